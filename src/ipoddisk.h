@@ -13,10 +13,12 @@
 #include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/statvfs.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <gpod/itdb.h>
 
 #define UNUSED(x) ( (void)(x) )
@@ -27,27 +29,342 @@ typedef enum {
 	IPODDISK_NODE_ROOT,
 	IPODDISK_NODE_IPOD,
 	IPODDISK_NODE_DEFAULT,
-	IPODDISK_NODE_LEAF
+	IPODDISK_NODE_LEAF,
+	IPODDISK_NODE_SEARCH,   /* children are queries, see ipoddisk_search.c */
+	IPODDISK_NODE_MANIFEST, /* lists its directory, see ipoddisk_manifest.c */
+	IPODDISK_NODE_RESULT    /* tracks matching a query, see ipoddisk_query */
 } ipoddisk_node_type;
 
+/* Leaves and manifests are files, all other nodes directories */
+#define IPODDISK_NODE_IS_FILE(node) \
+        ((node)->nd_type == IPODDISK_NODE_LEAF || \
+         (node)->nd_type == IPODDISK_NODE_MANIFEST)
+
+#define IPODDISK_MAX_IPOD       16
+
+/* Mount table iPods are found in, and whose changes attach and detach
+ * them, see ipoddisk_rescan_ipods */
+#ifndef IPODDISK_MOUNTINFO
+#define IPODDISK_MOUNTINFO      "/proc/self/mountinfo"
+#endif
+
+/* Unit of track data that is read ahead and cached, see
+ * ipoddisk_readahead.c and ipoddisk_bcache.c */
+#define IPODDISK_BLOCK          (128 * 1024)
+
+/* Memory that lives and dies with a tree, see ipoddisk_arena.c. Not
+ * thread-safe: the thread building a tree allocates from it alone until
+ * the tree is published. After that, the ipod_arena of an iPod still
+ * grows with its views, manifest texts, search index and search results,
+ * always under its ipod_view_lock, as does the arena of each search
+ * result. */
+struct ipoddisk_arena_chunk;
+struct ipoddisk_arena {
+        struct ipoddisk_arena_chunk *ar_chunks;
+        char                        *ar_cur;       /* free space of the */
+        size_t                       ar_left;      /* current chunk */
+        char                        *ar_last;      /* latest allocation */
+        size_t                       ar_nextsize;  /* size of next chunk */
+        size_t                       ar_bytes;     /* total of all chunks */
+};
+
+/* States of ipoddisk_tracks.tt_checked */
+enum {
+        IPODDISK_TRACK_UNCHECKED,
+        IPODDISK_TRACK_CHECKING,
+        IPODDISK_TRACK_CHECKED
+};
+
+/* What the filesystem keeps of the tracks of an iPod, one array per
+ * field so that the libgpod database can go once the tree is built.
+ * Leaves refer to their track by index. */
+struct ipoddisk_tracks {
+        guint          tt_count;
+        gchar        **tt_path;     /* relative to ipod_mp, starts with '/' */
+        /* attributes served by getattr; taken from iTunesDB until the
+         * real file has been opened once, see ipoddisk_track_check */
+        off_t         *tt_size;
+        time_t        *tt_mtime;
+        off_t         *tt_fsize;
+        time_t        *tt_fmtime;
+        volatile gint *tt_checked;
+        /* names, NULL if iTunesDB has none; what views are built from */
+        gchar        **tt_title;
+        gchar        **tt_album;
+        gchar        **tt_artist;
+        gchar        **tt_genre;
+        guint8        *tt_compilation;
+        /* sort keys */
+        guint16       *tt_track_nr;
+        guint16       *tt_cd_nr;
+        guint16       *tt_year;
+        time_t        *tt_added;
+        guint32       *tt_length;    /* in ms, 0 if unknown */
+        /* what smart views rank by */
+        time_t        *tt_played;    /* last played, 0 if never */
+        guint32       *tt_playcount;
+        guint8        *tt_rating;    /* stars * 20 */
+        struct ipoddisk_node **tt_leaf;  /* leaf under Artists */
+};
+
+/* A playlist, the master playlist aside */
+struct ipoddisk_playlist {
+        gchar *pl_name;
+        guint  pl_ntracks;
+        guint *pl_tracks;  /* indexes into the track table, in order */
+};
+
+/* Top-level directories whose contents are built on first use */
+typedef enum {
+        IPODDISK_VIEW_NONE,
+        IPODDISK_VIEW_GENRES,
+        IPODDISK_VIEW_ALBUMS,
+        IPODDISK_VIEW_PLAYLISTS,
+        IPODDISK_VIEW_COMPILATIONS,
+        /* smart views: the first smart_size tracks in some order */
+        IPODDISK_VIEW_RECENT,
+        IPODDISK_VIEW_MOST_PLAYED,
+        IPODDISK_VIEW_TOP_RATED
+} ipoddisk_view_type;
+
+/* A counter any thread adds to without a lock, with ipoddisk_count; read
+ * it with ipoddisk_count_get. Without 64-bit atomics, as on 32-bit
+ * PowerPC, it is kept in two 32-bit words, see ipoddisk_stats.c */
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+typedef volatile guint64 ipoddisk_counter;
+#else
+typedef struct {
+        volatile gint c_low;          /* the low 31 bits, then the parity
+                                         of c_high */
+        volatile gint c_high;         /* carries out of the low 31 bits */
+} ipoddisk_counter;
+#endif
+
+/* Readahead counters, in reads served; see ipoddisk_readahead.c */
+struct ipoddisk_ra_stats {
+        ipoddisk_counter ra_hits;     /* served from readahead blocks */
+        ipoddisk_counter ra_waits;    /* ... after waiting for one in flight */
+        ipoddisk_counter ra_misses;   /* sequential reads that went to disk */
+        ipoddisk_counter ra_blocks;   /* blocks read ahead */
+};
+
+/* Path lookup counters of the high-level backend; see
+ * ipoddisk_parse_path */
+struct ipoddisk_path_stats {
+        ipoddisk_counter ps_hits;     /* found in the path index */
+        ipoddisk_counter ps_misses;   /* known to be missing, not walked */
+        ipoddisk_counter ps_walks;    /* resolved by walking the tree */
+};
+
+/* Block cache counters, in block lookups; see ipoddisk_bcache.c */
+struct ipoddisk_bc_stats {
+        ipoddisk_counter bc_hits;
+        ipoddisk_counter bc_misses;
+        ipoddisk_counter bc_evictions;
+};
+
+/* What is counted and timed, see ipoddisk_stats.c. TREE and DEVICE
+ * are parts of the others: resolving names to nodes, and I/O on the
+ * iPods. */
+typedef enum {
+        IPODDISK_OP_GETATTR,
+        IPODDISK_OP_LOOKUP,     /* low-level backend only */
+        IPODDISK_OP_READDIR,
+        IPODDISK_OP_OPEN,
+        IPODDISK_OP_READ,
+        IPODDISK_OP_STATFS,
+        IPODDISK_OP_TREE,
+        IPODDISK_OP_DEVICE,
+        IPODDISK_OP_MAX
+} ipoddisk_op_type;
+
+/* The stats file, /.ipoddisk/stats within the mount */
+#define IPODDISK_STATS_DIR      ".ipoddisk"
+#define IPODDISK_STATS_FILE     "stats"
+
+/* Manifests every directory of tracks has, listing them in order */
+typedef enum {
+        IPODDISK_MANIFEST_M3U8,
+        IPODDISK_MANIFEST_JSON
+} ipoddisk_manifest_type;
+
+#define IPODDISK_M3U8_NAME      "Tracks.m3u8"
+#define IPODDISK_JSON_NAME      "Tracks.json"
+
+/* A manifest node, see ipoddisk_manifest.c. Its size is worked out on
+ * the first getattr and its text on the first open; both are kept, in
+ * the arena of the subtree or search result, for as long as that
+ * lives. */
+struct ipoddisk_manifest {
+        struct ipoddisk_ipod   *mf_ipod;
+        struct ipoddisk_node   *mf_dir;     /* directory it lists */
+        struct ipoddisk_arena  *mf_arena;   /* where its text goes */
+        ipoddisk_manifest_type  mf_type;
+        gboolean                mf_album;   /* in disc and track order, not
+                                               in directory order */
+        volatile gint           mf_sized;   /* mf_size is set */
+        gsize                   mf_size;
+        gchar                  *mf_text;    /* NULL until first opened */
+};
+
+/* Word index of the tracks of an iPod, see ipoddisk_search.c. Lives in
+ * the arena of the subtree. */
+struct ipoddisk_search {
+        guint   sr_ntokens;
+        gchar **sr_tokens;      /* sorted, case-folded, without accents */
+        guint  *sr_npostings;
+        guint **sr_postings;    /* ascending track indices, per token */
+};
+
+/* The directory of tracks matching a query in a Search directory, see
+ * ipoddisk_search_node. Results live in an arena of their own, so that
+ * they can be let go of one by one: the iPod keeps the ones used last,
+ * and others are freed once nothing holds them. Refcounted: the cache
+ * of its iPod holds a reference while it is cached, as does each node
+ * of it returned by a lookup until released (see ipoddisk_node_hold),
+ * and each open file, open directory and low-level inode on it. */
+struct ipoddisk_query {
+        gchar                 *q_key;
+        struct ipoddisk_ipod  *q_ipod;
+        struct ipoddisk_node  *q_node;     /* the RESULT node */
+        struct ipoddisk_arena *q_arena;    /* all of the above, this too */
+        volatile gint          q_refs;
+        volatile gint          q_used;     /* held since last passed over
+                                              for eviction */
+        volatile gint          q_evicted;  /* no longer cached */
+        struct ipoddisk_query *q_prev;     /* LRU list of the cache, under */
+        struct ipoddisk_query *q_next;     /* ipod_view_lock */
+};
+
+/* An iPod and its subtree. Refcounted: each tree containing it holds a
+ * reference, as does each busy fd on one of its tracks. */
 struct ipoddisk_ipod {
         gchar         *ipod_mp; /* mount point */
-        Itdb_iTunesDB *ipod_itdb;
+        gchar         *ipod_dbpath;
+        off_t          ipod_dbsize;    /* iTunesDB the subtree was built from */
+        time_t         ipod_dbmtime;
+        off_t          ipod_pendsize;  /* changed iTunesDB seen by the last */
+        time_t         ipod_pendmtime; /* reload check, see ipoddisk_reload_ipods */
+        guint64        ipod_dbhash;    /* see ipoddisk_snapshot_hash; 0 with
+                                          -o nosnapshot */
+        int            ipod_dbfd;
+        struct ipoddisk_node  *ipod_node;  /* the IPOD node */
+        struct ipoddisk_tracks ipod_tracks;
+        struct ipoddisk_playlist *ipod_playlists;
+        guint          ipod_nplaylists;
+        /* serializes building views, see ipoddisk_node_dir, searches
+         * and manifests */
+        pthread_mutex_t ipod_view_lock;
+        /* built on first search */
+        struct ipoddisk_search *ipod_search;
+        GHashTable    *ipod_queries;   /* query -> struct ipoddisk_query */
+        struct ipoddisk_query *ipod_query_head;  /* used last */
+        struct ipoddisk_query *ipod_query_tail;  /* next to be evicted */
+        /* nodes, child tables, names and the track table of the
+         * subtree, this struct included; released as a whole */
+        struct ipoddisk_arena *ipod_arena;
+        /* while building: every other node, for the snapshot, and
+         * room for making up names */
+        GPtrArray     *ipod_nodes;
+        GString       *ipod_scratch;
+        /* subtree loaded from a snapshot: names and track paths point
+         * into the mapping */
+        void          *ipod_snap;
+        size_t         ipod_snapsize;
+        volatile gint  ipod_refs;
 };
 
 struct ipoddisk_track {
         struct ipoddisk_ipod *trk_ipod;
+        guint                 trk_index;  /* into trk_ipod->ipod_tracks */
+};
+
+/* A directory node of a view not built yet, see ipoddisk_view_type */
+struct ipoddisk_view {
+        struct ipoddisk_ipod *vw_ipod;
+        volatile gint         vw_pending;  /* view to build, NONE once built */
 };
 
+struct ipoddisk_dirent {
+        gchar                *de_name;
+        guint                 de_hash;
+        guint                 de_ndup;  /* last N used for "(N) de_name" */
+        struct ipoddisk_node *de_node;
+};
+
+/* Children of a directory node. Entries are kept in insertion order for
+ * readdir; directories with more than a handful of entries also get an
+ * open-addressed index for lookups. */
+struct ipoddisk_dir {
+        struct ipoddisk_dirent *dir_ents;
+        guint                   dir_nents;
+        guint                   dir_size;   /* allocated entries */
+        guint                  *dir_slots;  /* 1 + index into dir_ents, 0 if free */
+        guint                   dir_mask;   /* number of slots - 1 */
+};
+
+/* Nodes are read-only once their tree is published, so FUSE ops walk
+ * them without locking. What changes later is tt_checked of tracks, and
+ * the children of views, which are added once under ipod_view_lock
+ * before vw_pending is cleared. Go through ipoddisk_node_dir to get at
+ * the children of a directory. SEARCH nodes have no children of their
+ * own; ipoddisk_get_child runs the query named instead. Nodes of search
+ * results, unlike all others, can go away while their tree lives, see
+ * ipoddisk_node_hold. */
 struct ipoddisk_node {
-	GData              *nd_children;
+	struct ipoddisk_dir nd_children;
 	ipoddisk_node_type  nd_type;
         union {
-                struct ipoddisk_ipod  ipod;
+                struct ipoddisk_ipod *ipod;  /* IPOD and SEARCH nodes; in
+                                                the subtree's arena */
                 struct ipoddisk_track track;
+                struct ipoddisk_view  view;   /* DEFAULT nodes only */
+                struct ipoddisk_manifest *manifest;
+                struct ipoddisk_query *query;  /* RESULT nodes */
         } nd_data;
 };
 
+/* Backing fd of a track, shared by all opens of it */
+struct ipoddisk_fd {
+        struct ipoddisk_node *fd_node;
+        struct ipoddisk_ipod *fd_ipod;  /* referenced while fd_refs > 0 */
+        int                   fd_fd;
+        int                   fd_refs;  /* opens currently using it */
+        struct ipoddisk_fd   *fd_prev;  /* LRU list of idle fds */
+        struct ipoddisk_fd   *fd_next;
+};
+
+/* A track or manifest opened through FUSE, one per open(2) */
+struct ipoddisk_ra_block;
+struct ipoddisk_file {
+        struct ipoddisk_fd       *fl_fd;
+        pthread_mutex_t           fl_lock;
+        pthread_cond_t            fl_cond;     /* a block was read */
+        off_t                     fl_next;     /* where a sequential read starts */
+        guint                     fl_seq;      /* sequential reads in a row */
+        /* readahead ring, set up on the first sequential read */
+        struct ipoddisk_ra_block *fl_blocks;
+        guint                     fl_nblocks;
+        int                       fl_jobs;     /* blocks being read ahead */
+        int                       fl_closed;
+        /* a manifest rather than a track: fl_fd is NULL, and the
+         * subtree is pinned by the file itself */
+        struct ipoddisk_node     *fl_manifest;
+};
+
+/* One published version of the whole filesystem. FUSE ops hold a
+ * reference for their duration, see ipoddisk_tree_get. */
+struct ipoddisk_tree {
+        volatile gint         tr_refs;
+        struct ipoddisk_node *tr_root;
+        struct ipoddisk_arena *tr_arena;  /* ROOT node, if any */
+        int                   tr_nipods;
+        struct ipoddisk_node *tr_ipods[IPODDISK_MAX_IPOD];
+        pthread_rwlock_t      tr_path_lock;
+        GHashTable           *tr_paths;   /* full path -> node */
+        GHashTable           *tr_misses;  /* full paths that don't exist */
+};
+
 struct __add_playlist_member_arg {
 	int nr;
 	gchar const *format;
@@ -55,12 +372,134 @@ struct __add_playlist_member_arg {
         struct ipoddisk_ipod *ipod;
 };
 
+/* Mount options, see ipoddisk_fuse_opts */
+struct ipoddisk_options {
+        int          lstat;            /* -o attr_lstat: lstat tracks on every getattr */
+        unsigned int reload_interval;  /* -o reload_interval=N: seconds between
+                                          iTunesDB checks, 0 disables reload
+                                          and hotplug */
+        int          nosnapshot;       /* -o nosnapshot: always parse iTunesDB */
+        char        *snapshot_dir;     /* -o snapshot_dir=DIR: where to keep
+                                          tree snapshots */
+        unsigned int readahead;        /* -o readahead=KB: window for sequential
+                                          reads, 0 disables readahead */
+        unsigned int readahead_threads; /* -o readahead_threads=N */
+        unsigned int cache;            /* -o cache=MB: track data kept in
+                                          memory, 0 disables the cache */
+        int          nosplice;         /* -o nosplice: copy track data through
+                                          ipoddisk instead of handing the
+                                          kernel the iPod file */
+        int          lowlevel;         /* -o lowlevel: serve requests through
+                                          the low-level FUSE API */
+        unsigned int smart_size;       /* -o smart_size=N: tracks listed in
+                                          Recently Added and the other smart
+                                          views */
+        int          nohold;           /* -o nohold: keep no fds open on an
+                                          iPod between uses, so that it can
+                                          be unmounted while mounted here */
+};
+
 extern gchar *mount_point;
+extern struct ipoddisk_options ipoddisk_opts;
+extern struct ipoddisk_ra_stats ipoddisk_ra_stats;
+extern struct ipoddisk_bc_stats ipoddisk_bc_stats;
+extern struct ipoddisk_path_stats ipoddisk_path_stats;
 
 int ipoddisk_init_ipods (void);
-int ipoddisk_statipods (struct statvfs *stbuf);
-struct ipoddisk_node *ipoddisk_parse_path (const char *path, int len);
+int ipoddisk_init_ipods_at (gchar **mps, int nmp);
+int ipoddisk_reload_ipods (void);
+int ipoddisk_rescan_ipods (void);
+gboolean ipoddisk_rescan_pending (void);
+void ipoddisk_foreach_dbpath (void (*fn) (const gchar *dbpath, gpointer arg),
+                              gpointer arg);
+int ipoddisk_statipods (struct ipoddisk_tree *tree, struct statvfs *stbuf);
+struct ipoddisk_tree *ipoddisk_tree_get (void);
+void ipoddisk_tree_put (struct ipoddisk_tree *tree);
+void ipoddisk_tree_notify (void (*fn) (struct ipoddisk_tree *old,
+                                       struct ipoddisk_tree *tree));
+void ipoddisk_ipod_ref (struct ipoddisk_ipod *ipod);
+void ipoddisk_ipod_unref (struct ipoddisk_ipod *ipod);
+struct ipoddisk_node *ipoddisk_parse_path (struct ipoddisk_tree *tree,
+                                           const char *path, int len);
+struct ipoddisk_node *ipoddisk_get_child (struct ipoddisk_node *parent,
+                                          const char *name, size_t len);
+void ipoddisk_node_hold (struct ipoddisk_node *node);
+void ipoddisk_node_release (struct ipoddisk_node *node);
+struct ipoddisk_dir *ipoddisk_node_dir (struct ipoddisk_node *node);
+void ipoddisk_dir_index (struct ipoddisk_arena *arena, struct ipoddisk_dir *dir);
 gchar *ipoddisk_node_path (struct ipoddisk_node *node);
+long ipoddisk_maxrss (void);
+double ipoddisk_now (void);
+
+struct ipoddisk_arena *ipoddisk_arena_new (void);
+struct ipoddisk_arena *ipoddisk_arena_new_sized (size_t size);
+void *ipoddisk_arena_alloc (struct ipoddisk_arena *arena, size_t size);
+void *ipoddisk_arena_grow (struct ipoddisk_arena *arena, void *ptr,
+                           size_t oldsize, size_t newsize);
+gchar *ipoddisk_arena_strdup (struct ipoddisk_arena *arena, const gchar *str);
+void ipoddisk_arena_free (struct ipoddisk_arena *arena);
+
+int  ipoddisk_fd_get (struct ipoddisk_node *node, struct ipoddisk_fd **fdp);
+void ipoddisk_fd_put (struct ipoddisk_fd *fd);
+void ipoddisk_fd_purge (struct ipoddisk_ipod *ipod);
+void ipoddisk_watch_start (void);
+
+void ipoddisk_node_stat (struct ipoddisk_node *node, struct stat *stbuf);
+int  ipoddisk_node_getattr (struct ipoddisk_node *node, struct stat *stbuf);
+void ipoddisk_stats_stat (int isdir, struct stat *stbuf);
+void ipoddisk_start (void);
+void ipoddisk_stop (void);
+
+struct fuse_args;
+int  ipoddisk_ll_main (struct fuse_args *args);
+
+int  ipoddisk_file_open (struct ipoddisk_node *node,
+                         struct ipoddisk_file **filep);
+ssize_t ipoddisk_file_read (struct ipoddisk_file *file, char *buf,
+                            size_t size, off_t off);
+size_t ipoddisk_file_read_cached (struct ipoddisk_file *file, char *buf,
+                                  size_t size, off_t off);
+void ipoddisk_file_close (struct ipoddisk_file *file);
+void ipoddisk_ra_start (void);
+
+void ipoddisk_bc_init (void);
+size_t ipoddisk_bc_read (struct ipoddisk_node *node, char *buf,
+                         size_t size, off_t off);
+int  ipoddisk_bc_contains (struct ipoddisk_node *node, off_t off);
+void ipoddisk_bc_insert (struct ipoddisk_node *node, off_t off,
+                         const char *data, size_t len);
+void ipoddisk_bc_purge (struct ipoddisk_ipod *ipod);
+
+void    ipoddisk_count (ipoddisk_counter *counter);
+guint64 ipoddisk_count_get (ipoddisk_counter *counter);
+guint64 ipoddisk_stats_clock (void);
+void ipoddisk_stats_add (ipoddisk_op_type op, guint64 start);
+GString *ipoddisk_stats_text (void);
+size_t ipoddisk_stats_read (GString *text, char *buf, size_t size, off_t off);
+void ipoddisk_stats_init (void);
+void ipoddisk_stats_start (void);
+
+guint64 ipoddisk_snapshot_hash (const gchar *dbfile);
+struct ipoddisk_node *ipoddisk_snapshot_load (const gchar *mp, off_t dbsize,
+                                              time_t dbmtime, guint64 dbhash);
+void ipoddisk_snapshot_save (struct ipoddisk_node *ipodnode);
+void ipoddisk_snapshot_free (struct ipoddisk_ipod *ipod);
+
+void ipoddisk_search_build (struct ipoddisk_ipod *ipod);
+GArray *ipoddisk_search_run (struct ipoddisk_ipod *ipod,
+                             const char *query, size_t len);
+
+gsize ipoddisk_manifest_size (struct ipoddisk_node *node);
+const gchar *ipoddisk_manifest_text (struct ipoddisk_node *node);
+size_t ipoddisk_manifest_read (struct ipoddisk_node *node, char *buf,
+                               size_t size, off_t off);
+
+void ipoddisk_track_check (struct ipoddisk_node *node, int fd);
+void ipoddisk_track_attr (struct ipoddisk_node *node,
+                          off_t *size, time_t *mtime);
+gboolean ipoddisk_track_checked (struct ipoddisk_node *node);
+void ipoddisk_tracks_alloc (struct ipoddisk_arena *arena,
+                            struct ipoddisk_tracks *tracks, guint count);
 
 
 #endif /* __IPODDISK_H */
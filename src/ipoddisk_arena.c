@@ -0,0 +1,148 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Bump allocator for everything that lives exactly as long as a tree:
+ * nodes, child tables and names. Memory comes from a few large chunks,
+ * is handed out zeroed, and is only ever released all at once.
+ */
+
+#include "ipoddisk.h"
+
+#define IPODDISK_ARENA_ALIGN     8
+#define IPODDISK_ARENA_MIN_CHUNK (64 * 1024)  /* first chunk, by default */
+#define IPODDISK_ARENA_MAX_CHUNK (4 * 1024 * 1024)
+
+#define ARENA_ROUND(n) (((n) + IPODDISK_ARENA_ALIGN - 1) & \
+                        ~(size_t) (IPODDISK_ARENA_ALIGN - 1))
+
+struct ipoddisk_arena_chunk {
+        struct ipoddisk_arena_chunk *ac_next;
+        size_t                       ac_size;
+        /* data follows, aligned by the padding below */
+        double                       ac_data[1];
+};
+
+struct ipoddisk_arena *
+ipoddisk_arena_new (void)
+{
+        return ipoddisk_arena_new_sized(IPODDISK_ARENA_MIN_CHUNK);
+}
+
+/**
+ * Makes an arena whose first chunk is size bytes, for things that are
+ * many and usually small, such as search results
+ */
+struct ipoddisk_arena *
+ipoddisk_arena_new_sized (size_t size)
+{
+        struct ipoddisk_arena *arena = g_slice_new0(struct ipoddisk_arena);
+
+        arena->ar_nextsize = ARENA_ROUND(size);
+        return arena;
+}
+
+static struct ipoddisk_arena_chunk *
+ipoddisk_arena_chunk (struct ipoddisk_arena *arena, size_t size)
+{
+        struct ipoddisk_arena_chunk *chunk;
+
+        chunk = g_malloc0(G_STRUCT_OFFSET(struct ipoddisk_arena_chunk,
+                                          ac_data) + size);
+        chunk->ac_size   = size;
+        chunk->ac_next   = arena->ar_chunks;
+        arena->ar_chunks = chunk;
+        arena->ar_bytes += size;
+
+        return chunk;
+}
+
+/**
+ * Allocates zeroed memory that stays valid until ipoddisk_arena_free
+ */
+void *
+ipoddisk_arena_alloc (struct ipoddisk_arena *arena, size_t size)
+{
+        struct ipoddisk_arena_chunk *chunk;
+        char                        *p;
+
+        size = ARENA_ROUND(size ? size : 1);
+
+        if (size > arena->ar_left) {
+                size_t csize = arena->ar_nextsize;
+
+                /* big blocks get a chunk of their own, so that the
+                 * rest of the current chunk isn't wasted */
+                if (size > csize / 4) {
+                        chunk = ipoddisk_arena_chunk(arena, size);
+                        return chunk->ac_data;
+                }
+
+                chunk = ipoddisk_arena_chunk(arena, csize);
+                arena->ar_cur   = (char *) chunk->ac_data;
+                arena->ar_left  = csize;
+                arena->ar_nextsize = MIN(csize * 2, IPODDISK_ARENA_MAX_CHUNK);
+        }
+
+        p = arena->ar_cur;
+        arena->ar_cur  += size;
+        arena->ar_left -= size;
+        arena->ar_last  = p;
+
+        return p;
+}
+
+/**
+ * Resizes an arena block, in place if it is the latest allocation. The
+ * old block is otherwise left behind until the arena goes.
+ */
+void *
+ipoddisk_arena_grow (struct ipoddisk_arena *arena, void *ptr,
+                     size_t oldsize, size_t newsize)
+{
+        void *p;
+
+        if (ptr != NULL && ptr == arena->ar_last) {
+                size_t oldr = ARENA_ROUND(oldsize ? oldsize : 1);
+                size_t newr = ARENA_ROUND(newsize);
+
+                if (newr <= oldr + arena->ar_left) {
+                        arena->ar_cur  += newr - oldr;
+                        arena->ar_left -= newr - oldr;
+                        return ptr;
+                }
+        }
+
+        p = ipoddisk_arena_alloc(arena, newsize);
+        if (ptr != NULL)
+                memcpy(p, ptr, MIN(oldsize, newsize));
+
+        return p;
+}
+
+gchar *
+ipoddisk_arena_strdup (struct ipoddisk_arena *arena, const gchar *str)
+{
+        size_t  len = strlen(str);
+        gchar  *p;
+
+        p = ipoddisk_arena_alloc(arena, len + 1);
+        memcpy(p, str, len + 1);
+
+        return p;
+}
+
+void
+ipoddisk_arena_free (struct ipoddisk_arena *arena)
+{
+        struct ipoddisk_arena_chunk *chunk;
+
+        while ((chunk = arena->ar_chunks) != NULL) {
+                arena->ar_chunks = chunk->ac_next;
+                g_free(chunk);
+        }
+        g_slice_free(struct ipoddisk_arena, arena);
+
+        return;
+}
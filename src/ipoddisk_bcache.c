@@ -0,0 +1,232 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Cache of track data shared by all opens. A track shows up under
+ * Artists, Albums, Genres, Compilations and any number of playlists,
+ * all as the same track of the same iPod, so blocks are keyed by track
+ * rather than by path and whatever one alias read is there for the
+ * others. Blocks are evicted with the CLOCK algorithm: a block that was
+ * hit since the hand last passed gets another round.
+ */
+
+#include "ipoddisk.h"
+
+struct ipoddisk_bc_slot {
+        struct ipoddisk_ipod *bs_ipod;  /* NULL while the slot is free */
+        guint                 bs_track;
+        off_t                 bs_block; /* offset / IPODDISK_BLOCK */
+        size_t                bs_len;   /* short at the end of a track */
+        int                   bs_ref;   /* hit since the hand passed */
+        char                 *bs_data;  /* allocated on first use */
+};
+
+struct ipoddisk_bc_stats ipoddisk_bc_stats;
+
+static pthread_mutex_t          bc_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable              *bc_table;  /* slot -> slot, by key */
+static struct ipoddisk_bc_slot *bc_slots;
+static guint                    bc_nslots;
+static guint                    bc_hand;
+
+static guint
+ipoddisk_bc_hash (gconstpointer key)
+{
+        const struct ipoddisk_bc_slot *slot = key;
+
+        return GPOINTER_TO_UINT(slot->bs_ipod) ^
+               slot->bs_track * 2654435761U ^
+               (guint) slot->bs_block * 40503U;
+}
+
+static gboolean
+ipoddisk_bc_equal (gconstpointer a, gconstpointer b)
+{
+        const struct ipoddisk_bc_slot *x = a;
+        const struct ipoddisk_bc_slot *y = b;
+
+        return x->bs_ipod == y->bs_ipod && x->bs_track == y->bs_track &&
+               x->bs_block == y->bs_block;
+}
+
+/* Finds the cached block of a track at off, called with bc_lock held */
+static struct ipoddisk_bc_slot *
+ipoddisk_bc_lookup (struct ipoddisk_node *node, off_t off)
+{
+        struct ipoddisk_bc_slot key;
+
+        assert (node->nd_type == IPODDISK_NODE_LEAF);
+
+        key.bs_ipod  = node->nd_data.track.trk_ipod;
+        key.bs_track = node->nd_data.track.trk_index;
+        key.bs_block = off / IPODDISK_BLOCK;
+
+        return g_hash_table_lookup(bc_table, &key);
+}
+
+/**
+ * Sets up a cache of ipoddisk_opts.cache MB, before any track is read
+ */
+void
+ipoddisk_bc_init (void)
+{
+        bc_nslots = (guint64) ipoddisk_opts.cache * 1024 * 1024 /
+                    IPODDISK_BLOCK;
+        if (bc_nslots == 0)
+                return;
+
+        bc_slots = g_new0(struct ipoddisk_bc_slot, bc_nslots);
+        bc_table = g_hash_table_new(ipoddisk_bc_hash, ipoddisk_bc_equal);
+
+        return;
+}
+
+/**
+ * Copies what the cache holds of a track's [off, off + size) into buf
+ * @return number of bytes copied from the start of the range
+ */
+size_t
+ipoddisk_bc_read (struct ipoddisk_node *node, char *buf, size_t size,
+                  off_t off)
+{
+        size_t done = 0;
+
+        if (bc_nslots == 0)
+                return 0;
+
+        pthread_mutex_lock(&bc_lock);
+        while (done < size) {
+                struct ipoddisk_bc_slot *slot;
+                size_t                   skip;
+                size_t                   n;
+
+                slot = ipoddisk_bc_lookup(node, off + done);
+                if (slot == NULL) {
+                        ipoddisk_count(&ipoddisk_bc_stats.bc_misses);
+                        break;
+                }
+                ipoddisk_count(&ipoddisk_bc_stats.bc_hits);
+                slot->bs_ref = 1;
+
+                skip = (off + done) % IPODDISK_BLOCK;
+                if (skip >= slot->bs_len)
+                        break;  /* end of file */
+
+                n = MIN(size - done, slot->bs_len - skip);
+                memcpy(buf + done, slot->bs_data + skip, n);
+                done += n;
+
+                if (slot->bs_len < IPODDISK_BLOCK)
+                        break;  /* end of file */
+        }
+        pthread_mutex_unlock(&bc_lock);
+
+        return done;
+}
+
+/**
+ * Tells whether the block of a track holding off is cached, without
+ * counting it as a hit or a miss
+ */
+int
+ipoddisk_bc_contains (struct ipoddisk_node *node, off_t off)
+{
+        int found;
+
+        if (bc_nslots == 0)
+                return 0;
+
+        pthread_mutex_lock(&bc_lock);
+        found = ipoddisk_bc_lookup(node, off) != NULL;
+        pthread_mutex_unlock(&bc_lock);
+
+        return found;
+}
+
+/**
+ * Caches a block of a track that was just read from the iPod
+ * @param off Offset of the block, a multiple of IPODDISK_BLOCK
+ * @param len Bytes in the block, less than IPODDISK_BLOCK only at the
+ *            end of the track
+ */
+void
+ipoddisk_bc_insert (struct ipoddisk_node *node, off_t off,
+                    const char *data, size_t len)
+{
+        struct ipoddisk_bc_slot *slot;
+
+        assert (off % IPODDISK_BLOCK == 0 && len <= IPODDISK_BLOCK);
+
+        if (bc_nslots == 0 || len == 0)
+                return;
+
+        pthread_mutex_lock(&bc_lock);
+
+        if (ipoddisk_bc_lookup(node, off) != NULL) {
+                /* another alias got there first */
+                pthread_mutex_unlock(&bc_lock);
+                return;
+        }
+
+        for (;;) {
+                slot    = &bc_slots[bc_hand];
+                bc_hand = (bc_hand + 1) % bc_nslots;
+
+                if (slot->bs_ipod == NULL)
+                        break;
+                if (slot->bs_ref) {
+                        slot->bs_ref = 0;
+                        continue;
+                }
+
+                g_hash_table_remove(bc_table, slot);
+                ipoddisk_count(&ipoddisk_bc_stats.bc_evictions);
+                break;
+        }
+
+        if (slot->bs_data == NULL)
+                slot->bs_data = g_malloc(IPODDISK_BLOCK);
+
+        slot->bs_ipod  = node->nd_data.track.trk_ipod;
+        slot->bs_track = node->nd_data.track.trk_index;
+        slot->bs_block = off / IPODDISK_BLOCK;
+        slot->bs_len   = len;
+        /* must be hit before the hand comes round to survive it, so a
+         * track played once doesn't push out the ones played often */
+        slot->bs_ref   = 0;
+        memcpy(slot->bs_data, data, len);
+        g_hash_table_insert(bc_table, slot, slot);
+
+        pthread_mutex_unlock(&bc_lock);
+
+        return;
+}
+
+/**
+ * Drops the cached blocks of an iPod whose subtree is going away. Its
+ * tracks may well be different ones after a reload.
+ */
+void
+ipoddisk_bc_purge (struct ipoddisk_ipod *ipod)
+{
+        guint i;
+
+        if (bc_nslots == 0)
+                return;
+
+        pthread_mutex_lock(&bc_lock);
+        for (i = 0; i < bc_nslots; i++) {
+                struct ipoddisk_bc_slot *slot = &bc_slots[i];
+
+                if (slot->bs_ipod != ipod)
+                        continue;
+
+                g_hash_table_remove(bc_table, slot);
+                slot->bs_ipod = NULL;
+                slot->bs_ref  = 0;
+        }
+        pthread_mutex_unlock(&bc_lock);
+
+        return;
+}
@@ -0,0 +1,1335 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Benchmarks for the tree and the read path that need no iPod. A fake
+ * iPod is generated in a temporary directory: an iTunesDB written with
+ * libgpod and a sparse media file for every track. It is then built,
+ * looked up, listed and read in-process, without FUSE, and each result
+ * is printed to stdout as a line of JSON so runs can be compared over
+ * releases. Progress and ipoddisk's own logging go to stderr. The iPod
+ * is generated by a child process, so that peak RSS figures are those
+ * of ipoddisk alone.
+ *
+ * Usage: ipoddisk_bench [-t tracks] [-a artists] [-l albums per artist]
+ *                       [-p playlists] [-s playlist size]
+ *                       [-c name collision %] [-u non-ASCII name %]
+ *                       [-m track size KiB] [-r tracks to read]
+ *                       [-x stress threads] [-n ops per thread]
+ *                       [-d dir] [-k]
+ *
+ * -c names some tracks like the one before them in their album, and
+ * some like a duplicate of it, "(2) Track 5"; the names benchmark
+ * checks that they get the names ipoddisk has always given them.
+ *
+ * Every track repeats the names of its artist and album, so few artists
+ * and many tracks, say -a 20 -t 50000, make a library of heavy name
+ * repetition; -u 0 and -u 100 then compare ASCII names with accented
+ * ones on the build benchmark.
+ *
+ * read_copy and read_splice compare the two ways FUSE can be handed
+ * track data, see ipoddisk_read_buf, on Linux where FUSE can splice.
+ *
+ * The stress test runs -x threads of lookups, searches and reads of
+ * tracks and manifests against the tree while another thread rebuilds
+ * it over and over, and checks what they find and read back. Any
+ * error fails the run; -x 0 skips it.
+ *
+ * The fake iPod goes in a new directory under $TMPDIR, removed at the
+ * end unless -k is given. One given with -d is never removed: it need
+ * not be empty, and -d /some/real/dir must not lose anything.
+ *
+ * Builds older than this benchmark, such as those before the path index
+ * and the track table, find iPods with getfsstat and so run on Mac OS X
+ * alone. Elsewhere, time their ipoddisk_parse_path in-process: keep a
+ * library,
+ *
+ *   ./ipoddisk_bench -t 50000 -a 2000 -m 4 -x 0 -d /tmp/fakepod -k
+ *
+ * then link the old ipoddisk_ipod.c, less its ipoddisk_init_ipods, with
+ * a main that builds the tree with ipoddisk_init_one_ipod on its
+ * iTunesDB, lists every path by walking nd_children with
+ * g_datalist_foreach, and resolves each as lookup_warm does. Feed the
+ * same paths to this build's ipoddisk_parse_path, whose tree has more
+ * views, to compare like with like. For memory, read VmRSS from
+ * /proc/self/status once each build is done: peak RSS is that of the
+ * parse in both.
+ *
+ * Builds that run on the machine can also be compared through FUSE.
+ * Generate the library onto a disk image, so that it is mounted from a
+ * disk device as an iPod would be. On Linux, where a loop device will
+ * do:
+ *
+ *   truncate -s 2G fakepod.img && mkfs.ext4 -q fakepod.img
+ *   mkdir fakepod && sudo mount -o loop fakepod.img fakepod
+ *   sudo chown `id -u` fakepod
+ *   ./ipoddisk_bench -t 50000 -a 2000 -m 4 -x 0 -d fakepod -k
+ *
+ * On Mac OS X, hdiutil create -size 2g -fs HFS+ -volname FakePod
+ * -attach fakepod and -d /Volumes/FakePod instead.
+ *
+ * Then, with each build in turn mounted on mnt:
+ *
+ *   find mnt > paths
+ *   time (tr '\n' '\0' < paths | xargs -0 stat > /dev/null)
+ *
+ * Lookups per second are the lines of paths over the time taken; mount
+ * with -o attr_timeout=0,entry_timeout=0,negative_timeout=0 so that every
+ * stat gets to ipoddisk rather than the kernel's cache. Resident memory
+ * of a build is that of the mounted daemon once find has been through
+ * every view, run in the foreground with -f:
+ *
+ *   ps -o rss= -p `pgrep -n ipoddisk`
+ *
+ * For builds with this benchmark, the peak_rss_kib of build is the same
+ * figure for the tree alone, without FUSE or views.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE     /* splice */
+#endif
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "ipoddisk.h"
+
+/* Music/Fxx directories, as on a real iPod */
+#define IPODDISK_BENCH_NDIRS    20
+
+/* The first tracks get a stamp every IPODDISK_BENCH_STAMP_EVERY bytes,
+ * so that the stress test can tell their bytes apart; the rest of each
+ * track, and all of the others, are zeros */
+#define IPODDISK_BENCH_STAMPED          64
+#define IPODDISK_BENCH_STAMP_EVERY      (64 * 1024)
+#define IPODDISK_BENCH_STAMP_SIZE       16
+
+/* Pause between rebuilds of the stress test, in us; every rebuild makes
+ * the readers build views and the search index over again */
+#define IPODDISK_BENCH_RELOAD_PAUSE     100000
+
+struct ipoddisk_options ipoddisk_opts;
+
+struct ipoddisk_bench_config {
+        guint    bc_tracks;
+        guint    bc_artists;
+        guint    bc_albums;      /* per artist */
+        guint    bc_playlists;
+        guint    bc_plsize;
+        guint    bc_collide;     /* % of tracks named like the previous */
+        guint    bc_unicode;     /* % of artists, albums and tracks with
+                                  * accented names */
+        guint    bc_tracksize;   /* KiB */
+        guint    bc_reads;       /* tracks read in the read benchmark */
+        guint    bc_threads;     /* of the stress test */
+        guint    bc_ops;         /* per thread of the stress test */
+        gchar   *bc_dir;
+        gboolean bc_made;        /* bc_dir was made here, by mkdtemp */
+        gboolean bc_keep;
+};
+
+static const gchar *ipoddisk_bench_genres[] = {
+        "Rock", "Pop", "Jazz", "Classical", "Hip-Hop", "Electronic",
+        "Folk", "Blues", "Metal", "Soundtrack", "Reggae", "Country"
+};
+
+static void
+ipoddisk_bench_result (const gchar *bench, const gchar *fmt, ...)
+{
+        va_list ap;
+
+        printf("{\"bench\": \"%s\"", bench);
+        if (fmt != NULL) {
+                printf(", ");
+                va_start(ap, fmt);
+                vprintf(fmt, ap);
+                va_end(ap);
+        }
+        printf("}\n");
+        fflush(stdout);
+
+        return;
+}
+
+/**
+ * Fills in the stamp of track i at off, a multiple of
+ * IPODDISK_BENCH_STAMP_EVERY
+ */
+static void
+ipoddisk_bench_stamp (guchar *stamp, guint i, off_t off)
+{
+        guint j;
+
+        for (j = 0; j < IPODDISK_BENCH_STAMP_SIZE; j++)
+                stamp[j] = (guchar) ((j < 8 ? (guint64) i >> (j * 8)
+                                            : (guint64) off >> ((j - 8) * 8))
+                                     ^ (0xa5 + j));
+        return;
+}
+
+/**
+ * Checks bytes read from [off, off + n) of track i
+ * @return TRUE if they are what ipoddisk_bench_generate wrote
+ */
+static gboolean
+ipoddisk_bench_stamped (guint i, const char *buf, size_t n, off_t off)
+{
+        guchar stamp[IPODDISK_BENCH_STAMP_SIZE];
+        off_t  at = -1;
+        size_t k;
+
+        for (k = 0; k < n; k++) {
+                off_t  pos = off + k;
+                off_t  base = pos - pos % IPODDISK_BENCH_STAMP_EVERY;
+                guchar want = 0;
+
+                if (i < IPODDISK_BENCH_STAMPED &&
+                    pos - base < IPODDISK_BENCH_STAMP_SIZE) {
+                        if (base != at) {
+                                ipoddisk_bench_stamp(stamp, i, base);
+                                at = base;
+                        }
+                        want = stamp[pos - base];
+                }
+                if ((guchar) buf[k] != want)
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/**
+ * Writes a fake iPod under cfg->bc_dir
+ * @return 0 on success, -1 otherwise
+ */
+static int
+ipoddisk_bench_generate (struct ipoddisk_bench_config *cfg)
+{
+        Itdb_iTunesDB  *itdb;
+        Itdb_Playlist  *mpl;
+        Itdb_Track    **tracks;
+        GRand          *rand;
+        GError         *err = NULL;
+        gchar          *path;
+        off_t           off;
+        guint           i;
+        guint           j;
+        int             rc = 0;
+
+        for (i = 0; i < IPODDISK_BENCH_NDIRS; i++) {
+                path = g_strdup_printf("%s/iPod_Control/Music/F%02u",
+                                       cfg->bc_dir, i);
+                g_mkdir_with_parents(path, 0755);
+                g_free(path);
+        }
+        path = g_strdup_printf("%s/iPod_Control/iTunes", cfg->bc_dir);
+        g_mkdir_with_parents(path, 0755);
+        g_free(path);
+
+        /* same seed every run, so runs are comparable */
+        rand   = g_rand_new_with_seed(1);
+        itdb   = itdb_new();
+        tracks = g_new(Itdb_Track *, cfg->bc_tracks);
+        itdb_set_mountpoint(itdb, cfg->bc_dir);
+
+        mpl = itdb_playlist_new("iPod", FALSE);
+        itdb_playlist_set_mpl(mpl);
+        itdb_playlist_add(itdb, mpl, -1);
+
+        for (i = 0; i < cfg->bc_tracks; i++) {
+                Itdb_Track *track = itdb_track_new();
+                guint       artist = i % cfg->bc_artists;
+                guint       album = i / cfg->bc_artists % cfg->bc_albums;
+                guint       prev = cfg->bc_artists * cfg->bc_albums;
+                int         fd;
+
+                /* the previous track of this album is prev back; some
+                 * tracks are titled "(k) title" like duplicates */
+                if (i >= prev &&
+                    (guint) g_rand_int_range(rand, 0, 100) < cfg->bc_collide)
+                        track->title = g_rand_int_range(rand, 0, 4) ?
+                                g_strdup(tracks[i - prev]->title) :
+                                g_strdup_printf("(%d) %s",
+                                        g_rand_int_range(rand, 1, 4),
+                                        tracks[i - prev]->title);
+                else if (i % 100 < cfg->bc_unicode)
+                        track->title = g_strdup_printf("Tr\xc3\xa4" "ck %u", i);
+                else
+                        track->title = g_strdup_printf("Track %u", i);
+
+                /* which names are accented must not depend on the
+                 * track, or an artist would have two names */
+                track->artist    = g_strdup_printf(
+                                        artist % 100 < cfg->bc_unicode ?
+                                        "\xc3\x81rtist %u" : "Artist %u",
+                                        artist);
+                track->album     = g_strdup_printf(
+                                        album % 100 < cfg->bc_unicode ?
+                                        "\xc3\x81lbum %u" : "Album %u",
+                                        album);
+                track->genre     = g_strdup(ipoddisk_bench_genres[
+                                        i % G_N_ELEMENTS(ipoddisk_bench_genres)]);
+                track->track_nr  = i / (cfg->bc_artists * cfg->bc_albums) + 1;
+                track->year      = 1960 + i % 60;
+                track->compilation = i % 50 == 0;
+                track->size      = cfg->bc_tracksize * 1024;
+                track->time_added = 1000000000 + i;
+                track->ipod_path = g_strdup_printf(
+                                        ":iPod_Control:Music:F%02u:T%u.mp3",
+                                        i % IPODDISK_BENCH_NDIRS, i);
+
+                itdb_track_add(itdb, track, -1);
+                itdb_playlist_add_track(mpl, track, -1);
+                tracks[i] = track;
+
+                /* sparse: reads measure ipoddisk, not the disk */
+                path = g_strdup_printf("%s/iPod_Control/Music/F%02u/T%u.mp3",
+                                       cfg->bc_dir, i % IPODDISK_BENCH_NDIRS,
+                                       i);
+                fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd == -1 || ftruncate(fd, track->size) == -1) {
+                        perror(path);
+                        rc = -1;
+                }
+                for (off = 0; fd != -1 && i < IPODDISK_BENCH_STAMPED &&
+                              off + IPODDISK_BENCH_STAMP_SIZE <= track->size;
+                     off += IPODDISK_BENCH_STAMP_EVERY) {
+                        guchar stamp[IPODDISK_BENCH_STAMP_SIZE];
+
+                        ipoddisk_bench_stamp(stamp, i, off);
+                        if (pwrite(fd, stamp, sizeof(stamp), off) !=
+                            sizeof(stamp)) {
+                                perror(path);
+                                rc = -1;
+                                break;
+                        }
+                }
+                if (fd != -1)
+                        close(fd);
+                g_free(path);
+        }
+
+        for (i = 0; i < cfg->bc_playlists; i++) {
+                Itdb_Playlist *pl;
+                gchar         *name;
+
+                name = g_strdup_printf("Playlist %u", i);
+                pl   = itdb_playlist_new(name, FALSE);
+                itdb_playlist_add(itdb, pl, -1);
+                g_free(name);
+
+                for (j = 0; j < cfg->bc_plsize; j++)
+                        itdb_playlist_add_track(pl, tracks[g_rand_int_range(
+                                        rand, 0, cfg->bc_tracks)], -1);
+        }
+
+        path = g_strdup_printf("%s/iPod_Control/iTunes/iTunesDB", cfg->bc_dir);
+        if (!itdb_write_file(itdb, path, &err)) {
+                fprintf(stderr, "failed to write %s: %s\n", path,
+                        err ? err->message : "unknown error");
+                g_clear_error(&err);
+                rc = -1;
+        }
+        g_free(path);
+
+        itdb_free(itdb);
+        g_free(tracks);
+        g_rand_free(rand);
+
+        return rc;
+}
+
+/**
+ * Runs ipoddisk_bench_generate in a child process. libgpod's copy of
+ * the library would otherwise stay in the peak RSS of this one, which
+ * the build benchmark reports.
+ * @return 0 on success, -1 otherwise
+ */
+static int
+ipoddisk_bench_generate_apart (struct ipoddisk_bench_config *cfg)
+{
+        pid_t pid;
+        int   status;
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid = fork();
+        if (pid == -1) {
+                perror("fork");
+                return -1;
+        }
+        if (pid == 0)
+                _exit(ipoddisk_bench_generate(cfg) == 0 ? 0 : 1);
+
+        while (waitpid(pid, &status, 0) == -1)
+                if (errno != EINTR) {
+                        perror("waitpid");
+                        return -1;
+                }
+
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * Builds the fake iPod and publishes it as the current tree
+ * @return seconds taken, or a negative number on failure
+ */
+static double
+ipoddisk_bench_build (struct ipoddisk_bench_config *cfg)
+{
+        double t = ipoddisk_now();
+
+        if (ipoddisk_init_ipods_at(&cfg->bc_dir, 1) != 0)
+                return -1;
+
+        return ipoddisk_now() - t;
+}
+
+/**
+ * Lists every directory below node as readdir does, attributes of
+ * tracks and manifests included, and collects the paths of all nodes
+ * @return number of entries listed
+ */
+static guint
+ipoddisk_bench_walk (struct ipoddisk_node *node, GString *path,
+                     GPtrArray *paths, GPtrArray *dirs)
+{
+        struct ipoddisk_dir *dir = ipoddisk_node_dir(node);
+        gsize                len = path->len;
+        guint                n = 0;
+        guint                i;
+
+        g_ptr_array_add(dirs, g_strdup(path->len ? path->str : "/"));
+
+        for (i = 0; i < dir->dir_nents; i++) {
+                struct ipoddisk_node *child = dir->dir_ents[i].de_node;
+
+                g_string_append_c(path, '/');
+                g_string_append(path, dir->dir_ents[i].de_name);
+                g_ptr_array_add(paths, g_strdup(path->str));
+                n++;
+
+                if (child->nd_type == IPODDISK_NODE_LEAF) {
+                        off_t  size;
+                        time_t mtime;
+
+                        ipoddisk_track_attr(child, &size, &mtime);
+                } else if (child->nd_type == IPODDISK_NODE_MANIFEST) {
+                        ipoddisk_manifest_size(child);
+                } else {
+                        n += ipoddisk_bench_walk(child, path, paths, dirs);
+                }
+                g_string_truncate(path, len);
+        }
+
+        return n;
+}
+
+/**
+ * Resolves every path once
+ * @return number of paths found
+ */
+static guint
+ipoddisk_bench_lookup (GPtrArray *paths, const gchar *suffix)
+{
+        struct ipoddisk_tree *tree = ipoddisk_tree_get();
+        GString              *probe = g_string_new(NULL);
+        struct ipoddisk_node *node;
+        guint                 found = 0;
+        guint                 i;
+
+        for (i = 0; i < paths->len; i++) {
+                const gchar *path = g_ptr_array_index(paths, i);
+
+                if (suffix != NULL) {
+                        g_string_assign(probe, path);
+                        g_string_append(probe, suffix);
+                        path = probe->str;
+                }
+                node = ipoddisk_parse_path(tree, path, strlen(path));
+                if (node != NULL) {
+                        ipoddisk_node_release(node);
+                        found++;
+                }
+        }
+
+        g_string_free(probe, TRUE);
+        ipoddisk_tree_put(tree);
+
+        return found;
+}
+
+/* Where ipoddisk_bench_read puts what it reads */
+typedef enum {
+        IPODDISK_BENCH_DROP,    /* nowhere */
+#ifdef __linux__
+        IPODDISK_BENCH_COPY,    /* into a pipe, as FUSE writes a buffer */
+        IPODDISK_BENCH_SPLICE   /* into a pipe, as FUSE splices an fd */
+#endif
+} ipoddisk_bench_sink;
+
+#ifdef __linux__
+/* A pipe emptied into /dev/null, standing in for /dev/fuse */
+struct ipoddisk_bench_pipe {
+        int    bp_fds[2];
+        int    bp_null;
+        size_t bp_size;     /* capacity */
+};
+
+static int
+ipoddisk_bench_pipe_open (struct ipoddisk_bench_pipe *bp)
+{
+        int size;
+
+        bp->bp_null = open("/dev/null", O_WRONLY);
+        if (bp->bp_null == -1) {
+                perror("/dev/null");
+                return -1;
+        }
+        if (pipe(bp->bp_fds) == -1) {
+                perror("pipe");
+                close(bp->bp_null);
+                return -1;
+        }
+
+        /* as big as a read, like the pipe libfuse splices through */
+        fcntl(bp->bp_fds[1], F_SETPIPE_SZ, IPODDISK_BLOCK);
+        size = fcntl(bp->bp_fds[1], F_GETPIPE_SZ);
+        bp->bp_size = size > 0 ? (size_t) size : 4096;
+
+        return 0;
+}
+
+static void
+ipoddisk_bench_pipe_close (struct ipoddisk_bench_pipe *bp)
+{
+        close(bp->bp_fds[0]);
+        close(bp->bp_fds[1]);
+        close(bp->bp_null);
+        return;
+}
+
+/**
+ * Empties n bytes out of the pipe, as the kernel takes a reply off
+ * /dev/fuse
+ */
+static int
+ipoddisk_bench_pipe_drain (struct ipoddisk_bench_pipe *bp, size_t n)
+{
+        ssize_t rc;
+
+        while (n > 0) {
+                rc = splice(bp->bp_fds[0], NULL, bp->bp_null, NULL, n, 0);
+                if (rc <= 0)
+                        return -1;
+                n -= rc;
+        }
+
+        return 0;
+}
+
+/**
+ * Hands a piece of a track on as FUSE would: memory is written into the
+ * pipe, the rest spliced from the fd of the track
+ * @return 0 on success, -1 otherwise
+ */
+static int
+ipoddisk_bench_pipe_put (struct ipoddisk_bench_pipe *bp, const char *mem,
+                         size_t n, int fd, off_t off)
+{
+        loff_t  pos = off;
+        ssize_t rc;
+
+        while (n > 0) {
+                if (mem != NULL)
+                        rc = write(bp->bp_fds[1], mem, MIN(n, bp->bp_size));
+                else
+                        rc = splice(fd, &pos, bp->bp_fds[1], NULL,
+                                    MIN(n, bp->bp_size), 0);
+                if (rc <= 0 || ipoddisk_bench_pipe_drain(bp, rc) != 0)
+                        return -1;
+                if (mem != NULL)
+                        mem += rc;
+                n -= rc;
+        }
+
+        return 0;
+}
+
+/**
+ * Reads size bytes at off the way ipoddisk_read_buf has FUSE do it:
+ * what is in memory is copied, the rest spliced
+ * @return bytes read, or -1 on failure
+ */
+static ssize_t
+ipoddisk_bench_read_spliced (struct ipoddisk_file *file, char *buf,
+                             size_t size, off_t off,
+                             struct ipoddisk_bench_pipe *bp)
+{
+        off_t  fsize;
+        time_t mtime;
+        size_t done;
+
+        /* FUSE knows the size from getattr and asks for no more */
+        ipoddisk_track_attr(file->fl_fd->fd_node, &fsize, &mtime);
+        if (off >= fsize)
+                return 0;
+        size = MIN(size, (size_t) (fsize - off));
+
+        done = ipoddisk_file_read_cached(file, buf, size, off);
+        if (ipoddisk_bench_pipe_put(bp, buf, done, -1, 0) != 0 ||
+            ipoddisk_bench_pipe_put(bp, NULL, size - done,
+                                    file->fl_fd->fd_fd, off + done) != 0)
+                return -1;
+
+        return size;
+}
+#endif
+
+/**
+ * Reads the first tracks under Artists from start to end, as a player
+ * would, in reads of the size FUSE uses
+ * @param sink What to do with the data
+ * @return bytes read, or -1 on failure
+ */
+static gint64
+ipoddisk_bench_read (GPtrArray *paths, guint ntracks, ipoddisk_bench_sink sink)
+{
+        struct ipoddisk_tree *tree = ipoddisk_tree_get();
+        char                 *buf = g_malloc(IPODDISK_BLOCK);
+        gint64                total = 0;
+        guint                 i;
+#ifdef __linux__
+        struct ipoddisk_bench_pipe bp;
+
+        if (sink != IPODDISK_BENCH_DROP && ipoddisk_bench_pipe_open(&bp) != 0) {
+                g_free(buf);
+                ipoddisk_tree_put(tree);
+                return -1;
+        }
+#endif
+
+        for (i = 0; i < paths->len && ntracks > 0; i++) {
+                struct ipoddisk_node *node;
+                struct ipoddisk_file *file;
+                const gchar          *path = g_ptr_array_index(paths, i);
+                off_t                 off = 0;
+                ssize_t               n;
+
+                if (!g_str_has_prefix(path, "/Artists/"))
+                        continue;
+                node = ipoddisk_parse_path(tree, path, strlen(path));
+                if (node == NULL)
+                        continue;
+                if (node->nd_type != IPODDISK_NODE_LEAF) {
+                        ipoddisk_node_release(node);
+                        continue;
+                }
+
+                if (ipoddisk_file_open(node, &file) != 0) {
+                        total = -1;
+                        break;
+                }
+                for (;;) {
+#ifdef __linux__
+                        if (sink == IPODDISK_BENCH_SPLICE) {
+                                n = ipoddisk_bench_read_spliced(file, buf,
+                                                                IPODDISK_BLOCK,
+                                                                off, &bp);
+                                if (n <= 0)
+                                        break;
+                                off += n;
+                                continue;
+                        }
+#endif
+                        n = ipoddisk_file_read(file, buf, IPODDISK_BLOCK, off);
+                        if (n <= 0)
+                                break;
+#ifdef __linux__
+                        if (sink == IPODDISK_BENCH_COPY &&
+                            ipoddisk_bench_pipe_put(&bp, buf, n, -1, 0) != 0) {
+                                n = -1;
+                                break;
+                        }
+#endif
+                        off += n;
+                }
+                ipoddisk_file_close(file);
+
+                if (n < 0) {
+                        total = -1;
+                        break;
+                }
+                total += off;
+                ntracks--;
+        }
+
+#ifdef __linux__
+        if (sink != IPODDISK_BENCH_DROP)
+                ipoddisk_bench_pipe_close(&bp);
+#endif
+        g_free(buf);
+        ipoddisk_tree_put(tree);
+
+        return total;
+}
+
+/**
+ * Names the tracks of a directory the way ipoddisk_add_child used to,
+ * probing "(1) name", "(2) name", ... from the start for each duplicate,
+ * and compares with the names they got
+ * @param ndups Incremented for each duplicate
+ * @return number of entries named differently
+ */
+static guint
+ipoddisk_bench_names_dir (struct ipoddisk_node *node, guint *ndups)
+{
+        struct ipoddisk_dir *dir = ipoddisk_node_dir(node);
+        GHashTable          *taken;
+        guint                wrong = 0;
+        guint                j;
+
+        taken = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+        for (j = 0; j < dir->dir_nents; j++) {
+                struct ipoddisk_dirent *de = &dir->dir_ents[j];
+                struct ipoddisk_tracks *tt;
+                gchar                  *key;
+                gchar                  *name;
+                guint                   i;
+                guint                   k;
+
+                if (de->de_node->nd_type != IPODDISK_NODE_LEAF) {
+                        g_hash_table_insert(taken, g_strdup(de->de_name),
+                                            GINT_TO_POINTER(1));
+                        continue;
+                }
+
+                /* as ipoddisk_append_track_name; all tracks are .mp3 */
+                tt  = &de->de_node->nd_data.track.trk_ipod->ipod_tracks;
+                i   = de->de_node->nd_data.track.trk_index;
+                key = g_strconcat(tt->tt_title[i] ? tt->tt_title[i]
+                                                  : "Unknown Track",
+                                  ".mp3", NULL);
+
+                name = g_strdup(key);
+                for (k = 1; g_hash_table_lookup(taken, name) != NULL; k++) {
+                        g_free(name);
+                        name = g_strdup_printf("(%d) %s", k, key);
+                }
+                if (k > 1)
+                        (*ndups)++;
+
+                if (strcmp(name, de->de_name) != 0) {
+                        if (wrong++ == 0)
+                                fprintf(stderr, "names: \"%s\" should be "
+                                                "\"%s\"\n", de->de_name, name);
+                }
+                g_hash_table_insert(taken, name, GINT_TO_POINTER(1));
+                g_free(key);
+        }
+
+        g_hash_table_destroy(taken);
+        return wrong;
+}
+
+/**
+ * Checks the names of the tracks of every album under Artists, where
+ * -c makes duplicates, and prints the result
+ * @return number of tracks named differently than they used to be
+ */
+static guint
+ipoddisk_bench_names (void)
+{
+        struct ipoddisk_tree *tree = ipoddisk_tree_get();
+        struct ipoddisk_node *artists;
+        struct ipoddisk_dir  *dir;
+        guint                 ndirs = 0;
+        guint                 ndups = 0;
+        guint                 wrong = 0;
+        guint                 i;
+        guint                 j;
+        double                t = ipoddisk_now();
+
+        artists = ipoddisk_parse_path(tree, "/Artists", strlen("/Artists"));
+        assert (artists != NULL);
+
+        dir = ipoddisk_node_dir(artists);
+        for (i = 0; i < dir->dir_nents; i++) {
+                struct ipoddisk_dir *albums;
+
+                if (IPODDISK_NODE_IS_FILE(dir->dir_ents[i].de_node))
+                        continue;
+                albums = ipoddisk_node_dir(dir->dir_ents[i].de_node);
+                for (j = 0; j < albums->dir_nents; j++) {
+                        struct ipoddisk_node *album = albums->dir_ents[j].de_node;
+
+                        if (album->nd_type != IPODDISK_NODE_DEFAULT)
+                                continue;
+                        wrong += ipoddisk_bench_names_dir(album, &ndups);
+                        ndirs++;
+                }
+        }
+        ipoddisk_node_release(artists);
+        ipoddisk_tree_put(tree);
+
+        ipoddisk_bench_result("names", "\"seconds\": %.6f, \"dirs\": %u, "
+                              "\"duplicates\": %u, \"wrong\": %u",
+                              ipoddisk_now() - t, ndirs, ndups, wrong);
+
+        return wrong;
+}
+
+/* Shared by the threads of the stress test */
+struct ipoddisk_bench_stress {
+        gchar         *bs_dir;
+        GPtrArray     *bs_paths;    /* of every node */
+        GPtrArray     *bs_tracks;   /* of the stamped tracks */
+        GArray        *bs_stamps;   /* guint, which track each of those is */
+        guint          bs_artists;
+        guint          bs_ops;
+        volatile gint  bs_done;     /* the readers are done */
+        volatile gint  bs_errors;
+        volatile gint  bs_reloads;
+        volatile gint  bs_reads;
+};
+
+/* A thread of the stress test */
+struct ipoddisk_bench_worker {
+        struct ipoddisk_bench_stress *bw_stress;
+        guint                         bw_seed;
+        pthread_t                     bw_thread;
+};
+
+static void
+ipoddisk_bench_stress_error (struct ipoddisk_bench_stress *bs,
+                             const gchar *path, const gchar *what)
+{
+        if (g_atomic_int_add(&bs->bs_errors, 1) < 10)
+                fprintf(stderr, "stress: %s: %s\n", path, what);
+        return;
+}
+
+/**
+ * Opens a file and reads it through, from a random offset on, checking
+ * every byte of stamped tracks and the length of manifests
+ * @param i Stamped track the file is, or -1 for a manifest
+ */
+static void
+ipoddisk_bench_stress_read (struct ipoddisk_bench_stress *bs,
+                            struct ipoddisk_tree *tree, const gchar *path,
+                            gint i, GRand *rand, char *buf)
+{
+        struct ipoddisk_node *node;
+        struct ipoddisk_file *file;
+        gsize                 size;
+        off_t                 off = 0;
+        ssize_t               n;
+
+        node = ipoddisk_parse_path(tree, path, strlen(path));
+        if (node == NULL) {
+                ipoddisk_bench_stress_error(bs, path, "not found");
+                return;
+        }
+        if (ipoddisk_file_open(node, &file) != 0) {
+                ipoddisk_bench_stress_error(bs, path, "open failed");
+                ipoddisk_node_release(node);
+                return;
+        }
+
+        if (i >= 0) {
+                off_t  fsize;
+                time_t mtime;
+
+                ipoddisk_track_attr(node, &fsize, &mtime);
+                size = fsize;
+                off  = g_rand_int_range(rand, 0, 4) * (size / 4);
+        } else {
+                size = ipoddisk_manifest_size(node);
+        }
+
+        while ((n = ipoddisk_file_read(file, buf, IPODDISK_BLOCK, off)) > 0) {
+                if (i >= 0 && !ipoddisk_bench_stamped(i, buf, n, off)) {
+                        ipoddisk_bench_stress_error(bs, path, "wrong data");
+                        break;
+                }
+                off += n;
+        }
+        if (n < 0)
+                ipoddisk_bench_stress_error(bs, path, "read failed");
+        else if (n == 0 && (gsize) off != size)
+                ipoddisk_bench_stress_error(bs, path, "wrong size");
+
+        ipoddisk_file_close(file);
+        ipoddisk_node_release(node);
+        g_atomic_int_inc(&bs->bs_reads);
+
+        return;
+}
+
+/**
+ * Looks up random paths, searches for random artists and reads random
+ * stamped tracks, each op against the tree current at the time
+ */
+static void *
+ipoddisk_bench_stress_reader (void *arg)
+{
+        struct ipoddisk_bench_worker *bw = arg;
+        struct ipoddisk_bench_stress *bs = bw->bw_stress;
+        GRand                        *rand = g_rand_new_with_seed(bw->bw_seed);
+        char                         *buf = g_malloc(IPODDISK_BLOCK);
+        gchar                        *query;
+        guint                         op;
+
+        for (op = 0; op < bs->bs_ops; op++) {
+                struct ipoddisk_tree *tree = ipoddisk_tree_get();
+                struct ipoddisk_node *node;
+                const gchar          *path;
+                guint                 k = g_rand_int_range(rand, 0, 100);
+
+                if (k < 2 && bs->bs_tracks->len > 0) {
+                        guint j = g_rand_int_range(rand, 0,
+                                                   bs->bs_tracks->len);
+
+                        ipoddisk_bench_stress_read(bs, tree,
+                                g_ptr_array_index(bs->bs_tracks, j),
+                                g_array_index(bs->bs_stamps, guint, j),
+                                rand, buf);
+                } else if (k < 12) {
+                        /* enough artists to keep evicting results */
+                        query = g_strdup_printf("/Search/artist %u/"
+                                                IPODDISK_M3U8_NAME,
+                                                g_rand_int_range(rand, 0,
+                                                        bs->bs_artists));
+                        ipoddisk_bench_stress_read(bs, tree, query, -1,
+                                                   rand, buf);
+                        g_free(query);
+                } else {
+                        path = g_ptr_array_index(bs->bs_paths,
+                                        g_rand_int_range(rand, 0,
+                                                bs->bs_paths->len));
+                        node = ipoddisk_parse_path(tree, path, strlen(path));
+                        if (node == NULL)
+                                ipoddisk_bench_stress_error(bs, path,
+                                                            "not found");
+                        else
+                                ipoddisk_node_release(node);
+                }
+
+                ipoddisk_tree_put(tree);
+        }
+
+        g_free(buf);
+        g_rand_free(rand);
+
+        return NULL;
+}
+
+/* Rebuilds the tree, and so replaces it, until the readers are done */
+static void *
+ipoddisk_bench_stress_reloader (void *arg)
+{
+        struct ipoddisk_bench_worker *bw = arg;
+        struct ipoddisk_bench_stress *bs = bw->bw_stress;
+
+        while (!g_atomic_int_get(&bs->bs_done)) {
+                if (ipoddisk_init_ipods_at(&bs->bs_dir, 1) != 0)
+                        ipoddisk_bench_stress_error(bs, bs->bs_dir,
+                                                    "reload failed");
+                g_atomic_int_inc(&bs->bs_reloads);
+                usleep(IPODDISK_BENCH_RELOAD_PAUSE);
+        }
+
+        return NULL;
+}
+
+/**
+ * Runs the stress test and prints its result
+ * @return number of errors found
+ */
+static guint
+ipoddisk_bench_stress (struct ipoddisk_bench_config *cfg, GPtrArray *paths)
+{
+        struct ipoddisk_bench_stress  bs;
+        struct ipoddisk_bench_worker *workers;
+        struct ipoddisk_bench_worker  reloader;
+        struct ipoddisk_tree         *tree;
+        double                        t;
+        guint                         i;
+
+        memset(&bs, 0, sizeof(bs));
+        bs.bs_dir     = cfg->bc_dir;
+        bs.bs_paths   = paths;
+        bs.bs_tracks  = g_ptr_array_new();
+        bs.bs_stamps  = g_array_new(FALSE, FALSE, sizeof(guint));
+        bs.bs_artists = cfg->bc_artists;
+        bs.bs_ops     = cfg->bc_ops;
+
+        /* every track is under Artists once */
+        tree = ipoddisk_tree_get();
+        for (i = 0; i < paths->len; i++) {
+                const gchar          *path = g_ptr_array_index(paths, i);
+                struct ipoddisk_node *node;
+                gchar                *file;
+                guint                 track;
+
+                if (!g_str_has_prefix(path, "/Artists/"))
+                        continue;
+                node = ipoddisk_parse_path(tree, path, strlen(path));
+                if (node == NULL)
+                        continue;
+                if (node->nd_type == IPODDISK_NODE_LEAF) {
+                        file = ipoddisk_node_path(node);
+                        if (sscanf(strrchr(file, '/'), "/T%u.mp3",
+                                   &track) == 1 &&
+                            track < IPODDISK_BENCH_STAMPED) {
+                                g_ptr_array_add(bs.bs_tracks, (gpointer) path);
+                                g_array_append_val(bs.bs_stamps, track);
+                        }
+                        g_free(file);
+                }
+                ipoddisk_node_release(node);
+        }
+        ipoddisk_tree_put(tree);
+
+        t = ipoddisk_now();
+
+        reloader.bw_stress = &bs;
+        if (pthread_create(&reloader.bw_thread, NULL,
+                           ipoddisk_bench_stress_reloader, &reloader) != 0) {
+                perror("pthread_create");
+                exit(1);
+        }
+        workers = g_new0(struct ipoddisk_bench_worker, cfg->bc_threads);
+        for (i = 0; i < cfg->bc_threads; i++) {
+                workers[i].bw_stress = &bs;
+                workers[i].bw_seed   = i + 1;
+                if (pthread_create(&workers[i].bw_thread, NULL,
+                                   ipoddisk_bench_stress_reader,
+                                   &workers[i]) != 0) {
+                        perror("pthread_create");
+                        exit(1);
+                }
+        }
+
+        for (i = 0; i < cfg->bc_threads; i++)
+                pthread_join(workers[i].bw_thread, NULL);
+        g_atomic_int_set(&bs.bs_done, 1);
+        pthread_join(reloader.bw_thread, NULL);
+
+        ipoddisk_bench_result("stress", "\"seconds\": %.6f, \"threads\": %u, "
+                              "\"ops\": %u, \"reads\": %d, \"reloads\": %d, "
+                              "\"errors\": %d",
+                              ipoddisk_now() - t, cfg->bc_threads,
+                              cfg->bc_threads * cfg->bc_ops, bs.bs_reads,
+                              bs.bs_reloads, bs.bs_errors);
+
+        g_free(workers);
+        g_array_free(bs.bs_stamps, TRUE);
+        g_ptr_array_free(bs.bs_tracks, TRUE);
+
+        return bs.bs_errors;
+}
+
+static void
+ipoddisk_bench_unlink (const gchar *path)
+{
+        if (unlink(path) == -1 && errno != ENOENT)
+                perror(path);
+        return;
+}
+
+static void
+ipoddisk_bench_rmdir (const gchar *path)
+{
+        if (rmdir(path) == -1 && errno != ENOENT)
+                perror(path);
+        return;
+}
+
+/**
+ * Removes the fake iPod written by ipoddisk_bench_generate, and the
+ * snapshots of it, one file at a time. Anything else found there is
+ * left alone, and so are the directories holding it.
+ */
+static void
+ipoddisk_bench_cleanup (struct ipoddisk_bench_config *cfg)
+{
+        const gchar *name;
+        gchar       *path;
+        GDir        *dir;
+        guint        i;
+
+        for (i = 0; i < cfg->bc_tracks; i++) {
+                path = g_strdup_printf("%s/iPod_Control/Music/F%02u/T%u.mp3",
+                                       cfg->bc_dir, i % IPODDISK_BENCH_NDIRS,
+                                       i);
+                ipoddisk_bench_unlink(path);
+                g_free(path);
+        }
+        for (i = 0; i < IPODDISK_BENCH_NDIRS; i++) {
+                path = g_strdup_printf("%s/iPod_Control/Music/F%02u",
+                                       cfg->bc_dir, i);
+                ipoddisk_bench_rmdir(path);
+                g_free(path);
+        }
+
+        path = g_strdup_printf("%s/iPod_Control/iTunes/iTunesDB", cfg->bc_dir);
+        ipoddisk_bench_unlink(path);
+        g_free(path);
+
+        /* only ipoddisk writes there */
+        dir = g_dir_open(ipoddisk_opts.snapshot_dir, 0, NULL);
+        while (dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+                if (!g_str_has_suffix(name, ".snap"))
+                        continue;
+                path = g_build_filename(ipoddisk_opts.snapshot_dir, name, NULL);
+                ipoddisk_bench_unlink(path);
+                g_free(path);
+        }
+        if (dir != NULL)
+                g_dir_close(dir);
+        ipoddisk_bench_rmdir(ipoddisk_opts.snapshot_dir);
+
+        path = g_strdup_printf("%s/iPod_Control/Music", cfg->bc_dir);
+        ipoddisk_bench_rmdir(path);
+        g_free(path);
+        path = g_strdup_printf("%s/iPod_Control/iTunes", cfg->bc_dir);
+        ipoddisk_bench_rmdir(path);
+        g_free(path);
+        path = g_strdup_printf("%s/iPod_Control", cfg->bc_dir);
+        ipoddisk_bench_rmdir(path);
+        g_free(path);
+        ipoddisk_bench_rmdir(cfg->bc_dir);
+
+        return;
+}
+
+static void
+ipoddisk_bench_usage (void)
+{
+        fprintf(stderr, "usage: ipoddisk_bench [-t tracks] [-a artists] "
+                        "[-l albums per artist]\n"
+                        "                      [-p playlists] "
+                        "[-s playlist size] [-c collision %%]\n"
+                        "                      [-u non-ASCII %%] "
+                        "[-m track size KiB] [-r tracks to read]\n"
+                        "                      [-x stress threads] "
+                        "[-n ops per thread]\n"
+                        "                      [-d dir] [-k]\n");
+        exit(2);
+}
+
+int
+main (int argc, char *argv[])
+{
+        struct ipoddisk_bench_config cfg;
+        struct ipoddisk_tree        *tree;
+        GPtrArray                   *paths;
+        GPtrArray                   *dirs;
+        GPtrArray                   *queries;
+        GString                     *path;
+        double                       t;
+        double                       secs;
+        gint64                       bytes;
+        guint                        errors = 0;
+        guint                        n;
+        guint                        i;
+        int                          c;
+
+        memset(&cfg, 0, sizeof(cfg));
+        cfg.bc_tracks    = 10000;
+        cfg.bc_artists   = 500;
+        cfg.bc_albums    = 4;
+        cfg.bc_playlists = 50;
+        cfg.bc_plsize    = 100;
+        cfg.bc_collide   = 5;
+        cfg.bc_unicode   = 10;
+        cfg.bc_tracksize = 4096;
+        cfg.bc_reads     = 4;
+        cfg.bc_threads   = 4;
+        cfg.bc_ops       = 20000;
+
+        while ((c = getopt(argc, argv, "t:a:l:p:s:c:u:m:r:x:n:d:k")) != -1) {
+                switch (c) {
+                case 't': cfg.bc_tracks    = strtoul(optarg, NULL, 0); break;
+                case 'a': cfg.bc_artists   = strtoul(optarg, NULL, 0); break;
+                case 'l': cfg.bc_albums    = strtoul(optarg, NULL, 0); break;
+                case 'p': cfg.bc_playlists = strtoul(optarg, NULL, 0); break;
+                case 's': cfg.bc_plsize    = strtoul(optarg, NULL, 0); break;
+                case 'c': cfg.bc_collide   = strtoul(optarg, NULL, 0); break;
+                case 'u': cfg.bc_unicode   = strtoul(optarg, NULL, 0); break;
+                case 'm': cfg.bc_tracksize = strtoul(optarg, NULL, 0); break;
+                case 'r': cfg.bc_reads     = strtoul(optarg, NULL, 0); break;
+                case 'x': cfg.bc_threads   = strtoul(optarg, NULL, 0); break;
+                case 'n': cfg.bc_ops       = strtoul(optarg, NULL, 0); break;
+                case 'd': cfg.bc_dir       = g_strdup(optarg);         break;
+                case 'k': cfg.bc_keep      = TRUE;                     break;
+                default:  ipoddisk_bench_usage();
+                }
+        }
+        if (cfg.bc_tracks == 0 || cfg.bc_artists == 0 || cfg.bc_albums == 0)
+                ipoddisk_bench_usage();
+
+        if (cfg.bc_dir == NULL) {
+                cfg.bc_dir = g_build_filename(g_get_tmp_dir(),
+                                              "ipoddisk-bench-XXXXXX", NULL);
+                if (mkdtemp(cfg.bc_dir) == NULL) {
+                        perror(cfg.bc_dir);
+                        return 1;
+                }
+                cfg.bc_made = TRUE;
+        }
+
+        ipoddisk_opts.readahead         = 1024;
+        ipoddisk_opts.readahead_threads = 2;
+        ipoddisk_opts.cache             = 32;
+        ipoddisk_opts.smart_size        = 500;
+        ipoddisk_opts.snapshot_dir      = g_build_filename(cfg.bc_dir,
+                                                           "snapshots", NULL);
+
+        ipoddisk_bench_result("config",
+                              "\"tracks\": %u, \"artists\": %u, "
+                              "\"albums\": %u, \"playlists\": %u, "
+                              "\"playlist_size\": %u, \"collide\": %u, "
+                              "\"unicode\": %u, \"track_kib\": %u",
+                              cfg.bc_tracks, cfg.bc_artists, cfg.bc_albums,
+                              cfg.bc_playlists, cfg.bc_plsize,
+                              cfg.bc_collide, cfg.bc_unicode,
+                              cfg.bc_tracksize);
+
+        t = ipoddisk_now();
+        if (ipoddisk_bench_generate_apart(&cfg) != 0)
+                return 1;
+        ipoddisk_bench_result("generate", "\"seconds\": %.6f",
+                              ipoddisk_now() - t);
+
+        /* parse, then parse and save a snapshot, then load it */
+        ipoddisk_opts.nosnapshot = 1;
+        secs = ipoddisk_bench_build(&cfg);
+        if (secs < 0)
+                return 1;
+        ipoddisk_bench_result("build", "\"seconds\": %.6f, "
+                              "\"peak_rss_kib\": %ld",
+                              secs, ipoddisk_maxrss());
+
+        ipoddisk_opts.nosnapshot = 0;
+        secs = ipoddisk_bench_build(&cfg);
+        ipoddisk_bench_result("build_and_save", "\"seconds\": %.6f", secs);
+        secs = ipoddisk_bench_build(&cfg);
+        ipoddisk_bench_result("snapshot_load", "\"seconds\": %.6f", secs);
+
+        /* the tree from the snapshot, with its views still unbuilt */
+        paths = g_ptr_array_new_with_free_func(g_free);
+        dirs  = g_ptr_array_new_with_free_func(g_free);
+        path  = g_string_new(NULL);
+        tree  = ipoddisk_tree_get();
+        t = ipoddisk_now();
+        n = ipoddisk_bench_walk(tree->tr_root, path, paths, dirs);
+        secs = ipoddisk_now() - t;
+        ipoddisk_tree_put(tree);
+        g_string_free(path, TRUE);
+        ipoddisk_bench_result("readdir", "\"seconds\": %.6f, "
+                              "\"dirs\": %u, \"entries\": %u, "
+                              "\"entries_per_sec\": %.0f",
+                              secs, dirs->len, n, n / secs);
+
+        t = ipoddisk_now();
+        n = ipoddisk_bench_lookup(paths, NULL);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("lookup_cold", "\"seconds\": %.6f, "
+                              "\"lookups\": %u, \"found\": %u, "
+                              "\"lookups_per_sec\": %.0f",
+                              secs, paths->len, n, paths->len / secs);
+
+        t = ipoddisk_now();
+        n = ipoddisk_bench_lookup(paths, NULL);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("lookup_warm", "\"seconds\": %.6f, "
+                              "\"lookups\": %u, \"found\": %u, "
+                              "\"lookups_per_sec\": %.0f",
+                              secs, paths->len, n, paths->len / secs);
+
+        /* what Finder asks of every directory it shows */
+        t = ipoddisk_now();
+        n = ipoddisk_bench_lookup(dirs, "/.DS_Store");
+        n += ipoddisk_bench_lookup(dirs, "/.DS_Store");
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("lookup_missing", "\"seconds\": %.6f, "
+                              "\"lookups\": %u, \"found\": %u, "
+                              "\"lookups_per_sec\": %.0f",
+                              secs, 2 * dirs->len, n, 2 * dirs->len / secs);
+
+        /* one query per artist, up to as many as are cached, so that
+         * none is evicted; the first one builds the index */
+        queries = g_ptr_array_new_with_free_func(g_free);
+        for (i = 0; i < MIN(cfg.bc_artists, 200); i++)
+                g_ptr_array_add(queries,
+                                g_strdup_printf("/Search/artist %u", i));
+        t = ipoddisk_now();
+        n = ipoddisk_bench_lookup(queries, NULL);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("search", "\"seconds\": %.6f, "
+                              "\"queries\": %u, \"found\": %u, "
+                              "\"queries_per_sec\": %.0f",
+                              secs, queries->len, n, queries->len / secs);
+        g_ptr_array_free(queries, TRUE);
+
+        errors += ipoddisk_bench_names();
+
+        ipoddisk_bc_init();
+        ipoddisk_ra_start();
+
+        t = ipoddisk_now();
+        bytes = ipoddisk_bench_read(paths, cfg.bc_reads, IPODDISK_BENCH_DROP);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("read", "\"seconds\": %.6f, \"bytes\": %"
+                              G_GINT64_FORMAT ", \"mib_per_sec\": %.1f",
+                              secs, bytes, bytes / secs / (1024 * 1024));
+
+        t = ipoddisk_now();
+        bytes = ipoddisk_bench_read(paths, cfg.bc_reads, IPODDISK_BENCH_DROP);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("read_again", "\"seconds\": %.6f, \"bytes\": %"
+                              G_GINT64_FORMAT ", \"mib_per_sec\": %.1f, "
+                              "\"cache_hits\": %" G_GUINT64_FORMAT
+                              ", \"cache_misses\": %" G_GUINT64_FORMAT,
+                              secs, bytes, bytes / secs / (1024 * 1024),
+                              ipoddisk_count_get(&ipoddisk_bc_stats.bc_hits),
+                              ipoddisk_count_get(&ipoddisk_bc_stats.bc_misses));
+
+#ifdef __linux__
+        /* the same tracks again, so both start from warm caches */
+        t = ipoddisk_now();
+        bytes = ipoddisk_bench_read(paths, cfg.bc_reads, IPODDISK_BENCH_COPY);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("read_copy", "\"seconds\": %.6f, \"bytes\": %"
+                              G_GINT64_FORMAT ", \"mib_per_sec\": %.1f",
+                              secs, bytes, bytes / secs / (1024 * 1024));
+
+        t = ipoddisk_now();
+        bytes = ipoddisk_bench_read(paths, cfg.bc_reads,
+                                    IPODDISK_BENCH_SPLICE);
+        secs = ipoddisk_now() - t;
+        ipoddisk_bench_result("read_splice", "\"seconds\": %.6f, \"bytes\": %"
+                              G_GINT64_FORMAT ", \"mib_per_sec\": %.1f",
+                              secs, bytes, bytes / secs / (1024 * 1024));
+#endif
+
+        ipoddisk_bench_result("peak_rss", "\"kib\": %ld", ipoddisk_maxrss());
+
+        if (cfg.bc_threads > 0)
+                errors += ipoddisk_bench_stress(&cfg, paths);
+
+        g_ptr_array_free(paths, TRUE);
+        g_ptr_array_free(dirs, TRUE);
+
+        if (cfg.bc_made && !cfg.bc_keep)
+                ipoddisk_bench_cleanup(&cfg);
+        g_free(cfg.bc_dir);
+
+        return errors > 0 ? 1 : 0;
+}
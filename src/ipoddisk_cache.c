@@ -0,0 +1,199 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+#include "ipoddisk.h"
+
+/* Max number of idle backing fds kept open */
+#define IPODDISK_FD_CACHE_MAX   32
+
+/* Idle fds keep iPods from being unmounted, none are kept with -o nohold */
+#define IPODDISK_FD_IDLE_MAX    (ipoddisk_opts.nohold ? \
+                                 0 : IPODDISK_FD_CACHE_MAX)
+
+static pthread_mutex_t     fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable         *fd_table;     /* node -> struct ipoddisk_fd */
+static struct ipoddisk_fd *fd_lru_head;  /* most recently released */
+static struct ipoddisk_fd *fd_lru_tail;  /* next to be evicted */
+static int                 fd_idle;
+
+static void
+ipoddisk_fd_lru_unlink (struct ipoddisk_fd *fd)
+{
+        if (fd->fd_prev != NULL)
+                fd->fd_prev->fd_next = fd->fd_next;
+        else
+                fd_lru_head = fd->fd_next;
+
+        if (fd->fd_next != NULL)
+                fd->fd_next->fd_prev = fd->fd_prev;
+        else
+                fd_lru_tail = fd->fd_prev;
+
+        fd->fd_prev = fd->fd_next = NULL;
+        fd_idle--;
+}
+
+static void
+ipoddisk_fd_lru_push (struct ipoddisk_fd *fd)
+{
+        fd->fd_prev = NULL;
+        fd->fd_next = fd_lru_head;
+        if (fd_lru_head != NULL)
+                fd_lru_head->fd_prev = fd;
+        else
+                fd_lru_tail = fd;
+        fd_lru_head = fd;
+        fd_idle++;
+}
+
+/* Takes a reference on a cached fd, called with fd_lock held */
+static void
+ipoddisk_fd_busy (struct ipoddisk_fd *fd)
+{
+        if (fd->fd_refs == 0) {
+                ipoddisk_fd_lru_unlink(fd);
+                /* keep the subtree, and thus fd_node, alive while in use */
+                ipoddisk_ipod_ref(fd->fd_ipod);
+        }
+        fd->fd_refs++;
+        return;
+}
+
+/**
+ * Looks up the cached backing fd of a track, opening it if needed
+ * @param node Leaf node of the track
+ * @param fdp On success, a referenced fd handle; release with ipoddisk_fd_put
+ * @return 0 on success, -errno otherwise
+ */
+int
+ipoddisk_fd_get (struct ipoddisk_node *node, struct ipoddisk_fd **fdp)
+{
+        int                 rawfd;
+        gchar              *file;
+        guint64             start;
+        struct ipoddisk_fd *fd;
+
+        assert (node->nd_type == IPODDISK_NODE_LEAF);
+
+        pthread_mutex_lock(&fd_lock);
+        if (fd_table == NULL)
+                fd_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        fd = g_hash_table_lookup(fd_table, node);
+        if (fd != NULL) {
+                ipoddisk_fd_busy(fd);
+                pthread_mutex_unlock(&fd_lock);
+                *fdp = fd;
+                return 0;
+        }
+        pthread_mutex_unlock(&fd_lock);
+
+        /* don't hold the lock while the iPod disk spins up */
+        file  = ipoddisk_node_path(node);
+        start = ipoddisk_stats_clock();
+        rawfd = open(file, O_RDONLY);
+        ipoddisk_stats_add(IPODDISK_OP_DEVICE, start);
+        g_free(file);
+        if (rawfd == -1)
+                return -errno;
+
+        ipoddisk_track_check(node, rawfd);
+
+        pthread_mutex_lock(&fd_lock);
+        fd = g_hash_table_lookup(fd_table, node);
+        if (fd != NULL) {
+                /* lost the race to another opener, use theirs */
+                ipoddisk_fd_busy(fd);
+                pthread_mutex_unlock(&fd_lock);
+                close(rawfd);
+                *fdp = fd;
+                return 0;
+        }
+
+        fd = g_slice_new0(struct ipoddisk_fd);
+        fd->fd_node = node;
+        fd->fd_ipod = node->nd_data.track.trk_ipod;
+        fd->fd_fd   = rawfd;
+        fd->fd_refs = 1;
+        ipoddisk_ipod_ref(fd->fd_ipod);
+        g_hash_table_insert(fd_table, node, fd);
+        pthread_mutex_unlock(&fd_lock);
+
+        *fdp = fd;
+        return 0;
+}
+
+/**
+ * Drops a reference obtained by ipoddisk_fd_get. The fd stays cached
+ * until it falls off the LRU list of idle fds, right away with -o nohold.
+ */
+void
+ipoddisk_fd_put (struct ipoddisk_fd *fd)
+{
+        struct ipoddisk_fd   *victim = NULL;
+        struct ipoddisk_ipod *idle = NULL;
+
+        pthread_mutex_lock(&fd_lock);
+
+        assert (fd->fd_refs > 0);
+        fd->fd_refs--;
+        if (fd->fd_refs == 0) {
+                ipoddisk_fd_lru_push(fd);
+                idle = fd->fd_ipod;
+        }
+
+        if (fd_idle > IPODDISK_FD_IDLE_MAX) {
+                victim = fd_lru_tail;
+                ipoddisk_fd_lru_unlink(victim);
+                g_hash_table_remove(fd_table, victim->fd_node);
+        }
+
+        pthread_mutex_unlock(&fd_lock);
+
+        if (victim != NULL) {
+                close(victim->fd_fd);
+                g_slice_free(struct ipoddisk_fd, victim);
+        }
+
+        /* may free the subtree, which purges its idle fds under fd_lock */
+        if (idle != NULL)
+                ipoddisk_ipod_unref(idle);
+
+        return;
+}
+
+/**
+ * Closes the idle cached fds of an iPod, whose subtree is going away or
+ * which has been unmounted. Busy ones are left to their last user; when
+ * the subtree goes, there can't be any, as they hold a reference to it.
+ */
+void
+ipoddisk_fd_purge (struct ipoddisk_ipod *ipod)
+{
+        struct ipoddisk_fd *fd;
+        struct ipoddisk_fd *next;
+        GSList             *victims = NULL;
+        GSList             *l;
+
+        pthread_mutex_lock(&fd_lock);
+        for (fd = fd_lru_head; fd != NULL; fd = next) {
+                next = fd->fd_next;
+                if (fd->fd_ipod != ipod)
+                        continue;
+
+                ipoddisk_fd_lru_unlink(fd);
+                g_hash_table_remove(fd_table, fd->fd_node);
+                victims = g_slist_prepend(victims, fd);
+        }
+        pthread_mutex_unlock(&fd_lock);
+
+        for (l = victims; l != NULL; l = l->next) {
+                fd = l->data;
+                close(fd->fd_fd);
+                g_slice_free(struct ipoddisk_fd, fd);
+        }
+        g_slist_free(victims);
+
+        return;
+}
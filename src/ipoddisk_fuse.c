@@ -6,6 +6,7 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -15,6 +16,8 @@
 #include <sys/uio.h>
 #include <unistd.h>
 #include <sys/xattr.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "ipoddisk.h"
 
@@ -23,37 +26,100 @@ static uid_t          the_uid;
 static gid_t          the_gid;
 static struct timeval the_time;
 
-static int 
-ipoddisk_statfs (const char *path, struct statvfs *stbuf)
+struct ipoddisk_options ipoddisk_opts;
+
+#define IPODDISK_OPT(t, p, v) { t, offsetof(struct ipoddisk_options, p), v }
+
+static struct fuse_opt ipoddisk_fuse_opts[] = {
+        IPODDISK_OPT("attr_lstat", lstat, 1),
+        IPODDISK_OPT("reload_interval=%u", reload_interval, 0),
+        IPODDISK_OPT("nosnapshot", nosnapshot, 1),
+        IPODDISK_OPT("snapshot_dir=%s", snapshot_dir, 0),
+        IPODDISK_OPT("readahead=%u", readahead, 0),
+        IPODDISK_OPT("readahead_threads=%u", readahead_threads, 0),
+        IPODDISK_OPT("cache=%u", cache, 0),
+        IPODDISK_OPT("nosplice", nosplice, 1),
+        IPODDISK_OPT("lowlevel", lowlevel, 1),
+        IPODDISK_OPT("smart_size=%u", smart_size, 0),
+        IPODDISK_OPT("nohold", nohold, 1),
+        FUSE_OPT_END
+};
+
+#undef IPODDISK_OPT
+
+/* Paths of the stats file and its directory, see ipoddisk_stats.c */
+enum {
+        IPODDISK_PATH_TREE,
+        IPODDISK_PATH_STATS_DIR,
+        IPODDISK_PATH_STATS_FILE
+};
+
+#define IPODDISK_STATS_DIR_PATH  "/" IPODDISK_STATS_DIR
+#define IPODDISK_STATS_FILE_PATH "/" IPODDISK_STATS_DIR "/" IPODDISK_STATS_FILE
+
+static int
+ipoddisk_path_kind (const char *path)
 {
-        memset(stbuf, 0, sizeof(*stbuf));
-        return ipoddisk_statipods(stbuf);
+        if (strncmp(path, CONST_STR_LEN(IPODDISK_STATS_DIR_PATH)) != 0)
+                return IPODDISK_PATH_TREE;
+        if (strcmp(path, IPODDISK_STATS_DIR_PATH) == 0)
+                return IPODDISK_PATH_STATS_DIR;
+        if (strcmp(path, IPODDISK_STATS_FILE_PATH) == 0)
+                return IPODDISK_PATH_STATS_FILE;
+
+        return IPODDISK_PATH_TREE;
 }
 
 static int 
-ipoddisk_getattr (const char *path, struct stat *stbuf)
+ipoddisk_statfs (const char *path, struct statvfs *stbuf)
 {
-        int                   rc = 0;
-        struct ipoddisk_node *node;
-
-        node = ipoddisk_parse_path(path, strlen(path));
-        if (node == NULL)
-                return -ENOENT;
+        int                   rc;
+        guint64               start = ipoddisk_stats_clock();
+        struct ipoddisk_tree *tree;
 
         memset(stbuf, 0, sizeof(*stbuf));
 
-        if (node->nd_type == IPODDISK_NODE_LEAF) {
-                gchar *file = ipoddisk_node_path(node);
+        tree = ipoddisk_tree_get();
+        rc = ipoddisk_statipods(tree, stbuf);
+        ipoddisk_tree_put(tree);
 
-                rc = (lstat(file, stbuf) == -1) ? -errno : 0;
-                stbuf->st_mode = S_IFREG |                    /* regular */
-                                 S_IRUSR | S_IRGRP | S_IROTH; /* readable */
+        ipoddisk_stats_add(IPODDISK_OP_STATFS, start);
+        return rc;
+}
+
+/**
+ * Fills in attributes of a node without touching the iPod, using the
+ * cached track size and times for leaves
+ */
+void
+ipoddisk_node_stat (struct ipoddisk_node *node, struct stat *stbuf)
+{
+        memset(stbuf, 0, sizeof(*stbuf));
+
+        stbuf->st_ino = (ino_t) node;
+        stbuf->st_uid = the_uid;
+        stbuf->st_gid = the_gid;
 
-                g_free(file);
+        if (IPODDISK_NODE_IS_FILE(node)) {
+                off_t  size;
+                time_t mtime = 0;
+
+                if (node->nd_type == IPODDISK_NODE_LEAF)
+                        ipoddisk_track_attr(node, &size, &mtime);
+                else
+                        size = ipoddisk_manifest_size(node);
+
+                stbuf->st_nlink  = 1;
+                stbuf->st_size   = size;
+                stbuf->st_blocks = (size + 511) / 512;
+                stbuf->st_atime  =
+                stbuf->st_mtime  =
+                stbuf->st_ctime  = mtime ? mtime : the_time.tv_sec;
+                stbuf->st_mode   = S_IFREG |                    /* regular */
+                                   S_IRUSR | S_IRGRP | S_IROTH; /* readable */
         } else {
                 stbuf->st_nlink = 2;
                 stbuf->st_size  = 1024;
-                stbuf->st_ino   = (ino_t) node;
                 stbuf->st_atime = 
                 stbuf->st_mtime =
                 stbuf->st_ctime = the_time.tv_sec;
@@ -62,78 +128,290 @@ ipoddisk_getattr (const char *path, struct stat *stbuf)
                                   S_IXUSR | S_IXGRP | S_IXOTH;  /* executable */
         }
 
-        stbuf->st_uid = the_uid;
-        stbuf->st_gid = the_gid;
+        return;
+}
+
+/**
+ * Fills in attributes of the stats directory or file. The file is made
+ * up on open, so its size isn't known before and is given as 0, as in
+ * /proc; both backends open it with direct_io so that it is read to the
+ * end anyway.
+ */
+void
+ipoddisk_stats_stat (int isdir, struct stat *stbuf)
+{
+        memset(stbuf, 0, sizeof(*stbuf));
+
+        stbuf->st_uid   = the_uid;
+        stbuf->st_gid   = the_gid;
+        stbuf->st_atime =
+        stbuf->st_mtime =
+        stbuf->st_ctime = the_time.tv_sec;
+
+        if (isdir) {
+                stbuf->st_nlink = 2;
+                stbuf->st_mode  = S_IFDIR |
+                                  S_IRUSR | S_IRGRP | S_IROTH |
+                                  S_IXUSR | S_IXGRP | S_IXOTH;
+        } else {
+                stbuf->st_nlink = 1;
+                stbuf->st_mode  = S_IFREG |
+                                  S_IRUSR | S_IRGRP | S_IROTH;
+        }
+
+        return;
+}
+
+/**
+ * Fills in attributes of a node as getattr reports them, which with
+ * -o attr_lstat means asking the iPod about tracks
+ * @return 0 on success, -errno otherwise
+ */
+int
+ipoddisk_node_getattr (struct ipoddisk_node *node, struct stat *stbuf)
+{
+        int     rc;
+        gchar  *file;
+        guint64 start;
+
+        if (node->nd_type != IPODDISK_NODE_LEAF || !ipoddisk_opts.lstat) {
+                ipoddisk_node_stat(node, stbuf);
+                return 0;
+        }
+
+        file = ipoddisk_node_path(node);
+
+        memset(stbuf, 0, sizeof(*stbuf));
+        start = ipoddisk_stats_clock();
+        rc = (lstat(file, stbuf) == -1) ? -errno : 0;
+        ipoddisk_stats_add(IPODDISK_OP_DEVICE, start);
+        stbuf->st_mode = S_IFREG |                    /* regular */
+                         S_IRUSR | S_IRGRP | S_IROTH; /* readable */
+        stbuf->st_uid  = the_uid;
+        stbuf->st_gid  = the_gid;
+
+        g_free(file);
 
         return rc;
 }
 
+static int 
+ipoddisk_getattr (const char *path, struct stat *stbuf)
+{
+        int                   rc;
+        int                   kind;
+        guint64               start = ipoddisk_stats_clock();
+        struct ipoddisk_tree *tree;
+        struct ipoddisk_node *node;
+
+        kind = ipoddisk_path_kind(path);
+        if (kind != IPODDISK_PATH_TREE) {
+                ipoddisk_stats_stat(kind == IPODDISK_PATH_STATS_DIR, stbuf);
+                return 0;
+        }
+
+        tree = ipoddisk_tree_get();
+        node = ipoddisk_parse_path(tree, path, strlen(path));
+        rc   = node ? ipoddisk_node_getattr(node, stbuf) : -ENOENT;
+        if (node != NULL)
+                ipoddisk_node_release(node);
+        ipoddisk_tree_put(tree);
+
+        ipoddisk_stats_add(IPODDISK_OP_GETATTR, start);
+        return rc;
+}
+
 static int 
 ipoddisk_access (const char *path, int mask)
 {
+        int                   rc = 0;
+        int                   kind;
+        struct ipoddisk_tree *tree;
         struct ipoddisk_node *node;
 
-        node = ipoddisk_parse_path(path, strlen(path));
+        kind = ipoddisk_path_kind(path);
+        if (kind != IPODDISK_PATH_TREE) {
+                if (mask & W_OK)
+                        return -EROFS;
+                if ((mask & X_OK) && kind == IPODDISK_PATH_STATS_FILE)
+                        return -EACCES;
+                return 0;
+        }
+
+        tree = ipoddisk_tree_get();
+        node = ipoddisk_parse_path(tree, path, strlen(path));
         if (node == NULL)
-                return -ENOENT;
+                rc = -ENOENT;
+        else if (mask & W_OK)     /* everything is read-only */
+                rc = -EROFS;
+        else if ((mask & X_OK) && /* only directories are executable */
+                 IPODDISK_NODE_IS_FILE(node))
+                rc = -EACCES;
+        if (node != NULL)
+                ipoddisk_node_release(node);
+        ipoddisk_tree_put(tree);
+
+        return rc;
+}
+
+/* An open directory; keeps its tree, and its node held, alive between
+ * readdir calls */
+struct ipoddisk_dirhandle {
+        struct ipoddisk_tree *dh_tree;
+        struct ipoddisk_node *dh_node;  /* NULL for the stats directory */
+};
 
-        if (mask & W_OK)     /* everything is read-only */
-                return -EROFS;
+static int
+ipoddisk_opendir (const char *path, struct fuse_file_info *fi)
+{
+        struct ipoddisk_tree      *tree;
+        struct ipoddisk_node      *node;
+        struct ipoddisk_dirhandle *dh;
+        int                        kind;
+
+        kind = ipoddisk_path_kind(path);
+        if (kind == IPODDISK_PATH_STATS_FILE)
+                return -ENOTDIR;
+
+        tree = ipoddisk_tree_get();
+        node = NULL;
+        if (kind == IPODDISK_PATH_TREE) {
+                node = ipoddisk_parse_path(tree, path, strlen(path));
+                if (node == NULL || IPODDISK_NODE_IS_FILE(node)) {
+                        if (node != NULL)
+                                ipoddisk_node_release(node);
+                        ipoddisk_tree_put(tree);
+                        return -ENOENT;
+                }
+        }
 
-        if ((mask & X_OK) && /* only directories are executable */
-            node->nd_type == IPODDISK_NODE_LEAF)
-                return -EACCES;
+        dh = g_slice_new(struct ipoddisk_dirhandle);
+        dh->dh_tree = tree;
+        dh->dh_node = node;
 
+        fi->fh = (uint64_t) (uintptr_t) dh;
         return 0;
 }
 
-struct __readdir_arg {
-        void            *buf;
-        fuse_fill_dir_t  filler;
-};
-
-void
-ipoddisk_gen_dir_entry(GQuark key_id, gpointer data, gpointer user_data)
+static int
+ipoddisk_releasedir (const char *path, struct fuse_file_info *fi)
 {
-        struct __readdir_arg *arg = user_data;
+        struct ipoddisk_dirhandle *dh;
+
+        UNUSED (path);
+
+        dh = (struct ipoddisk_dirhandle *) (uintptr_t) fi->fh;
+        if (dh->dh_node != NULL)
+                ipoddisk_node_release(dh->dh_node);
+        ipoddisk_tree_put(dh->dh_tree);
+        g_slice_free(struct ipoddisk_dirhandle, dh);
 
-        (arg->filler)(arg->buf, g_quark_to_string(key_id), NULL, 0);
+        return 0;
 }
 
+/**
+ * Lists a directory with attributes, resuming at offset. Offset k names
+ * the k-th entry, counting "." and ".." as 0 and 1, so big directories
+ * can be returned over several calls.
+ */
 static int ipoddisk_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                             off_t offset, struct fuse_file_info *fi)
 {
-        struct ipoddisk_node *node;
-        struct __readdir_arg arg;
+        off_t                      k;
+        struct stat                st;
+        struct ipoddisk_dir       *dir;
+        struct ipoddisk_node      *node;
+        struct ipoddisk_dirhandle *dh;
+        guint64                    start = ipoddisk_stats_clock();
+
+        UNUSED (path);
+
+        dh   = (struct ipoddisk_dirhandle *) (uintptr_t) fi->fh;
+        node = dh->dh_node;
+
+        if (node == NULL) {  /* the stats directory */
+                for (k = offset; k < 3; k++) {
+                        ipoddisk_stats_stat(k < 2, &st);
+                        if (filler(buf, k == 0 ? "." : k == 1 ? ".." :
+                                        IPODDISK_STATS_FILE, &st, k + 1))
+                                break;
+                }
+                return 0;
+        }
 
-        UNUSED(fi);
-        UNUSED(offset);
+        dir = ipoddisk_node_dir(node);
 
-        node = ipoddisk_parse_path(path, strlen(path));
-        if(node == NULL || node->nd_type == IPODDISK_NODE_LEAF)
-                return -ENOENT;
+        for (k = offset; k < (off_t) dir->dir_nents + 2; k++) {
+                const char           *name;
+                struct ipoddisk_node *child;
 
-        arg.buf    = buf;
-        arg.filler = filler;
+                if (k < 2) {
+                        name  = k == 0 ? "." : "..";
+                        child = k == 0 ? node : NULL;
+                } else {
+                        name  = dir->dir_ents[k - 2].de_name;
+                        child = dir->dir_ents[k - 2].de_node;
+                }
 
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
+                if (child != NULL)
+                        ipoddisk_node_stat(child, &st);
 
-        g_datalist_foreach(&node->nd_children, ipoddisk_gen_dir_entry, &arg);
+                if (filler(buf, name, child ? &st : NULL, k + 1))
+                        break;  /* buffer full, kernel comes back for more */
+        }
 
+        ipoddisk_stats_add(IPODDISK_OP_READDIR, start);
         return 0;
 }
 
 static int ipoddisk_open(const char *path, struct fuse_file_info *fi)
 {
+        int                   rc = 0;
+        guint64               start = ipoddisk_stats_clock();
+        struct ipoddisk_file *file;
+        struct ipoddisk_tree *tree;
         struct ipoddisk_node *node;
 
-        node = ipoddisk_parse_path(path, strlen(path));
+        fi->fh = 0;
+
+        switch (ipoddisk_path_kind(path)) {
+        case IPODDISK_PATH_STATS_DIR:
+                return -EISDIR;
+        case IPODDISK_PATH_STATS_FILE:
+                if ((fi->flags & O_ACCMODE) != O_RDONLY)
+                        return -EACCES;
+                /* taken now, so that it reads as one */
+                fi->fh        = (uint64_t) (uintptr_t) ipoddisk_stats_text();
+                fi->direct_io = 1;
+                return 0;
+        }
+
+        tree = ipoddisk_tree_get();
+        node = ipoddisk_parse_path(tree, path, strlen(path));
         if (node == NULL)
-                return -ENOENT;
+                rc = -ENOENT;
+        else if((fi->flags & O_ACCMODE) != O_RDONLY)
+                rc = -EACCES;
+        else if (IPODDISK_NODE_IS_FILE(node) &&
+                 (rc = ipoddisk_file_open(node, &file)) == 0)
+                fi->fh = (uint64_t) (uintptr_t) file; /* pins the subtree */
+        if (node != NULL)
+                ipoddisk_node_release(node);
+        ipoddisk_tree_put(tree);
+
+        ipoddisk_stats_add(IPODDISK_OP_OPEN, start);
+        return rc;
+}
 
-        if((fi->flags & O_ACCMODE) != O_RDONLY)
-                return -EACCES;
+static int
+ipoddisk_release (const char *path, struct fuse_file_info *fi)
+{
+        struct ipoddisk_file *file = (struct ipoddisk_file *) (uintptr_t) fi->fh;
+
+        if (ipoddisk_path_kind(path) == IPODDISK_PATH_STATS_FILE)
+                g_string_free((GString *) (uintptr_t) fi->fh, TRUE);
+        else if (file != NULL)
+                ipoddisk_file_close(file);
 
         return 0;
 }
@@ -142,36 +420,81 @@ static int
 ipoddisk_read (const char *path, char *buf, size_t size,
                off_t offset, struct fuse_file_info *fi)
 {
-        int                   fd;
-        int                   rc;
-        gchar                *file;
-        struct ipoddisk_node *node;
+        struct ipoddisk_file *file = (struct ipoddisk_file *) (uintptr_t) fi->fh;
+        guint64               start = ipoddisk_stats_clock();
+        ssize_t               rc;
 
-        UNUSED (fi);
+        if (ipoddisk_path_kind(path) == IPODDISK_PATH_STATS_FILE)
+                return ipoddisk_stats_read((GString *) (uintptr_t) fi->fh,
+                                           buf, size, offset);
 
-        node = ipoddisk_parse_path(path, strlen(path));
-        if(node == NULL ||
-           node->nd_type != IPODDISK_NODE_LEAF)
+        if (file == NULL) /* not a file */
                 return -ENOENT;
 
-        file = ipoddisk_node_path(node);
+        rc = ipoddisk_file_read(file, buf, size, offset);
+
+        ipoddisk_stats_add(IPODDISK_OP_READ, start);
+        return rc;
+}
+
+#if FUSE_VERSION >= 29
+/**
+ * Like ipoddisk_read, but only what is already in memory is copied.
+ * The rest is handed back as a range of the iPod file, which libfuse
+ * can splice straight into /dev/fuse. That happens after this returns,
+ * so read and device times leave it out.
+ */
+static int
+ipoddisk_read_buf (const char *path, struct fuse_bufvec **bufp,
+                   size_t size, off_t offset, struct fuse_file_info *fi)
+{
+        struct ipoddisk_file *file = (struct ipoddisk_file *) (uintptr_t) fi->fh;
+        struct fuse_bufvec   *bv;
+        char                 *mem;
+        size_t                done;
+        guint64               start = ipoddisk_stats_clock();
+        int                   stats;
+
+        stats = ipoddisk_path_kind(path) == IPODDISK_PATH_STATS_FILE;
+        if (file == NULL && !stats) /* not a file */
+                return -ENOENT;
 
-        fd = open(file, O_RDONLY);
-        if (fd == -1) {
-                rc = -errno;
-                g_free(file);
-                return rc;
+        /* libfuse frees both the vector and memory buffers with free(3) */
+        bv  = calloc(1, sizeof(*bv) + sizeof(bv->buf[0]));
+        mem = malloc(size);
+        if (bv == NULL || mem == NULL) {
+                free(bv);
+                free(mem);
+                return -ENOMEM;
         }
 
-        rc = pread(fd, buf, size, offset);
-        if (rc == -1)
-                rc = -errno;
+        if (stats)
+                done = ipoddisk_stats_read((GString *) (uintptr_t) fi->fh,
+                                           mem, size, offset);
+        else
+                done = ipoddisk_file_read_cached(file, mem, size, offset);
+        if (done > 0) {
+                bv->buf[bv->count].size = done;
+                bv->buf[bv->count].mem  = mem;
+                bv->count++;
+        } else {
+                free(mem);
+        }
 
-        close(fd);
-        g_free(file);
+        if (done < size && !stats && file->fl_fd != NULL) {
+                bv->buf[bv->count].size  = size - done;
+                bv->buf[bv->count].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                bv->buf[bv->count].fd    = file->fl_fd->fd_fd;
+                bv->buf[bv->count].pos   = offset + done;
+                bv->count++;
+        }
 
-        return rc;
+        *bufp = bv;
+        if (!stats)
+                ipoddisk_stats_add(IPODDISK_OP_READ, start);
+        return 0;
 }
+#endif
 
 #if 0
 static int
@@ -219,21 +542,133 @@ ipoddisk_listxattr (const char *path, char *list, size_t size)
 }
 #endif
 
+/**
+ * Starts the background threads. They must be started after FUSE has
+ * daemonized, so both backends call this from their init.
+ */
+void
+ipoddisk_start (void)
+{
+        if (ipoddisk_opts.reload_interval > 0)
+                ipoddisk_watch_start();
+        ipoddisk_bc_init();
+        if (ipoddisk_opts.readahead > 0)
+                ipoddisk_ra_start();
+        ipoddisk_stats_start();
+
+        return;
+}
+
+/**
+ * Reports how the caches did, at unmount
+ */
+void
+ipoddisk_stop (void)
+{
+        struct ipoddisk_ra_stats   *ra = &ipoddisk_ra_stats;
+        struct ipoddisk_bc_stats   *bc = &ipoddisk_bc_stats;
+        struct ipoddisk_path_stats *ps = &ipoddisk_path_stats;
+        guint64                     hits;
+        guint64                     misses;
+        guint64                     walks;
+
+        hits   = ipoddisk_count_get(&ra->ra_hits);
+        misses = ipoddisk_count_get(&ra->ra_misses);
+        if (hits + misses > 0)
+                fprintf(stderr, "ipoddisk: readahead served %" G_GUINT64_FORMAT
+                                " of %" G_GUINT64_FORMAT " sequential reads "
+                                "(%.1f%%, %" G_GUINT64_FORMAT " after waiting), "
+                                "%" G_GUINT64_FORMAT " blocks read ahead\n",
+                        hits, hits + misses, 100.0 * hits / (hits + misses),
+                        ipoddisk_count_get(&ra->ra_waits),
+                        ipoddisk_count_get(&ra->ra_blocks));
+
+        hits   = ipoddisk_count_get(&bc->bc_hits);
+        misses = ipoddisk_count_get(&bc->bc_misses);
+        if (hits + misses > 0)
+                fprintf(stderr, "ipoddisk: block cache hit %" G_GUINT64_FORMAT
+                                " of %" G_GUINT64_FORMAT " lookups (%.1f%%), "
+                                "%" G_GUINT64_FORMAT " blocks evicted\n",
+                        hits, hits + misses, 100.0 * hits / (hits + misses),
+                        ipoddisk_count_get(&bc->bc_evictions));
+
+        hits   = ipoddisk_count_get(&ps->ps_hits);
+        misses = ipoddisk_count_get(&ps->ps_misses);
+        walks  = ipoddisk_count_get(&ps->ps_walks);
+        if (hits + misses + walks > 0)
+                fprintf(stderr, "ipoddisk: %" G_GUINT64_FORMAT " path lookups, "
+                                "%" G_GUINT64_FORMAT " answered from the "
+                                "index and %" G_GUINT64_FORMAT " as known "
+                                "misses, %" G_GUINT64_FORMAT " walked\n",
+                        hits + misses + walks, hits, misses, walks);
+
+        return;
+}
+
+static void *
+ipoddisk_init (struct fuse_conn_info *conn)
+{
+        UNUSED (conn);
+
+        ipoddisk_start();
+
+        return NULL;
+}
+
+static void
+ipoddisk_destroy (void *data)
+{
+        UNUSED (data);
+
+        ipoddisk_stop();
+
+        return;
+}
+
 static struct fuse_operations ipoddisk_ops = {
-        .statfs    = ipoddisk_statfs,
-        .getattr   = ipoddisk_getattr,
-        .access	   = ipoddisk_access,
-        .readdir   = ipoddisk_readdir,
-        .open      = ipoddisk_open,
-        .read      = ipoddisk_read,
+        .init       = ipoddisk_init,
+        .destroy    = ipoddisk_destroy,
+        .statfs     = ipoddisk_statfs,
+        .getattr    = ipoddisk_getattr,
+        .access     = ipoddisk_access,
+        .opendir    = ipoddisk_opendir,
+        .readdir    = ipoddisk_readdir,
+        .releasedir = ipoddisk_releasedir,
+        .open       = ipoddisk_open,
+        .read       = ipoddisk_read,
+#if FUSE_VERSION >= 29
+        .read_buf   = ipoddisk_read_buf,
+#endif
+        .release    = ipoddisk_release,
 #if 0
-        .getxattr  = ipoddisk_getxattr,
-        .listxattr = ipoddisk_listxattr,
+        .getxattr   = ipoddisk_getxattr,
+        .listxattr  = ipoddisk_listxattr,
 #endif
 };
 
 int main(int argc, char *argv[])
 {
+        struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+        gchar           *opt;
+
+        ipoddisk_opts.reload_interval   = 5;
+        ipoddisk_opts.readahead         = 1024;
+        ipoddisk_opts.readahead_threads = 2;
+        ipoddisk_opts.cache             = 32;
+        ipoddisk_opts.smart_size        = 500;
+        if (fuse_opt_parse(&args, &ipoddisk_opts, ipoddisk_fuse_opts, NULL) == -1)
+                return 1;
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+        /* fuse_main serves requests from several threads, and g_slice
+         * and friends are only thread-safe once this has been called */
+        if (!g_thread_supported())
+                g_thread_init(NULL);
+#endif
+
+        /* before the iPods are scanned, which starts threads */
+        ipoddisk_stats_init();
+
         the_uid = getuid();
         the_gid = getgid();
 
@@ -243,9 +678,29 @@ int main(int argc, char *argv[])
         }
 
         if (ipoddisk_init_ipods() != 0) {
-                fprintf(stderr, "ipoddisk_init_ipods() has failed.\n");
-                return 1;
+                if (ipoddisk_opts.reload_interval == 0) {
+                        fprintf(stderr, "ipoddisk_init_ipods() has failed.\n");
+                        return 1;
+                }
+                fprintf(stderr, "ipoddisk: no iPod found, waiting for one\n");
         }
+
+#if FUSE_VERSION >= 29
+        if (ipoddisk_opts.nosplice)
+                ipoddisk_ops.read_buf = NULL;
+#endif
+
+        if (ipoddisk_opts.lowlevel)
+                return ipoddisk_ll_main(&args);
+
+        /* let the kernel remember misses as well, though not past a
+         * reload; a -o negative_timeout given by the user comes later
+         * and wins */
+        opt = g_strdup_printf("-onegative_timeout=%u",
+                              ipoddisk_opts.reload_interval ?
+                              ipoddisk_opts.reload_interval : 3600);
+        fuse_opt_insert_arg(&args, 1, opt);
+        g_free(opt);
         
-        return fuse_main(argc, argv, &ipoddisk_ops, NULL);
+        return fuse_main(args.argc, args.argv, &ipoddisk_ops, NULL);
 }
@@ -2,26 +2,61 @@
  * vim:expandtab:shiftwidth=8:tabstop=8:
  */
 
+#include <sys/resource.h>
+#include <sched.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #include "ipoddisk.h"
 
-#define IPODDISK_MAX_IPOD       16
-static int ipodnr;
-static struct ipoddisk_node *ipods[IPODDISK_MAX_IPOD];
-static struct ipoddisk_node *ipoddisk_tree;
-static GError *error = NULL;
+/* The published tree; swapped as a whole when an iTunesDB changes. Read
+ * without a lock, see ipoddisk_tree_get; tree_lock orders publishers. */
+static pthread_mutex_t       tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ipoddisk_tree *current_tree;
+/* Threads between reading current_tree and referencing what they read */
+static volatile gint         tree_getters;
+/* Every tree not freed yet, current or not, under tree_lock; see
+ * ipoddisk_trees_forget */
+static GList                *live_trees;
+/* Told when a tree is replaced, see ipoddisk_tree_notify */
+static void (*tree_changed) (struct ipoddisk_tree *old,
+                             struct ipoddisk_tree *tree);
+
+/* Max number of missing paths remembered per tree */
+#define IPODDISK_MISSES_MAX     4096
+
+/* Max number of search results cached per iPod subtree, and how many
+ * are kept when they are evicted; see ipoddisk_query_evict */
+#define IPODDISK_QUERIES_MAX    256
+#define IPODDISK_QUERIES_KEEP   (IPODDISK_QUERIES_MAX * 3 / 4)
+
+/* First chunk of the arena of a search result */
+#define IPODDISK_QUERY_CHUNK    (4 * 1024)
+
+struct ipoddisk_path_stats ipoddisk_path_stats;
 
 
 int
-ipoddisk_statipods (struct statvfs *stbuf)
+ipoddisk_statipods (struct ipoddisk_tree *tree, struct statvfs *stbuf)
 {
         struct statvfs tmp;
         int i;
 
-        if (statvfs(ipods[0]->nd_data.ipod.ipod_mp, stbuf) == -1)
+        if (tree->tr_nipods == 0) {
+                /* nothing plugged in: an empty, read-only disk */
+                stbuf->f_bsize   = 512;
+                stbuf->f_frsize  = 512;
+                stbuf->f_namemax = 255;
+                stbuf->f_flag    = ST_RDONLY | ST_NOSUID;
+                return 0;
+        }
+
+        if (statvfs(tree->tr_ipods[0]->nd_data.ipod->ipod_mp, stbuf) == -1)
                 return -errno;
 
-        for (i = 1; i < ipodnr; i++) {
-                if (statvfs(ipods[i]->nd_data.ipod.ipod_mp, &tmp) == -1)
+        for (i = 1; i < tree->tr_nipods; i++) {
+                if (statvfs(tree->tr_ipods[i]->nd_data.ipod->ipod_mp, &tmp) == -1)
                         return -errno;
                 /* FIXME: this assumes that block sizes of all filesystems
                  * are the same */
@@ -35,483 +70,2398 @@ ipoddisk_statipods (struct statvfs *stbuf)
         return 0;
 }
 
-#define IPODDISK_MAX_PATH_TOKENS	12
+/* Directories up to this size are searched linearly */
+#define IPODDISK_DIR_LINEAR_MAX 8
 
-struct ipoddisk_node *
-ipoddisk_parse_path (const char *path, int len)
+static inline guint
+ipoddisk_name_hash (const char *name, size_t len)
 {
-	struct ipoddisk_node *node;
-	struct ipoddisk_node *parent;
-	gchar                **orig;
-	gchar                **tokens;
-
-	UNUSED(len);
-
-        node   =
-	parent = ipoddisk_tree;
-	orig   =
-        tokens = g_strsplit(path, "/", IPODDISK_MAX_PATH_TOKENS);
-
-	while (*tokens) {
-		gchar *token = *tokens;
-
-		tokens++;
-                if (strlen(token) == 0)
-                        continue;
-
-                if (parent->nd_type == IPODDISK_NODE_LEAF) {
-                        node = NULL;
-                        break;
-                }
+        guint h = 5381;
 
-                node = g_datalist_get_data(&parent->nd_children, token);
-                if (node == NULL)
-                        break;
-                parent = node;
-	}
+        while (len--)
+                h = (h << 5) + h + (guchar) *name++;
 
-	g_strfreev(orig);
-	return node;
+        return h;
 }
 
-#undef IPODDISK_MAX_PATH_TOKENS
-
-/* FIXME: assume track->ipod_path has an extension 
-   of 4 char, e.g. '.mp3', '.m4a'. */
-#define IPOD_TRACK_EXTENSION_LEN	4
+static inline gboolean
+ipoddisk_dirent_match (struct ipoddisk_dirent *de, guint hash,
+                       const char *name, size_t len)
+{
+        return de->de_hash == hash &&
+               strncmp(de->de_name, name, len) == 0 &&
+               de->de_name[len] == '\0';
+}
 
-static inline gchar *
-ipod_get_track_extension (gchar * path)
+static void
+ipoddisk_dir_rehash (struct ipoddisk_arena *arena, struct ipoddisk_dir *dir,
+                     guint nslots)
 {
-	gchar *ext;
+        guint i;
 
-        assert (strlen(path) > IPOD_TRACK_EXTENSION_LEN);
+        /* the old index stays in the arena; all of them together are
+         * no bigger than the final one */
+        dir->dir_slots = ipoddisk_arena_alloc(arena, nslots * sizeof(guint));
+        dir->dir_mask  = nslots - 1;
 
-	ext = path + strlen(path) - IPOD_TRACK_EXTENSION_LEN;
-	return ext;
+        for (i = 0; i < dir->dir_nents; i++) {
+                guint slot = dir->dir_ents[i].de_hash & dir->dir_mask;
+
+                while (dir->dir_slots[slot] != 0)
+                        slot = (slot + 1) & dir->dir_mask;
+                dir->dir_slots[slot] = i + 1;
+        }
 }
 
-static void
-ipoddisk_encode_name (gchar **strpp)
+/**
+ * Builds the lookup index of a directory whose entries were filled in
+ * directly, as when loading a snapshot
+ */
+void
+ipoddisk_dir_index (struct ipoddisk_arena *arena, struct ipoddisk_dir *dir)
 {
-	gchar *old = *strpp;
-        gchar *nstr;         /* normalized utf-8 string */
-	int    i;
+        guint nslots = 32;
 
-        if (old == NULL)
+        if (dir->dir_nents <= IPODDISK_DIR_LINEAR_MAX)
                 return;
 
-	/* Encode path names to appease Finder:
-	 * 0. leading . is treated as hidden file, encode as _
-	 * 1. slash is Unix path separator, encode as : 
-	 * 2. \r and \n are problematic, encode as space
-	 * Then normalize the string to cope with tricky
-	 * things like umlaut */
-        for (i = 0; i < strlen(old); i++) {
-                if (i == 0 && old[i] == '.')
-                        old[i] = '_';
-                else if (old[i] == '/')
-                        old[i] = ':';
-                else if (old[i] == '\r' || old[i] == '\n')
-                        old[i] = ' ';
-        }
-        
-        nstr = g_utf8_normalize(old, -1, G_NORMALIZE_NFD);
-        if (nstr) {
-                g_free(old);
-                *strpp = nstr;
-        }
+        while (dir->dir_nents * 4 > nslots * 3)
+                nslots *= 2;
+        ipoddisk_dir_rehash(arena, dir, nslots);
 
         return;
 }
 
 /**
- * Adds a child to a parent node, and enure uniqueness of its key
+ * Appends an entry to a directory; name must live in arena. The caller
+ * makes sure name is not already present.
  */
 static void
-ipoddisk_add_child (struct ipoddisk_node *parent,
-                    struct ipoddisk_node *child, gchar *key)
+ipoddisk_dir_insert (struct ipoddisk_arena *arena, struct ipoddisk_dir *dir,
+                     gchar *name, struct ipoddisk_node *child)
 {
-        int    ndup = 0;
-        gchar *new_key = g_strdup(key);
-        
-        while (g_datalist_get_data(&parent->nd_children, new_key)) {
-                ndup++;
-                g_free(new_key);
-                new_key = g_strdup_printf("(%d) %s", ndup, key);
+        struct ipoddisk_dirent *de;
+
+        if (dir->dir_nents == dir->dir_size) {
+                guint size = dir->dir_size ? dir->dir_size * 2 : 4;
+
+                dir->dir_ents = ipoddisk_arena_grow(arena, dir->dir_ents,
+                                        dir->dir_size * sizeof(*de),
+                                        size * sizeof(*de));
+                dir->dir_size = size;
         }
 
-        g_datalist_set_data(&parent->nd_children, new_key, child);
-        g_free(new_key);
+        de = &dir->dir_ents[dir->dir_nents++];
+        de->de_name = name;
+        de->de_hash = ipoddisk_name_hash(name, strlen(name));
+        de->de_ndup = 0;
+        de->de_node = child;
+
+        if (dir->dir_nents <= IPODDISK_DIR_LINEAR_MAX)
+                return;
+
+        /* keep the index at most 3/4 full */
+        if (dir->dir_slots == NULL ||
+            dir->dir_nents * 4 > (dir->dir_mask + 1) * 3) {
+                guint nslots = dir->dir_slots ? (dir->dir_mask + 1) * 2 : 32;
+
+                ipoddisk_dir_rehash(arena, dir, nslots);
+        } else {
+                guint slot = de->de_hash & dir->dir_mask;
+
+                while (dir->dir_slots[slot] != 0)
+                        slot = (slot + 1) & dir->dir_mask;
+                dir->dir_slots[slot] = dir->dir_nents;
+        }
 
         return;
 }
 
-static inline struct ipoddisk_node *
-ipoddisk_new_node (struct ipoddisk_node *parent, gchar *key,
-                   ipoddisk_node_type type)
+static struct ipoddisk_dirent *
+ipoddisk_dir_find (struct ipoddisk_dir *dir, const char *name, size_t len)
 {
-        struct ipoddisk_node *node = g_slice_new(struct ipoddisk_node);
+        guint hash;
+        guint i;
 
-        assert (parent == NULL || key != NULL);
+        hash = ipoddisk_name_hash(name, len);
 
-        node->nd_type = type;
+        if (dir->dir_slots == NULL) {
+                for (i = 0; i < dir->dir_nents; i++)
+                        if (ipoddisk_dirent_match(&dir->dir_ents[i],
+                                                  hash, name, len))
+                                return &dir->dir_ents[i];
+                return NULL;
+        }
 
-        if (type != IPODDISK_NODE_LEAF) /* leaf node has no children */
-                g_datalist_init(&node->nd_children);
+        for (i = hash & dir->dir_mask;
+             dir->dir_slots[i] != 0;
+             i = (i + 1) & dir->dir_mask) {
+                struct ipoddisk_dirent *de;
 
-        if (parent != NULL)
-                ipoddisk_add_child(parent, node, key);
+                de = &dir->dir_ents[dir->dir_slots[i] - 1];
+                if (ipoddisk_dirent_match(de, hash, name, len))
+                        return de;
+        }
 
-        return node;
+        return NULL;
 }
 
 /**
- * Adds a track into a tree structure
- * @param itdbtrk Pointer to the track's Itdb_Track structure
- * @param start Pointer to the root of the tree
- * @param track If not NULL, pointer to the node of the track
- * @param ipod Root node of this track
+ * Looks up a child among those built so far, for use while building
  */
-static void
-ipoddisk_add_track (Itdb_Track *itdbtrk,
-                    struct ipoddisk_node *start, struct ipoddisk_node *albums,
-                    struct ipoddisk_node *track, struct ipoddisk_ipod *ipod)
-{
-	struct ipoddisk_node *artist;
-	struct ipoddisk_node *album;
-	gchar                *track_ext;
-	gchar                *album_name;
-	gchar                *track_name;
-	gchar                *artist_name;
-
-	album_name  = itdbtrk->album ? itdbtrk->album : "Unknown Album";
-	track_name  = itdbtrk->title ? itdbtrk->title : "Unknown Track";
-	artist_name = itdbtrk->artist ? itdbtrk->artist : "Unknown Artist";
-
-	artist = g_datalist_get_data(&start->nd_children, artist_name);
-	if (!artist)
-		artist = ipoddisk_new_node(start, artist_name,
-                                           IPODDISK_NODE_DEFAULT);
-
-	album = g_datalist_get_data(&artist->nd_children, album_name);
-	if (!album) {
-		album = ipoddisk_new_node(artist, album_name,
-                                          IPODDISK_NODE_DEFAULT);
-                if (albums != NULL)
-                        ipoddisk_add_child(albums, album, album_name);
-        }
+static struct ipoddisk_node *
+ipoddisk_find_child (struct ipoddisk_node *parent, const char *name, size_t len)
+{
+        struct ipoddisk_dirent *de;
 
-        track_ext = ipod_get_track_extension(itdbtrk->ipod_path);
-        track_name = g_strconcat(track_name, track_ext, NULL);
+        assert (!IPODDISK_NODE_IS_FILE(parent));
 
-        if (track != NULL) {
-                ipoddisk_add_child(album, track, track_name);
-        } else {
-                track = ipoddisk_new_node(album, track_name,
-                                          IPODDISK_NODE_LEAF);
-                track->nd_children = (GData *) itdbtrk;
-                track->nd_data.track.trk_ipod = ipod;
-                itdbtrk->userdata = track;
-        }
+        de = ipoddisk_dir_find(&parent->nd_children, name, len);
 
-        g_free(track_name);
-	return;
+        return de ? de->de_node : NULL;
 }
 
-struct __add_member_arg {
-        char                 *prefixfmt;
-        int                   counter;
-        struct ipoddisk_node *ipod;
-        struct ipoddisk_node *playlist;
-};
+static struct ipoddisk_node *
+ipoddisk_search_node (struct ipoddisk_node *search, const char *query,
+                      size_t len);
+
+/**
+ * Returns the search result a node is part of
+ * @return NULL if it isn't, as it then lives as long as its subtree
+ */
+static inline struct ipoddisk_query *
+ipoddisk_node_query (struct ipoddisk_node *node)
+{
+        if (node->nd_type == IPODDISK_NODE_RESULT)
+                return node->nd_data.query;
+        if (node->nd_type == IPODDISK_NODE_MANIFEST &&
+            node->nd_data.manifest->mf_dir->nd_type == IPODDISK_NODE_RESULT)
+                return node->nd_data.manifest->mf_dir->nd_data.query;
+
+        return NULL;
+}
 
 static void
-ipoddisk_add_playlist_member (gpointer data, gpointer user_data)
-{
-	Itdb_Track              *itdbtrk = data;
-	struct __add_member_arg *argp = user_data;
-	struct ipoddisk_node    *track = itdbtrk->userdata;
-	gchar                   *track_ext;
-	gchar                   *track_name;
-
-	track_ext = ipod_get_track_extension(itdbtrk->ipod_path);
-	track_name = itdbtrk->title ? itdbtrk->title : "Unknown Track";
-        
-        if (argp->prefixfmt) {
-                gchar *prefix;
-
-                prefix = g_strdup_printf(argp->prefixfmt, argp->counter);
-                track_name = g_strconcat(prefix, track_name, track_ext, NULL);
-                
-                g_free(prefix);
-        } else {
-                track_name = g_strconcat(track_name, track_ext, NULL);
-        }
+ipoddisk_query_unref (struct ipoddisk_query *query)
+{
+        /* the query and its nodes live in the arena */
+        if (g_atomic_int_dec_and_test(&query->q_refs))
+                ipoddisk_arena_free(query->q_arena);
 
-        if (track == NULL) {
-                track = ipoddisk_new_node(argp->playlist, track_name,
-                                          IPODDISK_NODE_LEAF);
-                /* TODO: store itdbtrk in rack->nd_data.track */
-                track->nd_children = (GData *) itdbtrk;
-                track->nd_data.track.trk_ipod = &argp->ipod->nd_data.ipod;
-                itdbtrk->userdata = track;
-        } else {
-                ipoddisk_add_child(argp->playlist, track, track_name);
-        }
+        return;
+}
 
-	argp->counter++;
-        g_free(track_name);
-	return;
+/**
+ * Keeps a node that is already held alive until a matching
+ * ipoddisk_node_release. Only nodes of search results need this, and
+ * for all others it does nothing: they live as long as their subtree.
+ */
+void
+ipoddisk_node_hold (struct ipoddisk_node *node)
+{
+        struct ipoddisk_query *query = ipoddisk_node_query(node);
+
+        if (query == NULL)
+                return;
+
+        g_atomic_int_inc(&query->q_refs);
+        g_atomic_int_set(&query->q_used, 1);
+        return;
 }
 
+/**
+ * Lets go of a node returned by a lookup, or held with ipoddisk_node_hold
+ */
 void
-ipoddisk_build_ipod_node (struct ipoddisk_node *root, Itdb_iTunesDB *itdb)
+ipoddisk_node_release (struct ipoddisk_node *node)
 {
-        GList                *list;
-        struct ipoddisk_node *genres;
-        struct ipoddisk_node *albums;
-        struct ipoddisk_node *artists;
-        struct ipoddisk_node *compilations;
-        struct ipoddisk_node *playlists;
-
-        genres       = ipoddisk_new_node(root, "Genres", IPODDISK_NODE_DEFAULT);
-        albums       = ipoddisk_new_node(root, "Albums", IPODDISK_NODE_DEFAULT);
-        artists      = ipoddisk_new_node(root, "Artists", IPODDISK_NODE_DEFAULT);
-        playlists    = ipoddisk_new_node(root, "Playlists", IPODDISK_NODE_DEFAULT);
-        compilations = ipoddisk_new_node(root, "Compilations", IPODDISK_NODE_DEFAULT);
-
-        /* Populate iPodDisk/(Artists|Albums|Genres) */
-        list = itdb->tracks;
-        while (list) {
-                Itdb_Track           *itdbtrk = list->data;
-                struct ipoddisk_node *comp;
-                gchar                *comp_title;
-
-                list = g_list_next(list);
-
-                ipoddisk_encode_name(&itdbtrk->album);
-                ipoddisk_encode_name(&itdbtrk->title);
-                ipoddisk_encode_name(&itdbtrk->genre);
-                ipoddisk_encode_name(&itdbtrk->artist);
-
-                ipoddisk_add_track(itdbtrk, artists, albums,
-                                   NULL, &root->nd_data.ipod);
-
-                if (itdbtrk->genre != NULL && strlen(itdbtrk->genre) != 0) {
-                        struct ipoddisk_node *genre;
-                        
-                        genre = g_datalist_get_data(&genres->nd_children, itdbtrk->genre);
-                        if (genre == NULL)
-                                genre = ipoddisk_new_node(genres, itdbtrk->genre,
-                                                          IPODDISK_NODE_DEFAULT);
-                        ipoddisk_add_track(itdbtrk, genre, NULL,
-                                           (struct ipoddisk_node *) itdbtrk->userdata, NULL);
-                }
+        struct ipoddisk_query *query = ipoddisk_node_query(node);
 
-                if (!itdbtrk->compilation || /* not part of a compilation */
-                    itdbtrk->album == NULL || itdbtrk->title == NULL)
-                        continue;
+        if (query != NULL)
+                ipoddisk_query_unref(query);
 
-                comp = g_datalist_get_data(&compilations->nd_children, itdbtrk->album);
-                if (comp == NULL)
-                        comp = ipoddisk_new_node(compilations, itdbtrk->album,
-                                                 IPODDISK_NODE_DEFAULT);
+        return;
+}
 
-                comp_title = g_strconcat(itdbtrk->title,
-                                         ipod_get_track_extension(itdbtrk->ipod_path), 
-                                         NULL);
-                assert (itdbtrk->userdata != NULL);
-                ipoddisk_add_child(comp, itdbtrk->userdata, comp_title);
-                g_free(comp_title);
-        }
+/**
+ * Looks up a child by name; name need not be NUL-terminated. The child
+ * is held for the caller, see ipoddisk_node_release.
+ */
+struct ipoddisk_node *
+ipoddisk_get_child (struct ipoddisk_node *parent, const char *name, size_t len)
+{
+        struct ipoddisk_dirent *de;
 
-        /* Populate iPodDisk/Playlists */
-        list = itdb->playlists;
-        while (list) {
-                Itdb_Playlist          *itdbpl = list->data;
-                gchar                  *pl_name;
-                guint                   cnt;
-                struct ipoddisk_node   *pl;
-                struct __add_member_arg arg;
+        assert (!IPODDISK_NODE_IS_FILE(parent));
 
-                list = g_list_next(list);
+        if (parent->nd_type == IPODDISK_NODE_SEARCH)
+                return ipoddisk_search_node(parent, name, len);
 
-                if (itdb_playlist_is_mpl(itdbpl)) {
-                        pl_name = "Master Playlist";
-                        continue; /* ignore mpl for now, make it optional in the future */
-                } else {
-                        ipoddisk_encode_name(&itdbpl->name);
-                        pl_name = itdbpl->name ? itdbpl->name : "Unknown Playlist";
+        de = ipoddisk_dir_find(ipoddisk_node_dir(parent), name, len);
+        if (de == NULL)
+                return NULL;
+
+        /* parent is held, so the child's result can't go meanwhile */
+        ipoddisk_node_hold(de->de_node);
+        return de->de_node;
+}
+
+#undef IPODDISK_DIR_LINEAR_MAX
+
+/**
+ * Walks the tree one path component at a time, without allocating
+ * @return the node, held, or NULL
+ */
+static struct ipoddisk_node *
+ipoddisk_walk_path (struct ipoddisk_tree *tree, const char *path)
+{
+        struct ipoddisk_node *node;
+        struct ipoddisk_node *parent;
+        const char           *end;
+
+        node   =
+        parent = tree->tr_root;
+
+        while (*path) {
+                if (*path == '/') {
+                        path++;
+                        continue;
                 }
 
-                pl = g_datalist_get_data(&playlists->nd_children, pl_name);
-                if (pl == NULL)
-                        pl = ipoddisk_new_node(playlists, pl_name,
-                                               IPODDISK_NODE_DEFAULT);
-
-                cnt = g_list_length(itdbpl->members);
-                if (cnt == 1) {
-                        arg.prefixfmt = NULL;
-                } else if (cnt < 10) {
-                        arg.prefixfmt = "%d. ";
-                } else if (cnt < 100) {
-                        arg.prefixfmt = "%.2d. ";
-                } else if (cnt < 1000) {
-                        arg.prefixfmt = "%.3d. ";
-                } else {
-                        arg.prefixfmt = "%.4d. ";
+                end = strchr(path, '/');
+                if (end == NULL)
+                        end = path + strlen(path);
+
+                if (IPODDISK_NODE_IS_FILE(parent)) {
+                        ipoddisk_node_release(parent);
+                        return NULL;
                 }
 
-                arg.counter  = 1;
-                arg.playlist = pl;
-                arg.ipod     = root;
+                node = ipoddisk_get_child(parent, path, end - path);
+                ipoddisk_node_release(parent);
+                if (node == NULL)
+                        return NULL;
+                parent = node;
+                path   = end;
+        }
+
+        return node;
+}
+
+/*
+ * Full paths are indexed on first lookup, and so are misses, which
+ * Finder and desktop indexers probe for in every directory (.DS_Store,
+ * ._*, desktop.ini, ...). A tree never changes once published, so
+ * neither kind of entry goes stale. Search results are the exception:
+ * the paths of one are dropped when it is evicted, see
+ * ipoddisk_trees_forget.
+ */
+static struct ipoddisk_node *
+ipoddisk_lookup_path (struct ipoddisk_tree *tree, const char *path)
+{
+        struct ipoddisk_node  *node;
+        struct ipoddisk_query *query;
+        gboolean               missing;
+
+        pthread_rwlock_rdlock(&tree->tr_path_lock);
+        node    = g_hash_table_lookup(tree->tr_paths, path);
+        missing = node == NULL &&
+                  g_hash_table_lookup(tree->tr_misses, path) != NULL;
+        if (node != NULL)  /* indexed, so its result is still cached */
+                ipoddisk_node_hold(node);
+        pthread_rwlock_unlock(&tree->tr_path_lock);
+        if (node != NULL) {
+                ipoddisk_count(&ipoddisk_path_stats.ps_hits);
+                return node;
+        }
+        if (missing) {
+                ipoddisk_count(&ipoddisk_path_stats.ps_misses);
+                return NULL;
+        }
 
-		g_list_foreach(itdbpl->members,
-                               ipoddisk_add_playlist_member, &arg);
+        ipoddisk_count(&ipoddisk_path_stats.ps_walks);
+        node = ipoddisk_walk_path(tree, path);
+
+        pthread_rwlock_wrlock(&tree->tr_path_lock);
+        if (node != NULL) {
+                /* an evicted result may already have been dropped from
+                 * the index, it mustn't come back */
+                query = ipoddisk_node_query(node);
+                if (g_hash_table_lookup(tree->tr_paths, path) == NULL &&
+                    (query == NULL || !g_atomic_int_get(&query->q_evicted)))
+                        g_hash_table_insert(tree->tr_paths, g_strdup(path),
+                                            node);
+        } else if (g_hash_table_lookup(tree->tr_misses, path) == NULL) {
+                /* any name can be asked for, so keep a lid on them */
+                if (g_hash_table_size(tree->tr_misses) >= IPODDISK_MISSES_MAX)
+                        g_hash_table_remove_all(tree->tr_misses);
+                g_hash_table_insert(tree->tr_misses, g_strdup(path),
+                                    GINT_TO_POINTER(1));
         }
+        pthread_rwlock_unlock(&tree->tr_path_lock);
 
-        return;
+        return node;
 }
 
-gchar *
-ipoddisk_node_path (struct ipoddisk_node *node)
+/**
+ * Resolves a path in a tree, see ipoddisk_lookup_path
+ * @return the node, held for the caller (see ipoddisk_node_release), or
+ *         NULL if there is none
+ */
+struct ipoddisk_node *
+ipoddisk_parse_path (struct ipoddisk_tree *tree, const char *path, int len)
 {
-        gchar      *rpath; /* relative path */
-        gchar      *apath; /* absolute path */
-        Itdb_Track *track;
+        struct ipoddisk_node *node;
+        guint64               start;
 
-        assert(node->nd_type == IPODDISK_NODE_LEAF);
+        UNUSED(len);
 
-        track = (Itdb_Track *) node->nd_children;
-        rpath = g_strdup(track->ipod_path);
-        itdb_filename_ipod2fs(rpath);
+        start = ipoddisk_stats_clock();
+        node  = ipoddisk_lookup_path(tree, path);
+        ipoddisk_stats_add(IPODDISK_OP_TREE, start);
 
-        assert (*rpath == '/');
+        return node;
+}
+
+/* FIXME: assume track->ipod_path has an extension 
+   of 4 char, e.g. '.mp3', '.m4a'. */
+#define IPOD_TRACK_EXTENSION_LEN	4
+
+static inline gchar *
+ipod_get_track_extension (gchar * path)
+{
+	gchar *ext;
 
-	apath = g_strconcat(node->nd_data.track.trk_ipod->ipod_mp, rpath, NULL);
+        assert (strlen(path) > IPOD_TRACK_EXTENSION_LEN);
 
-        g_free(rpath);
-        return apath;
+	ext = path + strlen(path) - IPOD_TRACK_EXTENSION_LEN;
+	return ext;
 }
 
-struct ipoddisk_node *
-ipoddisk_init_one_ipod (gchar *dbfile)
+/* Bytes of a word, for scanning names a word at a time */
+#define IPODDISK_ONES   G_GUINT64_CONSTANT(0x0101010101010101)
+#define IPODDISK_HIGHS  G_GUINT64_CONSTANT(0x8080808080808080)
+
+/* Non-zero if some byte of w is zero; w must be ASCII-only */
+#define IPODDISK_HAS_ZERO(w)    (((w) - IPODDISK_ONES) & IPODDISK_HIGHS)
+
+/* Non-zero if some byte of the ASCII-only word w is c */
+#define IPODDISK_HAS_BYTE(w, c) IPODDISK_HAS_ZERO((w) ^ (IPODDISK_ONES * (c)))
+
+/* What a name needs to become a file name, see ipoddisk_encode_name */
+enum {
+        IPODDISK_NAME_ASIS,     /* nothing */
+        IPODDISK_NAME_ENCODE,   /* characters replaced */
+        IPODDISK_NAME_NORMALIZE /* that and normalizing, it isn't ASCII */
+};
+
+/**
+ * Works out what a name of len bytes needs, looking at 8 bytes at a
+ * time: most names are plain ASCII and need nothing
+ */
+static int
+ipoddisk_name_scan (const gchar *name, size_t len)
 {
-        struct ipoddisk_node *node;
-        Itdb_iTunesDB        *the_itdb;
+        int    need = name[0] == '.' ? IPODDISK_NAME_ENCODE
+                                     : IPODDISK_NAME_ASIS;
+        size_t i = 0;
+
+        for (; i + sizeof(guint64) <= len; i += sizeof(guint64)) {
+                guint64 w;
+
+                memcpy(&w, name + i, sizeof(w));
+                if (w & IPODDISK_HIGHS)
+                        return IPODDISK_NAME_NORMALIZE;
+                if (IPODDISK_HAS_BYTE(w, '/') || IPODDISK_HAS_BYTE(w, '\r') ||
+                    IPODDISK_HAS_BYTE(w, '\n'))
+                        need = IPODDISK_NAME_ENCODE;
+        }
 
-        the_itdb = itdb_parse_file(dbfile, &error);
-	if (error != NULL) {
-                fprintf(stderr,
-                        "itdb_parse_file() failed: %s!\n",
-                        error->message);
-		g_error_free(error);
-		error = NULL;
-                return NULL;
-	}
+        for (; i < len; i++) {
+                guchar c = name[i];
 
-	if (the_itdb == NULL)
-		return NULL;
+                if (c >= 0x80)
+                        return IPODDISK_NAME_NORMALIZE;
+                if (c == '/' || c == '\r' || c == '\n')
+                        need = IPODDISK_NAME_ENCODE;
+        }
 
-        node = ipoddisk_new_node(NULL, NULL, IPODDISK_NODE_IPOD);
-        node->nd_data.ipod.ipod_itdb = the_itdb;
+        return need;
+}
 
-        ipoddisk_build_ipod_node(node, the_itdb);
+#undef IPODDISK_HAS_BYTE
+#undef IPODDISK_HAS_ZERO
+#undef IPODDISK_HIGHS
+#undef IPODDISK_ONES
 
-        open(dbfile, O_RDONLY); /* leave me not, babe */
+/**
+ * Encodes a name from iTunesDB in place, to appease Finder:
+ * 0. leading . is treated as hidden file, encode as _
+ * 1. slash is Unix path separator, encode as :
+ * 2. \r and \n are problematic, encode as space
+ */
+static void
+ipoddisk_encode_name (gchar *name, size_t len)
+{
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                if (i == 0 && name[i] == '.')
+                        name[i] = '_';
+                else if (name[i] == '/')
+                        name[i] = ':';
+                else if (name[i] == '\r' || name[i] == '\n')
+                        name[i] = ' ';
+        }
 
-	return node;
+        return;
 }
 
-int
-ipoddisk_init_ipods (void)
+/**
+ * Returns the file name for a name from iTunesDB, encoded and then
+ * normalized to cope with tricky things like umlauts, in the arena of
+ * an iPod. Artists, albums and genres repeat over many tracks, so each
+ * distinct name goes through this once and its tracks share one copy.
+ * @param names Names seen so far, from iTunesDB to file name
+ */
+static gchar *
+ipoddisk_intern (struct ipoddisk_ipod *ipod, GHashTable *names,
+                 const gchar *str)
 {
-	int                  i;
-        int                  fsnr;
-	struct statfs        *stats = NULL;
+        gchar  *p;
+        gchar  *tmp;
+        gchar  *norm;
+        size_t  len;
 
-	fsnr = getfsstat(NULL, 0, MNT_NOWAIT);
-	if (fsnr <= 0)
-		return ENOENT;
+        if (str == NULL)
+                return NULL;
 
-	stats = g_malloc0(fsnr * sizeof(struct statfs));
-        if (stats == NULL)
-                return ENOMEM;
+        p = g_hash_table_lookup(names, str);
+        if (p != NULL)
+                return p;
+
+        len = strlen(str);
+        switch (len ? ipoddisk_name_scan(str, len) : IPODDISK_NAME_ASIS) {
+        case IPODDISK_NAME_ASIS:
+                p = ipoddisk_arena_strdup(ipod->ipod_arena, str);
+                break;
+        case IPODDISK_NAME_ENCODE:
+                /* ASCII is the same in any normal form */
+                p = ipoddisk_arena_strdup(ipod->ipod_arena, str);
+                ipoddisk_encode_name(p, len);
+                break;
+        default:
+                tmp = g_strndup(str, len);
+                ipoddisk_encode_name(tmp, len);
+                norm = g_utf8_normalize(tmp, len, G_NORMALIZE_NFD);
+                p = ipoddisk_arena_strdup(ipod->ipod_arena,
+                                          norm ? norm : tmp);
+                g_free(norm);
+                g_free(tmp);
+                break;
+        }
 
-	fsnr = getfsstat(stats, fsnr * sizeof(struct statfs), MNT_NOWAIT);
-	if (fsnr <= 0) {
-		g_free(stats);
-		return ENOENT;
+        /* keyed by the iTunesDB string, which outlives the table */
+        g_hash_table_insert(names, (gpointer) str, p);
+        return p;
+}
+
+/**
+ * Adds a child to a parent node, and enure uniqueness of its key
+ *
+ * The k-th duplicate of a key becomes "(k) key". The base entry remembers
+ * the last k handed out, so adding another duplicate does not re-probe
+ * "(1) key", "(2) key", ... from the start.
+ */
+static void
+ipoddisk_add_child (struct ipoddisk_arena *arena, struct ipoddisk_node *parent,
+                    struct ipoddisk_node *child, const gchar *key)
+{
+        guint                   ndup;
+        gchar                  *new_key;
+        struct ipoddisk_dir    *dir = &parent->nd_children;
+        struct ipoddisk_dirent *base;
+
+        base = ipoddisk_dir_find(dir, key, strlen(key));
+        if (base == NULL) {
+                ipoddisk_dir_insert(arena, dir,
+                                    ipoddisk_arena_strdup(arena, key), child);
+                return;
         }
 
-        ipoddisk_tree = ipoddisk_new_node(NULL, NULL, IPODDISK_NODE_ROOT);
+        /* "(k) key" may also exist as a name in its own right */
+        ndup    = base->de_ndup + 1;
+        new_key = g_strdup_printf("(%d) %s", ndup, key);
+        while (ipoddisk_dir_find(dir, new_key, strlen(new_key))) {
+                ndup++;
+                g_free(new_key);
+                new_key = g_strdup_printf("(%d) %s", ndup, key);
+        }
 
-        for (i = 0, ipodnr = 0; i < fsnr && ipodnr < IPODDISK_MAX_IPOD; i++) {
-                gchar                *dbpath;
-                gchar                *ipodname;
-                struct ipoddisk_node *node;
+        base->de_ndup = ndup; /* before insert moves dir_ents */
+        ipoddisk_dir_insert(arena, dir,
+                            ipoddisk_arena_strdup(arena, new_key), child);
+        g_free(new_key);
 
-                if (strncasecmp(stats[i].f_mntfromname,
-                                CONST_STR_LEN("/dev/disk")))
-                        continue;  /* fs not disk-based */
+        return;
+}
 
-                if (!strcmp(stats[i].f_mntonname, "/"))
-                        continue;  /* skip root fs */
+/**
+ * Allocates a node of an iPod subtree being built, and links it under
+ * parent. Nodes of views built later aren't tracked in ipod_nodes, as
+ * snapshots leave views out.
+ */
+static inline struct ipoddisk_node *
+ipoddisk_new_node (struct ipoddisk_ipod *ipod, struct ipoddisk_node *parent,
+                   const gchar *key, ipoddisk_node_type type)
+{
+        struct ipoddisk_node *node;
 
-                dbpath = g_strconcat(stats[i].f_mntonname,
-                                     "/iPod_Control/iTunes/iTunesDB", NULL);
+        assert (parent != NULL && key != NULL);
 
-                if (strlen(dbpath) >= MAXPATHLEN ||
-                    !g_file_test(dbpath, G_FILE_TEST_EXISTS) ||
-                    !g_file_test(dbpath, G_FILE_TEST_IS_REGULAR)) {
-                        g_free(dbpath);
-                        continue;
-                }
+        node = ipoddisk_arena_alloc(ipod->ipod_arena, sizeof(*node));
+        node->nd_type = type;
 
-                node = ipoddisk_init_one_ipod(dbpath);
-                if (node == NULL) {
-                        g_free(dbpath);
-                        continue;
-                }
+        if (ipod->ipod_nodes != NULL)
+                g_ptr_array_add(ipod->ipod_nodes, node);
+        ipoddisk_add_child(ipod->ipod_arena, parent, node, key);
+
+        return node;
+}
 
-                ipodname = g_path_get_basename(stats[i].f_mntonname);
-                ipoddisk_add_child(ipoddisk_tree, node, ipodname);
-                node->nd_data.ipod.ipod_mp = g_strdup(stats[i].f_mntonname);
+/**
+ * Allocates a track table with room for count tracks; it starts empty
+ */
+void
+ipoddisk_tracks_alloc (struct ipoddisk_arena *arena,
+                       struct ipoddisk_tracks *tracks, guint count)
+{
+#define TRACKS_COLUMN(col) \
+        tracks->col = ipoddisk_arena_alloc(arena, count * sizeof(*tracks->col))
+
+        tracks->tt_count = 0;
+        TRACKS_COLUMN(tt_path);
+        TRACKS_COLUMN(tt_size);
+        TRACKS_COLUMN(tt_mtime);
+        TRACKS_COLUMN(tt_fsize);
+        TRACKS_COLUMN(tt_fmtime);
+        TRACKS_COLUMN(tt_checked);
+        TRACKS_COLUMN(tt_title);
+        TRACKS_COLUMN(tt_album);
+        TRACKS_COLUMN(tt_artist);
+        TRACKS_COLUMN(tt_genre);
+        TRACKS_COLUMN(tt_compilation);
+        TRACKS_COLUMN(tt_track_nr);
+        TRACKS_COLUMN(tt_cd_nr);
+        TRACKS_COLUMN(tt_year);
+        TRACKS_COLUMN(tt_added);
+        TRACKS_COLUMN(tt_length);
+        TRACKS_COLUMN(tt_played);
+        TRACKS_COLUMN(tt_playcount);
+        TRACKS_COLUMN(tt_rating);
+        TRACKS_COLUMN(tt_leaf);
+
+#undef TRACKS_COLUMN
+        return;
+}
 
-                ipods[ipodnr] = node;
-                ipodnr++;
-                
-                g_free(dbpath);
-                g_free(ipodname);
+/**
+ * Copies what we need of the tracks and playlists of an iTunesDB into
+ * the track table and playlists of its iPod, encoding names on the way
+ */
+static void
+ipoddisk_init_tracks (struct ipoddisk_ipod *ipod, Itdb_iTunesDB *itdb)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        GHashTable             *names;
+        GList                  *list;
+        guint                   n;
+
+        names = g_hash_table_new(g_str_hash, g_str_equal);
+        ipoddisk_tracks_alloc(ipod->ipod_arena, tt,
+                              g_list_length(itdb->tracks));
+
+        for (list = itdb->tracks; list != NULL; list = g_list_next(list)) {
+                Itdb_Track *itdbtrk = list->data;
+                guint       i = tt->tt_count++;
+
+                tt->tt_path[i] = ipoddisk_arena_strdup(ipod->ipod_arena,
+                                                       itdbtrk->ipod_path);
+                itdb_filename_ipod2fs(tt->tt_path[i]);
+                assert (*tt->tt_path[i] == '/');
+                tt->tt_size[i]        = itdbtrk->size;
+                tt->tt_mtime[i]       = itdbtrk->time_modified;
+                tt->tt_title[i]       = ipoddisk_intern(ipod, names,
+                                                        itdbtrk->title);
+                tt->tt_album[i]       = ipoddisk_intern(ipod, names,
+                                                        itdbtrk->album);
+                tt->tt_artist[i]      = ipoddisk_intern(ipod, names,
+                                                        itdbtrk->artist);
+                tt->tt_genre[i]       = ipoddisk_intern(ipod, names,
+                                                        itdbtrk->genre);
+                tt->tt_compilation[i] = itdbtrk->compilation != 0;
+                tt->tt_track_nr[i]    = CLAMP(itdbtrk->track_nr, 0, G_MAXUINT16);
+                tt->tt_cd_nr[i]       = CLAMP(itdbtrk->cd_nr, 0, G_MAXUINT16);
+                tt->tt_year[i]        = CLAMP(itdbtrk->year, 0, G_MAXUINT16);
+                tt->tt_added[i]       = itdbtrk->time_added;
+                tt->tt_length[i]      = MAX(itdbtrk->tracklen, 0);
+                tt->tt_played[i]      = itdbtrk->time_played;
+                tt->tt_playcount[i]   = itdbtrk->playcount;
+                tt->tt_rating[i]      = MIN(itdbtrk->rating, 100);
+
+                itdbtrk->userdata = GUINT_TO_POINTER(i + 1);
         }
 
-        g_free(stats);
+        n = 0;
+        for (list = itdb->playlists; list != NULL; list = g_list_next(list))
+                n++;
+        ipod->ipod_playlists = ipoddisk_arena_alloc(ipod->ipod_arena,
+                                  n * sizeof(struct ipoddisk_playlist));
 
-        if (ipodnr == 0)
-                return ENOENT;
+        for (list = itdb->playlists; list != NULL; list = g_list_next(list)) {
+                Itdb_Playlist            *itdbpl = list->data;
+                struct ipoddisk_playlist *pl;
+                GList                    *member;
+
+                if (itdb_playlist_is_mpl(itdbpl))
+                        continue; /* ignore mpl for now, make it optional in the future */
+
+                pl = &ipod->ipod_playlists[ipod->ipod_nplaylists++];
+                pl->pl_name   = ipoddisk_intern(ipod, names, itdbpl->name);
+                pl->pl_tracks = ipoddisk_arena_alloc(ipod->ipod_arena,
+                                  g_list_length(itdbpl->members) * sizeof(guint));
 
-        if (ipodnr == 1) {
-                ipoddisk_tree = ipods[0];
-                ipoddisk_tree->nd_type = IPODDISK_NODE_ROOT;
+                /* every member is also in itdb->tracks, and got its
+                 * slot in the track table from there */
+                for (member = itdbpl->members; member != NULL;
+                     member = g_list_next(member)) {
+                        Itdb_Track *itdbtrk = member->data;
+
+                        if (itdbtrk->userdata != NULL)
+                                pl->pl_tracks[pl->pl_ntracks++] =
+                                        GPOINTER_TO_UINT(itdbtrk->userdata) - 1;
+                }
         }
 
-        return 0;
+        g_hash_table_destroy(names);
+        return;
 }
 
+/**
+ * Records the real attributes of a track from its opened backing file.
+ * Only the first open of each track pays for the fstat; the tree is
+ * otherwise read-only, so this is published with an atomic flag rather
+ * than a lock that getattr would have to take.
+ */
 void
-ipod_free(void)
+ipoddisk_track_check (struct ipoddisk_node *node, int fd)
 {
-	/* no need to clean up:
-           if (the_itdb)
-                   itdb_free(the_itdb);
-	   if (artists)
-	   g_datalist_clear(&artists);
-	   if (playlists)
-	   g_datalist_clear(&playlists);
-	 */
+        struct stat             st;
+        struct ipoddisk_tracks *tt = &node->nd_data.track.trk_ipod->ipod_tracks;
+        guint                   i = node->nd_data.track.trk_index;
 
-	/* TODO: clear datalists within artists and playlists */
+        if (!g_atomic_int_compare_and_exchange(&tt->tt_checked[i],
+                                               IPODDISK_TRACK_UNCHECKED,
+                                               IPODDISK_TRACK_CHECKING))
+                return;
 
-	return;
+        if (fstat(fd, &st) == -1) {
+                g_atomic_int_set(&tt->tt_checked[i], IPODDISK_TRACK_UNCHECKED);
+                return;
+        }
+
+        tt->tt_fsize[i]  = st.st_size;
+        tt->tt_fmtime[i] = st.st_mtime;
+        g_atomic_int_set(&tt->tt_checked[i], IPODDISK_TRACK_CHECKED);
+        return;
+}
+
+/**
+ * Returns the size and mtime getattr should report for a track
+ */
+void
+ipoddisk_track_attr (struct ipoddisk_node *node, off_t *size, time_t *mtime)
+{
+        struct ipoddisk_tracks *tt = &node->nd_data.track.trk_ipod->ipod_tracks;
+        guint                   i = node->nd_data.track.trk_index;
+
+        if (g_atomic_int_get(&tt->tt_checked[i]) == IPODDISK_TRACK_CHECKED) {
+                *size  = tt->tt_fsize[i];
+                *mtime = tt->tt_fmtime[i];
+        } else {
+                *size  = tt->tt_size[i];
+                *mtime = tt->tt_mtime[i];
+        }
+
+        return;
+}
+
+/**
+ * Tells whether the attributes of a track are those of its file, rather
+ * than the iTunesDB's, which may be off until ipoddisk_track_check
+ */
+gboolean
+ipoddisk_track_checked (struct ipoddisk_node *node)
+{
+        struct ipoddisk_tracks *tt = &node->nd_data.track.trk_ipod->ipod_tracks;
+        guint                   i = node->nd_data.track.trk_index;
+
+        return g_atomic_int_get(&tt->tt_checked[i]) == IPODDISK_TRACK_CHECKED;
+}
+
+/**
+ * Appends a track's file name, e.g. "Title.mp3", to the scratch string
+ */
+static void
+ipoddisk_append_track_name (struct ipoddisk_ipod *ipod, guint i)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+
+        g_string_append(ipod->ipod_scratch,
+                        tt->tt_title[i] ? tt->tt_title[i] : "Unknown Track");
+        g_string_append(ipod->ipod_scratch,
+                        ipod_get_track_extension(tt->tt_path[i]));
+        return;
+}
+
+/**
+ * Adds a track into a tree structure, as start/artist/album/track
+ * @param ipod iPod of this track, owner of new nodes
+ * @param i Index of the track in the track table
+ * @param start Pointer to the root of the tree
+ * @param track If not NULL, pointer to the node of the track
+ */
+static void
+ipoddisk_add_track (struct ipoddisk_ipod *ipod, guint i,
+                    struct ipoddisk_node *start, struct ipoddisk_node *track)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+	struct ipoddisk_node   *artist;
+	struct ipoddisk_node   *album;
+	const gchar            *album_name;
+	const gchar            *artist_name;
+
+	album_name  = tt->tt_album[i] ? tt->tt_album[i] : "Unknown Album";
+	artist_name = tt->tt_artist[i] ? tt->tt_artist[i] : "Unknown Artist";
+
+	artist = ipoddisk_find_child(start, artist_name, strlen(artist_name));
+	if (!artist)
+		artist = ipoddisk_new_node(ipod, start, artist_name,
+                                           IPODDISK_NODE_DEFAULT);
+
+	album = ipoddisk_find_child(artist, album_name, strlen(album_name));
+	if (!album)
+		album = ipoddisk_new_node(ipod, artist, album_name,
+                                          IPODDISK_NODE_DEFAULT);
+
+        g_string_truncate(ipod->ipod_scratch, 0);
+        ipoddisk_append_track_name(ipod, i);
+
+        if (track != NULL) {
+                ipoddisk_add_child(ipod->ipod_arena, album, track,
+                                   ipod->ipod_scratch->str);
+        } else {
+                track = ipoddisk_new_node(ipod, album, ipod->ipod_scratch->str,
+                                          IPODDISK_NODE_LEAF);
+                track->nd_data.track.trk_ipod  = ipod;
+                track->nd_data.track.trk_index = i;
+                tt->tt_leaf[i] = track;
+        }
+
+	return;
+}
+
+/**
+ * Returns the child of parent named name, creating a directory for it
+ * if there is none
+ */
+static struct ipoddisk_node *
+ipoddisk_get_dir (struct ipoddisk_ipod *ipod, struct ipoddisk_node *parent,
+                  const gchar *name)
+{
+        struct ipoddisk_node *node;
+
+        node = ipoddisk_find_child(parent, name, strlen(name));
+        if (node == NULL)
+                node = ipoddisk_new_node(ipod, parent, name,
+                                         IPODDISK_NODE_DEFAULT);
+
+        return node;
+}
+
+/**
+ * Gives a directory of tracks its manifests, see ipoddisk_manifest.c
+ * @param arena Where dir lives, and its manifests go
+ * @param album List tracks in disc and track order, not as dir does
+ */
+static void
+ipoddisk_add_manifests (struct ipoddisk_ipod *ipod, struct ipoddisk_arena *arena,
+                        struct ipoddisk_node *dir, gboolean album)
+{
+        static const struct {
+                const gchar            *name;
+                ipoddisk_manifest_type  type;
+        } manifests[] = {
+                { IPODDISK_M3U8_NAME, IPODDISK_MANIFEST_M3U8 },
+                { IPODDISK_JSON_NAME, IPODDISK_MANIFEST_JSON },
+        };
+        guint m;
+
+        for (m = 0; m < G_N_ELEMENTS(manifests); m++) {
+                struct ipoddisk_manifest *mf;
+                struct ipoddisk_node     *node;
+
+                mf = ipoddisk_arena_alloc(arena, sizeof(*mf));
+                mf->mf_ipod  = ipod;
+                mf->mf_dir   = dir;
+                mf->mf_arena = arena;
+                mf->mf_type  = manifests[m].type;
+                mf->mf_album = album;
+
+                if (arena == ipod->ipod_arena) {
+                        node = ipoddisk_new_node(ipod, dir, manifests[m].name,
+                                                 IPODDISK_NODE_MANIFEST);
+                } else {
+                        node = ipoddisk_arena_alloc(arena, sizeof(*node));
+                        node->nd_type = IPODDISK_NODE_MANIFEST;
+                        ipoddisk_add_child(arena, dir, node,
+                                           manifests[m].name);
+                }
+                node->nd_data.manifest = mf;
+        }
+
+        return;
+}
+
+/**
+ * Gives the directories of tracks below node their manifests, once all
+ * their tracks are in
+ */
+static void
+ipoddisk_add_manifests_below (struct ipoddisk_ipod *ipod,
+                              struct ipoddisk_node *node, gboolean album)
+{
+        struct ipoddisk_dir *dir = &node->nd_children;
+        gboolean             tracks = FALSE;
+        guint                j;
+
+        for (j = 0; j < dir->dir_nents; j++) {
+                struct ipoddisk_node *child = dir->dir_ents[j].de_node;
+
+                if (child->nd_type == IPODDISK_NODE_LEAF)
+                        tracks = TRUE;
+                else if (child->nd_type == IPODDISK_NODE_DEFAULT)
+                        ipoddisk_add_manifests_below(ipod, child, album);
+        }
+
+        if (tracks)
+                ipoddisk_add_manifests(ipod, ipod->ipod_arena, node, album);
+
+        return;
+}
+
+/* Populate iPodDisk/Albums, sharing the album nodes of Artists */
+static void
+ipoddisk_build_albums (struct ipoddisk_ipod *ipod, struct ipoddisk_node *albums)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        struct ipoddisk_node   *artists;
+        GHashTable             *seen;
+        guint                   i;
+
+        artists = ipoddisk_find_child(ipod->ipod_node, CONST_STR_LEN("Artists"));
+        seen    = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        for (i = 0; i < tt->tt_count; i++) {
+                struct ipoddisk_node *artist;
+                struct ipoddisk_node *album;
+                const gchar          *album_name;
+                const gchar          *artist_name;
+
+                album_name  = tt->tt_album[i] ? tt->tt_album[i] : "Unknown Album";
+                artist_name = tt->tt_artist[i] ? tt->tt_artist[i] : "Unknown Artist";
+
+                artist = ipoddisk_find_child(artists, artist_name,
+                                             strlen(artist_name));
+                album  = artist ? ipoddisk_find_child(artist, album_name,
+                                                      strlen(album_name))
+                                : NULL;
+                if (album == NULL || g_hash_table_lookup(seen, album))
+                        continue;
+
+                g_hash_table_insert(seen, album, album);
+                ipoddisk_add_child(ipod->ipod_arena, albums, album, album_name);
+        }
+
+        g_hash_table_destroy(seen);
+        return;
+}
+
+/* Populate iPodDisk/Genres */
+static void
+ipoddisk_build_genres (struct ipoddisk_ipod *ipod, struct ipoddisk_node *genres)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        guint                   i;
+
+        for (i = 0; i < tt->tt_count; i++) {
+                if (tt->tt_genre[i] == NULL || *tt->tt_genre[i] == '\0')
+                        continue;
+
+                ipoddisk_add_track(ipod, i,
+                                   ipoddisk_get_dir(ipod, genres, tt->tt_genre[i]),
+                                   tt->tt_leaf[i]);
+        }
+
+        ipoddisk_add_manifests_below(ipod, genres, TRUE);
+        return;
+}
+
+/* Populate iPodDisk/Compilations */
+static void
+ipoddisk_build_compilations (struct ipoddisk_ipod *ipod,
+                             struct ipoddisk_node *compilations)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        guint                   i;
+
+        for (i = 0; i < tt->tt_count; i++) {
+                struct ipoddisk_node *comp;
+
+                if (!tt->tt_compilation[i] || /* not part of a compilation */
+                    tt->tt_album[i] == NULL || tt->tt_title[i] == NULL)
+                        continue;
+
+                comp = ipoddisk_get_dir(ipod, compilations, tt->tt_album[i]);
+
+                g_string_truncate(ipod->ipod_scratch, 0);
+                ipoddisk_append_track_name(ipod, i);
+                ipoddisk_add_child(ipod->ipod_arena, comp, tt->tt_leaf[i],
+                                   ipod->ipod_scratch->str);
+        }
+
+        ipoddisk_add_manifests_below(ipod, compilations, TRUE);
+        return;
+}
+
+/**
+ * Adds tracks to dir in the given order, numbered so that they list in
+ * that order too, e.g. "01. Title.mp3"
+ */
+static void
+ipoddisk_add_numbered (struct ipoddisk_ipod *ipod, struct ipoddisk_node *dir,
+                       const guint *tracks, guint ntracks)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        const char             *prefixfmt;
+        guint                   j;
+
+        if (ntracks == 1) {
+                prefixfmt = NULL;
+        } else if (ntracks < 10) {
+                prefixfmt = "%d. ";
+        } else if (ntracks < 100) {
+                prefixfmt = "%.2d. ";
+        } else if (ntracks < 1000) {
+                prefixfmt = "%.3d. ";
+        } else {
+                prefixfmt = "%.4d. ";
+        }
+
+        for (j = 0; j < ntracks; j++) {
+                guint i = tracks[j];
+
+                if (prefixfmt)
+                        g_string_printf(ipod->ipod_scratch, prefixfmt, j + 1);
+                else
+                        g_string_truncate(ipod->ipod_scratch, 0);
+                ipoddisk_append_track_name(ipod, i);
+
+                ipoddisk_add_child(ipod->ipod_arena, dir, tt->tt_leaf[i],
+                                   ipod->ipod_scratch->str);
+        }
+
+        return;
+}
+
+/* Populate iPodDisk/Playlists */
+static void
+ipoddisk_build_playlists (struct ipoddisk_ipod *ipod,
+                          struct ipoddisk_node *playlists)
+{
+        guint p;
+
+        for (p = 0; p < ipod->ipod_nplaylists; p++) {
+                struct ipoddisk_playlist *itpl = &ipod->ipod_playlists[p];
+                struct ipoddisk_node     *pl;
+
+                pl = ipoddisk_get_dir(ipod, playlists, itpl->pl_name ?
+                                      itpl->pl_name : "Unknown Playlist");
+                ipoddisk_add_numbered(ipod, pl, itpl->pl_tracks,
+                                      itpl->pl_ntracks);
+        }
+
+        /* after all, as playlists of the same name share a directory */
+        ipoddisk_add_manifests_below(ipod, playlists, FALSE);
+        return;
+}
+
+/* Orders of the smart views: < 0 if track a comes before track b.
+ * Ties go to the track listed first in iTunesDB. */
+typedef int (*ipoddisk_rank_fn) (struct ipoddisk_tracks *tt, guint a, guint b);
+
+#define IPODDISK_RANK(x, y)     ((x) > (y) ? -1 : (x) < (y) ? 1 : 0)
+
+static int
+ipoddisk_rank_recent (struct ipoddisk_tracks *tt, guint a, guint b)
+{
+        int r = IPODDISK_RANK(tt->tt_added[a], tt->tt_added[b]);
+
+        return r ? r : IPODDISK_RANK(b, a);
+}
+
+static int
+ipoddisk_rank_most_played (struct ipoddisk_tracks *tt, guint a, guint b)
+{
+        int r = IPODDISK_RANK(tt->tt_playcount[a], tt->tt_playcount[b]);
+
+        if (r == 0)
+                r = IPODDISK_RANK(tt->tt_played[a], tt->tt_played[b]);
+        return r ? r : IPODDISK_RANK(b, a);
+}
+
+static int
+ipoddisk_rank_top_rated (struct ipoddisk_tracks *tt, guint a, guint b)
+{
+        int r = IPODDISK_RANK(tt->tt_rating[a], tt->tt_rating[b]);
+
+        if (r == 0)
+                r = IPODDISK_RANK(tt->tt_playcount[a], tt->tt_playcount[b]);
+        return r ? r : IPODDISK_RANK(b, a);
+}
+
+/* Moves heap[k] down to its place in a heap of n tracks with the last
+ * in rank order on top */
+static void
+ipoddisk_heap_down (struct ipoddisk_tracks *tt, ipoddisk_rank_fn rank,
+                    guint *heap, guint n, guint k)
+{
+        guint i = heap[k];
+
+        for (;;) {
+                guint c = 2 * k + 1;
+
+                if (c >= n)
+                        break;
+                if (c + 1 < n && rank(tt, heap[c + 1], heap[c]) > 0)
+                        c++;
+                if (rank(tt, heap[c], i) <= 0)
+                        break;
+                heap[k] = heap[c];
+                k = c;
+        }
+        heap[k] = i;
+
+        return;
+}
+
+static gboolean
+ipoddisk_was_played (struct ipoddisk_tracks *tt, guint i)
+{
+        return tt->tt_playcount[i] != 0;
+}
+
+static gboolean
+ipoddisk_is_rated (struct ipoddisk_tracks *tt, guint i)
+{
+        return tt->tt_rating[i] != 0;
+}
+
+/**
+ * Picks the first max tracks in rank order among those keep accepts,
+ * without sorting the whole table: a heap keeps the best max tracks seen
+ * so far with the worst of them on top, so a track that ranks below it
+ * costs one comparison.
+ * @param keep NULL to consider all tracks
+ * @param top Room for max tracks, gets those picked in rank order
+ * @return number of tracks picked
+ */
+static guint
+ipoddisk_top_tracks (struct ipoddisk_tracks *tt, ipoddisk_rank_fn rank,
+                     gboolean (*keep) (struct ipoddisk_tracks *tt, guint i),
+                     guint max, guint *top)
+{
+        guint n = 0;
+        guint i;
+
+        if (max == 0)
+                return 0;
+
+        for (i = 0; i < tt->tt_count; i++) {
+                guint k;
+
+                if (keep != NULL && !keep(tt, i))
+                        continue;
+
+                if (n < max) {
+                        /* sift up */
+                        for (k = n++; k > 0 &&
+                                      rank(tt, top[(k - 1) / 2], i) < 0;
+                             k = (k - 1) / 2)
+                                top[k] = top[(k - 1) / 2];
+                        top[k] = i;
+                } else if (rank(tt, i, top[0]) < 0) {
+                        top[0] = i;
+                        ipoddisk_heap_down(tt, rank, top, n, 0);
+                }
+        }
+
+        /* heapsort what is left: the worst goes to the end */
+        for (i = n; i > 1; i--) {
+                guint worst = top[0];
+
+                top[0] = top[i - 1];
+                top[i - 1] = worst;
+                ipoddisk_heap_down(tt, rank, top, i - 1, 0);
+        }
+
+        return n;
+}
+
+/* Populate iPodDisk/Recently Added, Most Played or Top Rated */
+static void
+ipoddisk_build_smart (struct ipoddisk_ipod *ipod, struct ipoddisk_node *node,
+                      ipoddisk_view_type type)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        guint                   max = MIN(ipoddisk_opts.smart_size,
+                                          tt->tt_count);
+        guint                  *top = g_new(guint, MAX(max, 1));
+        guint                   n = 0;
+
+        switch (type) {
+        case IPODDISK_VIEW_RECENT:
+                n = ipoddisk_top_tracks(tt, ipoddisk_rank_recent, NULL,
+                                        max, top);
+                break;
+        case IPODDISK_VIEW_MOST_PLAYED:
+                n = ipoddisk_top_tracks(tt, ipoddisk_rank_most_played,
+                                        ipoddisk_was_played, max, top);
+                break;
+        case IPODDISK_VIEW_TOP_RATED:
+                n = ipoddisk_top_tracks(tt, ipoddisk_rank_top_rated,
+                                        ipoddisk_is_rated, max, top);
+                break;
+        default:
+                break;
+        }
+
+        ipoddisk_add_numbered(ipod, node, top, n);
+        ipoddisk_add_manifests_below(ipod, node, FALSE);
+
+        g_free(top);
+        return;
+}
+
+/**
+ * Builds a view directory nobody has looked into yet. Views are built
+ * into the same arena as the rest of the subtree, one at a time.
+ */
+static void
+ipoddisk_view_build (struct ipoddisk_node *node)
+{
+        struct ipoddisk_ipod *ipod = node->nd_data.view.vw_ipod;
+
+        pthread_mutex_lock(&ipod->ipod_view_lock);
+
+        ipod->ipod_scratch = g_string_sized_new(256);
+
+        switch (node->nd_data.view.vw_pending) {
+        case IPODDISK_VIEW_GENRES:
+                ipoddisk_build_genres(ipod, node);
+                break;
+        case IPODDISK_VIEW_ALBUMS:
+                ipoddisk_build_albums(ipod, node);
+                break;
+        case IPODDISK_VIEW_PLAYLISTS:
+                ipoddisk_build_playlists(ipod, node);
+                break;
+        case IPODDISK_VIEW_COMPILATIONS:
+                ipoddisk_build_compilations(ipod, node);
+                break;
+        case IPODDISK_VIEW_RECENT:
+        case IPODDISK_VIEW_MOST_PLAYED:
+        case IPODDISK_VIEW_TOP_RATED:
+                ipoddisk_build_smart(ipod, node,
+                                     node->nd_data.view.vw_pending);
+                break;
+        default:  /* built while we were waiting */
+                break;
+        }
+
+        g_string_free(ipod->ipod_scratch, TRUE);
+        ipod->ipod_scratch = NULL;
+
+        /* publishes the children to readers that find it unset */
+        g_atomic_int_set(&node->nd_data.view.vw_pending, IPODDISK_VIEW_NONE);
+
+        pthread_mutex_unlock(&ipod->ipod_view_lock);
+        return;
+}
+
+/**
+ * Returns the children of a directory node, building them first if it
+ * is a view that hasn't been built yet
+ */
+struct ipoddisk_dir *
+ipoddisk_node_dir (struct ipoddisk_node *node)
+{
+        if (node->nd_type == IPODDISK_NODE_DEFAULT &&
+            g_atomic_int_get(&node->nd_data.view.vw_pending) !=
+            IPODDISK_VIEW_NONE)
+                ipoddisk_view_build(node);
+
+        return &node->nd_children;
+}
+
+static void
+ipoddisk_query_lru_unlink (struct ipoddisk_ipod *ipod,
+                           struct ipoddisk_query *query)
+{
+        if (query->q_prev != NULL)
+                query->q_prev->q_next = query->q_next;
+        else
+                ipod->ipod_query_head = query->q_next;
+
+        if (query->q_next != NULL)
+                query->q_next->q_prev = query->q_prev;
+        else
+                ipod->ipod_query_tail = query->q_prev;
+
+        query->q_prev = query->q_next = NULL;
+        return;
+}
+
+static void
+ipoddisk_query_lru_push (struct ipoddisk_ipod *ipod,
+                         struct ipoddisk_query *query)
+{
+        query->q_prev = NULL;
+        query->q_next = ipod->ipod_query_head;
+        if (ipod->ipod_query_head != NULL)
+                ipod->ipod_query_head->q_prev = query;
+        else
+                ipod->ipod_query_tail = query;
+        ipod->ipod_query_head = query;
+        return;
+}
+
+/**
+ * Runs a query and makes a directory of the tracks it finds, named
+ * "Artist - Title.mp3", called with ipod_view_lock held
+ * @return the result, unreferenced
+ */
+static struct ipoddisk_query *
+ipoddisk_query_new (struct ipoddisk_ipod *ipod, const gchar *key, size_t len)
+{
+        struct ipoddisk_tracks *tt = &ipod->ipod_tracks;
+        struct ipoddisk_arena  *arena;
+        struct ipoddisk_query  *query;
+        struct ipoddisk_node   *node;
+        GArray                 *tracks;
+        guint                   j;
+
+        ipoddisk_search_build(ipod);
+        tracks = ipoddisk_search_run(ipod, key, len);
+
+        arena = ipoddisk_arena_new_sized(IPODDISK_QUERY_CHUNK);
+        query = ipoddisk_arena_alloc(arena, sizeof(*query));
+        node  = ipoddisk_arena_alloc(arena, sizeof(*node));
+        query->q_key   = ipoddisk_arena_strdup(arena, key);
+        query->q_ipod  = ipod;
+        query->q_node  = node;
+        query->q_arena = arena;
+        node->nd_type       = IPODDISK_NODE_RESULT;
+        node->nd_data.query = query;
+
+        ipod->ipod_scratch = g_string_sized_new(256);
+        for (j = 0; j < tracks->len; j++) {
+                guint i = g_array_index(tracks, guint, j);
+
+                g_string_assign(ipod->ipod_scratch, tt->tt_artist[i] ?
+                                tt->tt_artist[i] : "Unknown Artist");
+                g_string_append(ipod->ipod_scratch, " - ");
+                ipoddisk_append_track_name(ipod, i);
+
+                ipoddisk_add_child(arena, node, tt->tt_leaf[i],
+                                   ipod->ipod_scratch->str);
+        }
+        if (tracks->len > 0)
+                ipoddisk_add_manifests(ipod, arena, node, FALSE);
+        g_string_free(ipod->ipod_scratch, TRUE);
+        ipod->ipod_scratch = NULL;
+        g_array_free(tracks, TRUE);
+
+        return query;
+}
+
+static gboolean
+ipoddisk_trees_forget_one (gpointer path, gpointer node, gpointer victims)
+{
+        struct ipoddisk_query *query = ipoddisk_node_query(node);
+
+        UNUSED(path);
+
+        return query != NULL && g_hash_table_lookup(victims, query) != NULL;
+}
+
+/**
+ * Drops the nodes of evicted search results from the path index of
+ * every tree, including trees that are no longer current but still in
+ * use. Lookups hold a node found in the index before letting go of the
+ * index lock, so once this returns only holders keep the results alive.
+ * @param victims Set of struct ipoddisk_query, marked q_evicted
+ */
+static void
+ipoddisk_trees_forget (GHashTable *victims)
+{
+        GList *trees = NULL;
+        GList *l;
+
+        pthread_mutex_lock(&tree_lock);
+        for (l = live_trees; l != NULL; l = l->next) {
+                struct ipoddisk_tree *tree = l->data;
+                gint                  refs;
+
+                /* skip trees already on their way out */
+                do {
+                        refs = g_atomic_int_get(&tree->tr_refs);
+                } while (refs > 0 &&
+                         !g_atomic_int_compare_and_exchange(&tree->tr_refs,
+                                                            refs, refs + 1));
+                if (refs > 0)
+                        trees = g_list_prepend(trees, tree);
+        }
+        pthread_mutex_unlock(&tree_lock);
+
+        for (l = trees; l != NULL; l = l->next) {
+                struct ipoddisk_tree *tree = l->data;
+
+                pthread_rwlock_wrlock(&tree->tr_path_lock);
+                g_hash_table_foreach_remove(tree->tr_paths,
+                                            ipoddisk_trees_forget_one,
+                                            victims);
+                pthread_rwlock_unlock(&tree->tr_path_lock);
+                ipoddisk_tree_put(tree);
+        }
+        g_list_free(trees);
+
+        return;
+}
+
+/**
+ * Evicts the search results of an iPod used least recently, once more
+ * than IPODDISK_QUERIES_MAX are cached, down to IPODDISK_QUERIES_KEEP.
+ * Results held since they were last passed over get another round, as
+ * lookups answered from the path index don't reorder the list. An
+ * evicted result is freed once the last holder lets go of it.
+ */
+static void
+ipoddisk_query_evict (struct ipoddisk_ipod *ipod)
+{
+        struct ipoddisk_query *query;
+        GHashTable            *victims;
+        GHashTableIter         iter;
+        guint                  budget;
+
+        victims = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        pthread_mutex_lock(&ipod->ipod_view_lock);
+        /* enough for every result to get its second chance */
+        budget = 2 * g_hash_table_size(ipod->ipod_queries) + 1;
+        while (g_hash_table_size(ipod->ipod_queries) > IPODDISK_QUERIES_KEEP &&
+               budget-- > 0) {
+                query = ipod->ipod_query_tail;
+                ipoddisk_query_lru_unlink(ipod, query);
+
+                if (g_atomic_int_get(&query->q_used)) {
+                        g_atomic_int_set(&query->q_used, 0);
+                        ipoddisk_query_lru_push(ipod, query);
+                        continue;
+                }
+
+                g_hash_table_remove(ipod->ipod_queries, query->q_key);
+                g_atomic_int_set(&query->q_evicted, 1);
+                g_hash_table_insert(victims, query, query);
+        }
+        pthread_mutex_unlock(&ipod->ipod_view_lock);
+
+        if (g_hash_table_size(victims) > 0)
+                ipoddisk_trees_forget(victims);
+
+        /* the references of the cache */
+        g_hash_table_iter_init(&iter, victims);
+        while (g_hash_table_iter_next(&iter, (gpointer *) &query, NULL))
+                ipoddisk_query_unref(query);
+        g_hash_table_destroy(victims);
+
+        return;
+}
+
+/**
+ * Returns the directory of the tracks matching a query in the Search
+ * directory of an iPod, running the query the first time it is asked
+ * for. The kernel may come back for a result at any time, so results
+ * are cached; the least used ones are evicted once there are too many,
+ * and run again if asked for again.
+ * @return the directory, held for the caller, or NULL if there is no
+ *         such directory
+ */
+static struct ipoddisk_node *
+ipoddisk_search_node (struct ipoddisk_node *search, const char *query,
+                      size_t len)
+{
+        struct ipoddisk_ipod  *ipod = search->nd_data.ipod;
+        struct ipoddisk_query *result;
+        gchar                 *key;
+        gboolean               evict = FALSE;
+
+        /* what Finder and friends probe every directory for; no track
+         * name starts with a dot, see ipoddisk_encode_name */
+        if (len == 0 || *query == '.')
+                return NULL;
+
+        key = g_strndup(query, len);
+
+        pthread_mutex_lock(&ipod->ipod_view_lock);
+
+        if (ipod->ipod_queries == NULL)
+                ipod->ipod_queries = g_hash_table_new(g_str_hash,
+                                                      g_str_equal);
+
+        result = g_hash_table_lookup(ipod->ipod_queries, key);
+        if (result != NULL) {
+                ipoddisk_query_lru_unlink(ipod, result);
+        } else {
+                result = ipoddisk_query_new(ipod, key, len);
+                result->q_refs = 1;  /* the cache's */
+                g_hash_table_insert(ipod->ipod_queries, result->q_key,
+                                    result);
+                evict = g_hash_table_size(ipod->ipod_queries) >
+                        IPODDISK_QUERIES_MAX;
+        }
+        ipoddisk_query_lru_push(ipod, result);
+        g_atomic_int_inc(&result->q_refs);  /* the caller's */
+
+        pthread_mutex_unlock(&ipod->ipod_view_lock);
+        g_free(key);
+
+        if (evict)
+                ipoddisk_query_evict(ipod);
+
+        return result->q_node;
+}
+
+static void
+ipoddisk_new_view (struct ipoddisk_ipod *ipod, struct ipoddisk_node *root,
+                   const gchar *name, ipoddisk_view_type type)
+{
+        struct ipoddisk_node *node;
+
+        node = ipoddisk_new_node(ipod, root, name, IPODDISK_NODE_DEFAULT);
+        node->nd_data.view.vw_ipod    = ipod;
+        node->nd_data.view.vw_pending = type;
+
+        return;
+}
+
+/**
+ * Builds the subtree of an iPod from its track table. Only Artists is
+ * built right away; the other views wait for someone to look into them,
+ * and Search for someone to search.
+ */
+static void
+ipoddisk_build_ipod_node (struct ipoddisk_node *root)
+{
+        struct ipoddisk_ipod *ipod = root->nd_data.ipod;
+        struct ipoddisk_node *artists;
+        struct ipoddisk_node *search;
+        guint                 i;
+
+        ipoddisk_new_view(ipod, root, "Genres", IPODDISK_VIEW_GENRES);
+        ipoddisk_new_view(ipod, root, "Albums", IPODDISK_VIEW_ALBUMS);
+        artists = ipoddisk_new_node(ipod, root, "Artists", IPODDISK_NODE_DEFAULT);
+        ipoddisk_new_view(ipod, root, "Playlists", IPODDISK_VIEW_PLAYLISTS);
+        ipoddisk_new_view(ipod, root, "Compilations", IPODDISK_VIEW_COMPILATIONS);
+        ipoddisk_new_view(ipod, root, "Recently Added", IPODDISK_VIEW_RECENT);
+        ipoddisk_new_view(ipod, root, "Most Played", IPODDISK_VIEW_MOST_PLAYED);
+        ipoddisk_new_view(ipod, root, "Top Rated", IPODDISK_VIEW_TOP_RATED);
+        search  = ipoddisk_new_node(ipod, root, "Search", IPODDISK_NODE_SEARCH);
+        search->nd_data.ipod = ipod;
+
+        /* Populate iPodDisk/Artists */
+        for (i = 0; i < ipod->ipod_tracks.tt_count; i++)
+                ipoddisk_add_track(ipod, i, artists, NULL);
+        ipoddisk_add_manifests_below(ipod, artists, TRUE);
+
+        return;
+}
+
+gchar *
+ipoddisk_node_path (struct ipoddisk_node *node)
+{
+        struct ipoddisk_track *trk = &node->nd_data.track;
+
+        assert(node->nd_type == IPODDISK_NODE_LEAF);
+
+	return g_strconcat(trk->trk_ipod->ipod_mp,
+                           trk->trk_ipod->ipod_tracks.tt_path[trk->trk_index],
+                           NULL);
+}
+
+/**
+ * Peak resident set size of the process in KiB, for startup logging
+ * and ipoddisk_bench
+ */
+long
+ipoddisk_maxrss (void)
+{
+        struct rusage ru;
+
+        if (getrusage(RUSAGE_SELF, &ru) == -1)
+                return 0;
+#ifdef __APPLE__
+        return ru.ru_maxrss / 1024;  /* bytes there, KiB elsewhere */
+#else
+        return ru.ru_maxrss;
+#endif
+}
+
+double
+ipoddisk_now (void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Builds the subtree of the iPod mounted at mp, from a snapshot if one
+ * matches its iTunesDB and by parsing the iTunesDB otherwise
+ * @return IPOD node holding one reference, or NULL on failure
+ */
+struct ipoddisk_node *
+ipoddisk_init_one_ipod (const gchar *mp)
+{
+        struct ipoddisk_node *node = NULL;
+        struct ipoddisk_ipod *ipod;
+        struct ipoddisk_arena *arena;
+        Itdb_iTunesDB        *the_itdb;
+        GError               *error = NULL;
+        gchar                *dbfile;
+        struct stat           st;
+        guint64               dbhash;
+        double                t_start;
+        double                t_parsed;
+
+        dbfile = g_strconcat(mp, "/iPod_Control/iTunes/iTunesDB", NULL);
+
+        /* stat before parsing, so a write racing with the parse shows
+         * up as a change on the next check */
+        if (strlen(dbfile) >= MAXPATHLEN ||
+            stat(dbfile, &st) == -1 || !S_ISREG(st.st_mode)) {
+                g_free(dbfile);
+                return NULL;
+        }
+
+        t_start = ipoddisk_now();
+
+        /* the hash reads all of iTunesDB, and only snapshots need it */
+        dbhash = 0;
+        if (!ipoddisk_opts.nosnapshot) {
+                dbhash = ipoddisk_snapshot_hash(dbfile);
+                node   = ipoddisk_snapshot_load(mp, st.st_size,
+                                                st.st_mtime, dbhash);
+        }
+        if (node != NULL) {
+                fprintf(stderr, "ipoddisk: %s: loaded snapshot in %.3fs\n",
+                        mp, ipoddisk_now() - t_start);
+        } else {
+                the_itdb = itdb_parse_file(dbfile, &error);
+                if (error != NULL) {
+                        fprintf(stderr,
+                                "itdb_parse_file() failed: %s!\n",
+                                error->message);
+                        g_error_free(error);
+                        g_free(dbfile);
+                        return NULL;
+                }
+
+                if (the_itdb == NULL) {
+                        g_free(dbfile);
+                        return NULL;
+                }
+
+                arena = ipoddisk_arena_new();
+                node  = ipoddisk_arena_alloc(arena, sizeof(*node));
+                ipod  = ipoddisk_arena_alloc(arena, sizeof(*ipod));
+                node->nd_type      = IPODDISK_NODE_IPOD;
+                node->nd_data.ipod = ipod;
+                ipod->ipod_arena   = arena;
+                ipod->ipod_nodes   = g_ptr_array_new();
+                ipod->ipod_scratch = g_string_sized_new(256);
+
+                t_parsed = ipoddisk_now();
+                ipoddisk_init_tracks(ipod, the_itdb);
+                ipoddisk_build_ipod_node(node);
+
+                /* everything needed is in the track table now */
+                itdb_free(the_itdb);
+                g_string_free(ipod->ipod_scratch, TRUE);
+                ipod->ipod_scratch = NULL;
+
+                fprintf(stderr, "ipoddisk: %s: parsed iTunesDB in %.3fs, "
+                                "built tree in %.3fs (%u tracks, %u nodes, "
+                                "%lu KiB)\n",
+                        mp, t_parsed - t_start, ipoddisk_now() - t_parsed,
+                        ipod->ipod_tracks.tt_count, ipod->ipod_nodes->len + 1,
+                        (unsigned long) (arena->ar_bytes / 1024));
+        }
+
+        ipod = node->nd_data.ipod;
+        ipod->ipod_node    = node;
+        ipod->ipod_refs    = 1;
+        ipod->ipod_mp      = g_strdup(mp);
+        ipod->ipod_dbpath  = dbfile;
+        ipod->ipod_dbsize  = st.st_size;
+        ipod->ipod_dbmtime = st.st_mtime;
+        ipod->ipod_dbhash  = dbhash;
+        pthread_mutex_init(&ipod->ipod_view_lock, NULL);
+
+        if (ipod->ipod_nodes != NULL) {
+                if (!ipoddisk_opts.nosnapshot)
+                        ipoddisk_snapshot_save(node);
+                g_ptr_array_free(ipod->ipod_nodes, TRUE);
+                ipod->ipod_nodes = NULL;
+#ifdef __GLIBC__
+                /* glibc keeps what the libgpod database freed; give it
+                 * back, or RSS stays where the parse left it */
+                malloc_trim(0);
+#endif
+        }
+
+        /* leave me not, babe; unless told to let go, see -o nohold */
+        ipod->ipod_dbfd = ipoddisk_opts.nohold ? -1 : open(dbfile, O_RDONLY);
+
+	return node;
+}
+
+void
+ipoddisk_ipod_ref (struct ipoddisk_ipod *ipod)
+{
+        g_atomic_int_inc(&ipod->ipod_refs);
+        return;
+}
+
+/**
+ * Drops a reference to an iPod subtree, freeing the whole subtree and
+ * its cached fds and blocks when the last one goes
+ */
+void
+ipoddisk_ipod_unref (struct ipoddisk_ipod *ipod)
+{
+        if (!g_atomic_int_dec_and_test(&ipod->ipod_refs))
+                return;
+
+        ipoddisk_fd_purge(ipod);
+        ipoddisk_bc_purge(ipod);
+
+        if (ipod->ipod_dbfd != -1)
+                close(ipod->ipod_dbfd);
+        g_free(ipod->ipod_mp);
+        g_free(ipod->ipod_dbpath);
+
+        if (ipod->ipod_snap != NULL)
+                ipoddisk_snapshot_free(ipod);
+        if (ipod->ipod_queries != NULL) {
+                /* nothing else holds them once the subtree goes */
+                while (ipod->ipod_query_head != NULL) {
+                        struct ipoddisk_query *query = ipod->ipod_query_head;
+
+                        ipoddisk_query_lru_unlink(ipod, query);
+                        ipoddisk_query_unref(query);
+                }
+                g_hash_table_destroy(ipod->ipod_queries);
+        }
+        pthread_mutex_destroy(&ipod->ipod_view_lock);
+
+        /* ipod lives in the arena too, so this goes last */
+        ipoddisk_arena_free(ipod->ipod_arena);
+
+        return;
+}
+
+/**
+ * Makes a tree out of a set of iPod subtrees, taking a reference to each.
+ * A single iPod is the root itself; none makes an empty root, for while
+ * waiting for one to be plugged in.
+ */
+static struct ipoddisk_tree *
+ipoddisk_tree_new (struct ipoddisk_node **ipods, int nipods)
+{
+        struct ipoddisk_tree *tree = g_slice_new0(struct ipoddisk_tree);
+        int                   i;
+
+        assert (nipods >= 0 && nipods <= IPODDISK_MAX_IPOD);
+
+        tree->tr_refs   = 1;
+        tree->tr_nipods = nipods;
+        tree->tr_paths  = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, NULL);
+        tree->tr_misses = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, NULL);
+        pthread_rwlock_init(&tree->tr_path_lock, NULL);
+
+        if (nipods == 1) {
+                tree->tr_root = ipods[0];
+        } else {
+                tree->tr_arena = ipoddisk_arena_new();
+                tree->tr_root  = ipoddisk_arena_alloc(tree->tr_arena,
+                                                      sizeof(*tree->tr_root));
+                tree->tr_root->nd_type = IPODDISK_NODE_ROOT;
+        }
+
+        for (i = 0; i < nipods; i++) {
+                tree->tr_ipods[i] = ipods[i];
+                ipoddisk_ipod_ref(ipods[i]->nd_data.ipod);
+
+                if (nipods > 1) {
+                        gchar *ipodname;
+
+                        ipodname = g_path_get_basename(ipods[i]->nd_data.ipod->ipod_mp);
+                        ipoddisk_add_child(tree->tr_arena, tree->tr_root,
+                                           ipods[i], ipodname);
+                        g_free(ipodname);
+                }
+        }
+
+        pthread_mutex_lock(&tree_lock);
+        live_trees = g_list_prepend(live_trees, tree);
+        pthread_mutex_unlock(&tree_lock);
+
+        return tree;
+}
+
+/**
+ * Returns the current tree with a reference held; nodes reached from it
+ * stay valid until the matching ipoddisk_tree_put. Every operation
+ * starts here, so no lock is taken: the tree read may be replaced at
+ * once, but ipoddisk_tree_publish doesn't drop its reference before the
+ * reader is counted in tree_getters no more, by which time it holds its
+ * own.
+ */
+struct ipoddisk_tree *
+ipoddisk_tree_get (void)
+{
+        struct ipoddisk_tree *tree;
+
+        g_atomic_int_inc(&tree_getters);
+        tree = g_atomic_pointer_get(&current_tree);
+        g_atomic_int_inc(&tree->tr_refs);
+        g_atomic_int_add(&tree_getters, -1);
+
+        return tree;
+}
+
+void
+ipoddisk_tree_put (struct ipoddisk_tree *tree)
+{
+        int i;
+
+        if (!g_atomic_int_dec_and_test(&tree->tr_refs))
+                return;
+
+        pthread_mutex_lock(&tree_lock);
+        live_trees = g_list_remove(live_trees, tree);
+        pthread_mutex_unlock(&tree_lock);
+
+        if (tree->tr_arena != NULL)
+                ipoddisk_arena_free(tree->tr_arena);
+
+        for (i = 0; i < tree->tr_nipods; i++)
+                ipoddisk_ipod_unref(tree->tr_ipods[i]->nd_data.ipod);
+
+        g_hash_table_destroy(tree->tr_paths);
+        g_hash_table_destroy(tree->tr_misses);
+        pthread_rwlock_destroy(&tree->tr_path_lock);
+        g_slice_free(struct ipoddisk_tree, tree);
+
+        return;
+}
+
+/**
+ * Makes tree the current one. Operations still running on the previous
+ * tree keep it alive until they finish.
+ */
+static void
+ipoddisk_tree_publish (struct ipoddisk_tree *tree)
+{
+        struct ipoddisk_tree *old;
+
+        pthread_mutex_lock(&tree_lock);
+        old = current_tree;
+        g_atomic_pointer_set(&current_tree, tree);
+        pthread_mutex_unlock(&tree_lock);
+
+        /* a reader counted now may have read old but not referenced it
+         * yet; those that come later read the new tree. Each is only a
+         * few instructions away from leaving, so just wait it out. */
+        while (g_atomic_int_get(&tree_getters) != 0)
+                sched_yield();
+
+        if (old != NULL) {
+                if (tree_changed != NULL)
+                        tree_changed(old, tree);
+                ipoddisk_tree_put(old);
+        }
+
+        return;
+}
+
+/**
+ * Registers fn to be called with the old and the new tree whenever a
+ * reload publishes a new one, before the old one is let go
+ */
+void
+ipoddisk_tree_notify (void (*fn) (struct ipoddisk_tree *old,
+                                  struct ipoddisk_tree *tree))
+{
+        tree_changed = fn;
+        return;
+}
+
+/**
+ * Rebuilds the subtree of every iPod whose iTunesDB has changed, and
+ * publishes a new tree if any was rebuilt. A changed iTunesDB is only
+ * reparsed once it looks the same on two calls in a row, so that we
+ * don't parse it halfway through a sync.
+ * @return number of iPods with a change that hasn't settled yet
+ */
+int
+ipoddisk_reload_ipods (void)
+{
+        struct ipoddisk_tree *tree;
+        struct ipoddisk_node *ipods[IPODDISK_MAX_IPOD];
+        gboolean              fresh[IPODDISK_MAX_IPOD];
+        int                   nchanged = 0;
+        int                   unsettled = 0;
+        int                   i;
+
+        tree = ipoddisk_tree_get();
+
+        for (i = 0; i < tree->tr_nipods; i++) {
+                struct ipoddisk_ipod *ipod = tree->tr_ipods[i]->nd_data.ipod;
+                struct ipoddisk_node *node;
+                struct stat           st;
+
+                ipods[i] = tree->tr_ipods[i];
+                fresh[i] = FALSE;
+
+                if (stat(ipod->ipod_dbpath, &st) == -1)
+                        continue;
+
+                if (st.st_size  == ipod->ipod_dbsize &&
+                    st.st_mtime == ipod->ipod_dbmtime) {
+                        ipod->ipod_pendsize  = 0;
+                        ipod->ipod_pendmtime = 0;
+                        continue;
+                }
+
+                if (st.st_size  != ipod->ipod_pendsize ||
+                    st.st_mtime != ipod->ipod_pendmtime) {
+                        ipod->ipod_pendsize  = st.st_size;
+                        ipod->ipod_pendmtime = st.st_mtime;
+                        unsettled++;
+                        continue;
+                }
+
+                node = ipoddisk_init_one_ipod(ipod->ipod_mp);
+                if (node == NULL) {
+                        /* try again once it changes again */
+                        ipod->ipod_dbsize  = st.st_size;
+                        ipod->ipod_dbmtime = st.st_mtime;
+                        continue;
+                }
+
+                ipods[i] = node;
+                fresh[i] = TRUE;
+                nchanged++;
+        }
+
+        if (nchanged > 0) {
+                ipoddisk_tree_publish(ipoddisk_tree_new(ipods, tree->tr_nipods));
+
+                for (i = 0; i < tree->tr_nipods; i++)
+                        if (fresh[i])
+                                ipoddisk_ipod_unref(ipods[i]->nd_data.ipod);
+        }
+
+        ipoddisk_tree_put(tree);
+        return unsettled;
+}
+
+/**
+ * Hands the iTunesDB paths of the current iPods to fn, e.g. for setting
+ * up change notifications
+ */
+void
+ipoddisk_foreach_dbpath (void (*fn) (const gchar *dbpath, gpointer arg),
+                         gpointer arg)
+{
+        struct ipoddisk_tree *tree;
+        int                   i;
+
+        tree = ipoddisk_tree_get();
+        for (i = 0; i < tree->tr_nipods; i++)
+                fn(tree->tr_ipods[i]->nd_data.ipod->ipod_dbpath, arg);
+        ipoddisk_tree_put(tree);
+
+        return;
+}
+
+struct __init_ipod_arg {
+        gchar                *mp;
+        struct ipoddisk_node *node;
+        pthread_t             thread;
+        int                   joinable;
+};
+
+static void *
+ipoddisk_init_ipod_thread (void *data)
+{
+        struct __init_ipod_arg *arg = data;
+
+        arg->node = ipoddisk_init_one_ipod(arg->mp);
+        return NULL;
+}
+
+/**
+ * Parses the iPods mounted at mps, each on a thread of its own
+ * @param ipods Where to put the subtrees built, in the order given; the
+ *              caller owns a reference to each
+ * @return number of subtrees built
+ */
+static int
+ipoddisk_parse_ipods (gchar **mps, int nmp, struct ipoddisk_node **ipods)
+{
+        int                     i;
+        int                     ipodnr;
+        struct __init_ipod_arg  args[IPODDISK_MAX_IPOD];
+
+        nmp = MIN(nmp, IPODDISK_MAX_IPOD);
+
+        for (i = 0; i < nmp; i++) {
+                args[i].mp       = mps[i];
+                args[i].node     = NULL;
+                args[i].joinable = pthread_create(&args[i].thread, NULL,
+                                                  ipoddisk_init_ipod_thread,
+                                                  &args[i]) == 0;
+                if (!args[i].joinable) /* build it here instead */
+                        ipoddisk_init_ipod_thread(&args[i]);
+        }
+
+        for (i = 0, ipodnr = 0; i < nmp; i++) {
+                if (args[i].joinable)
+                        pthread_join(args[i].thread, NULL);
+                if (args[i].node != NULL)
+                        ipods[ipodnr++] = args[i].node;
+        }
+
+        return ipodnr;
+}
+
+/**
+ * Builds the initial tree out of the iPods mounted at mps. Their subtrees
+ * are put under the root once all are done, in the order given.
+ * @return 0 on success, errno otherwise
+ */
+int
+ipoddisk_init_ipods_at (gchar **mps, int nmp)
+{
+        int                     i;
+        int                     ipodnr;
+        struct ipoddisk_node   *ipods[IPODDISK_MAX_IPOD];
+        double                  t_start = ipoddisk_now();
+
+        ipodnr = ipoddisk_parse_ipods(mps, nmp, ipods);
+        if (ipodnr == 0)
+                return ENOENT;
+
+        ipoddisk_tree_publish(ipoddisk_tree_new(ipods, ipodnr));
+
+        /* the tree holds its own references now */
+        for (i = 0; i < ipodnr; i++)
+                ipoddisk_ipod_unref(ipods[i]->nd_data.ipod);
+
+        fprintf(stderr, "ipoddisk: %d iPod(s) ready in %.3fs, "
+                        "peak RSS %ld KiB\n",
+                ipodnr, ipoddisk_now() - t_start, ipoddisk_maxrss());
+
+        return 0;
+}
+
+/**
+ * Tells whether a mounted filesystem looks like an iPod. Only those
+ * mounted from a device node are looked into: stat'ing a path on a
+ * network or FUSE filesystem, ipoddisk's own mount included, can hang,
+ * and proc, tmpfs and the like can't be iPods anyway.
+ */
+static gboolean
+ipoddisk_is_ipod (const char *from, const char *on)
+{
+        gchar    *dbpath;
+        gboolean  found;
+
+#ifdef __linux__
+        /* sd*, but also loop devices holding disk images and the like */
+        if (strncmp(from, CONST_STR_LEN("/dev/")))
+#else
+        if (strncasecmp(from, CONST_STR_LEN("/dev/disk")))
+#endif
+                return FALSE;  /* fs not disk-based */
+
+        if (!strcmp(on, "/"))
+                return FALSE;  /* skip root fs */
+
+        /* don't spawn a thread for every disk without an iPod */
+        dbpath = g_strconcat(on, "/iPod_Control/iTunes/iTunesDB", NULL);
+        found  = g_file_test(dbpath, G_FILE_TEST_IS_REGULAR);
+        g_free(dbpath);
+
+        return found;
+}
+
+#ifdef __linux__
+/**
+ * Undoes the octal escapes of spaces and the like in a field of
+ * /proc/self/mountinfo, in place
+ */
+static void
+ipoddisk_mountinfo_unescape (gchar *field)
+{
+        gchar *from = field;
+        gchar *to = field;
+
+        while (*from != '\0') {
+                if (from[0] == '\\' &&
+                    from[1] >= '0' && from[1] <= '3' &&
+                    from[2] >= '0' && from[2] <= '7' &&
+                    from[3] >= '0' && from[3] <= '7') {
+                        *to++ = (from[1] - '0') << 6 | (from[2] - '0') << 3 |
+                                (from[3] - '0');
+                        from += 4;
+                } else {
+                        *to++ = *from++;
+                }
+        }
+        *to = '\0';
+
+        return;
+}
+
+/**
+ * Lists the mount points of mounted iPods, from /proc/self/mountinfo.
+ * Each line is "id parent major:minor root mountpoint options
+ * [optional fields...] - fstype source superoptions".
+ * @return number of mount points put in mps, to be freed by the caller
+ */
+static int
+ipoddisk_find_ipods (gchar **mps)
+{
+        int    nmp = 0;
+        FILE  *mounts;
+        char   line[4096];
+
+        mounts = fopen(IPODDISK_MOUNTINFO, "r");
+        if (mounts == NULL)
+                return 0;
+
+        while (nmp < IPODDISK_MAX_IPOD &&
+               fgets(line, sizeof(line), mounts) != NULL) {
+                gchar **fields;
+                int     n;
+                int     sep;
+
+                g_strchomp(line);
+                fields = g_strsplit(line, " ", -1);
+                n = g_strv_length(fields);
+
+                /* the optional fields end at a lone "-" */
+                for (sep = 6; sep < n && strcmp(fields[sep], "-"); sep++)
+                        ;
+
+                if (sep + 2 < n) {
+                        ipoddisk_mountinfo_unescape(fields[4]);
+                        ipoddisk_mountinfo_unescape(fields[sep + 2]);
+                        if (ipoddisk_is_ipod(fields[sep + 2], fields[4]))
+                                mps[nmp++] = g_strdup(fields[4]);
+                }
+
+                g_strfreev(fields);
+        }
+
+        fclose(mounts);
+        return nmp;
+}
+#else
+/**
+ * Lists the mount points of mounted iPods
+ * @return number of mount points put in mps, to be freed by the caller
+ */
+static int
+ipoddisk_find_ipods (gchar **mps)
+{
+	int             i;
+        int             fsnr;
+        int             nmp;
+	struct statfs  *stats = NULL;
+
+	fsnr = getfsstat(NULL, 0, MNT_NOWAIT);
+	if (fsnr <= 0)
+		return 0;
+
+	stats = g_malloc0(fsnr * sizeof(struct statfs));
+        if (stats == NULL)
+                return 0;
+
+	fsnr = getfsstat(stats, fsnr * sizeof(struct statfs), MNT_NOWAIT);
+
+        for (i = 0, nmp = 0; i < fsnr && nmp < IPODDISK_MAX_IPOD; i++)
+                if (ipoddisk_is_ipod(stats[i].f_mntfromname,
+                                     stats[i].f_mntonname))
+                        mps[nmp++] = g_strdup(stats[i].f_mntonname);
+
+        g_free(stats);
+        return nmp;
+}
+#endif
+
+/**
+ * Finds mounted iPods and builds the initial tree. If there are none,
+ * the tree is left empty for ipoddisk_rescan_ipods to fill in.
+ * @return 0 on success, errno otherwise
+ */
+int
+ipoddisk_init_ipods (void)
+{
+        int    i;
+        int    rc = ENOENT;
+        int    nmp;
+        gchar *mps[IPODDISK_MAX_IPOD];
+
+        nmp = ipoddisk_find_ipods(mps);
+        if (nmp > 0)
+                rc = ipoddisk_init_ipods_at(mps, nmp);
+
+        for (i = 0; i < nmp; i++)
+                g_free(mps[i]);
+
+        if (rc != 0)
+                ipoddisk_tree_publish(ipoddisk_tree_new(NULL, 0));
+
+        return rc;
+}
+
+/* Mount points that didn't parse, so that they aren't parsed again on
+ * every rescan but only when worth it; forgotten once unmounted. Only
+ * the watch thread rescans. */
+static GHashTable *rescan_failed;   /* mount point -> struct ipoddisk_failed */
+
+/* Bounds of the wait before parsing a failed iPod again, in seconds */
+#define IPODDISK_RETRY_MIN      5
+#define IPODDISK_RETRY_MAX      300
+
+/* An iPod that failed to attach, and when to try it again */
+struct ipoddisk_failed {
+        off_t  fl_dbsize;   /* iTunesDB as it was when it failed */
+        time_t fl_dbmtime;
+        time_t fl_retry;    /* try again after this, even if unchanged */
+        int    fl_backoff;  /* seconds until the next retry */
+};
+
+/**
+ * Tells whether an iPod that failed to attach should be tried again: as
+ * soon as its iTunesDB changes, say once iTunes is done writing it, and
+ * otherwise after a wait doubling on every failure. Not watched with
+ * inotify, which only covers attached iPods.
+ */
+static gboolean
+ipoddisk_failed_retry (const gchar *mp, struct ipoddisk_failed *fl)
+{
+        gchar       *dbfile;
+        struct stat  st;
+        int          rc;
+
+        dbfile = g_strconcat(mp, "/iPod_Control/iTunes/iTunesDB", NULL);
+        rc = stat(dbfile, &st);
+        g_free(dbfile);
+
+        if (rc == 0 && (st.st_size != fl->fl_dbsize ||
+                        st.st_mtime != fl->fl_dbmtime))
+                return TRUE;
+
+        return time(NULL) >= fl->fl_retry;
+}
+
+/**
+ * Records a failure to attach an iPod
+ * @param prev How it failed last time, or NULL on a first failure
+ */
+static struct ipoddisk_failed *
+ipoddisk_failed_new (const gchar *mp, struct ipoddisk_failed *prev)
+{
+        gchar                  *dbfile;
+        struct stat             st;
+        struct ipoddisk_failed *fl;
+
+        fl = g_new0(struct ipoddisk_failed, 1);
+        dbfile = g_strconcat(mp, "/iPod_Control/iTunes/iTunesDB", NULL);
+        if (stat(dbfile, &st) == 0) {
+                fl->fl_dbsize  = st.st_size;
+                fl->fl_dbmtime = st.st_mtime;
+        }
+        g_free(dbfile);
+
+        fl->fl_backoff = prev == NULL ? IPODDISK_RETRY_MIN :
+                         MIN(prev->fl_backoff * 2, IPODDISK_RETRY_MAX);
+        fl->fl_retry   = time(NULL) + fl->fl_backoff;
+
+        return fl;
+}
+
+/**
+ * Tells whether there are mounted iPods that failed to attach, and so
+ * rescans are wanted even if the mount table doesn't change
+ */
+gboolean
+ipoddisk_rescan_pending (void)
+{
+        return rescan_failed != NULL && g_hash_table_size(rescan_failed) > 0;
+}
+
+/**
+ * Attaches the iPods mounted since the last call and detaches the ones
+ * unmounted since, and publishes a new tree if there are any. New iPods
+ * are parsed while the current tree goes on serving requests. A detached
+ * iPod is let go once the operations and open files still using it are
+ * done with it.
+ * @return number of iPods attached or detached
+ */
+int
+ipoddisk_rescan_ipods (void)
+{
+        struct ipoddisk_tree *tree;
+        struct ipoddisk_node *ipods[IPODDISK_MAX_IPOD];
+        struct ipoddisk_node *fresh[IPODDISK_MAX_IPOD];
+        gchar                *mps[IPODDISK_MAX_IPOD];
+        gchar                *added[IPODDISK_MAX_IPOD];
+        gboolean              kept[IPODDISK_MAX_IPOD];
+        GHashTable           *failed;
+        int                   nmp;
+        int                   nipods = 0;
+        int                   nadded = 0;
+        int                   nfresh;
+        int                   nchanged = 0;
+        int                   i;
+        int                   j;
+
+        nmp  = ipoddisk_find_ipods(mps);
+        tree = ipoddisk_tree_get();
+
+        for (i = 0; i < nmp; i++)
+                kept[i] = FALSE;
+
+        for (i = 0; i < tree->tr_nipods; i++) {
+                struct ipoddisk_ipod *ipod = tree->tr_ipods[i]->nd_data.ipod;
+
+                for (j = 0; j < nmp; j++)
+                        if (!kept[j] && !strcmp(mps[j], ipod->ipod_mp))
+                                break;
+
+                if (j < nmp) {
+                        kept[j] = TRUE;
+                        ipods[nipods++] = tree->tr_ipods[i];
+                } else {
+                        fprintf(stderr, "ipoddisk: %s: detached\n",
+                                ipod->ipod_mp);
+                        /* lazily unmounted iPods stay busy while they
+                         * have open files; only the watch thread gets
+                         * here, and the subtree can't go before tree is
+                         * put */
+                        ipoddisk_fd_purge(ipod);
+                        if (ipod->ipod_dbfd != -1) {
+                                close(ipod->ipod_dbfd);
+                                ipod->ipod_dbfd = -1;
+                        }
+                        nchanged++;
+                }
+        }
+
+        failed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        for (i = 0; i < nmp; i++) {
+                struct ipoddisk_failed *fl = NULL;
+
+                if (kept[i])
+                        continue;
+                if (rescan_failed != NULL)
+                        fl = g_hash_table_lookup(rescan_failed, mps[i]);
+                if (fl != NULL && !ipoddisk_failed_retry(mps[i], fl)) {
+                        struct ipoddisk_failed *copy;
+
+                        copy  = g_new(struct ipoddisk_failed, 1);
+                        *copy = *fl;
+                        g_hash_table_insert(failed, g_strdup(mps[i]), copy);
+                } else if (nipods + nadded < IPODDISK_MAX_IPOD) {
+                        added[nadded++] = mps[i];
+                }
+        }
+
+        nfresh = ipoddisk_parse_ipods(added, nadded, fresh);
+        for (i = 0, j = 0; i < nadded; i++) {
+                if (j < nfresh &&
+                    !strcmp(added[i], fresh[j]->nd_data.ipod->ipod_mp)) {
+                        fprintf(stderr, "ipoddisk: %s: attached\n",
+                                added[i]);
+                        ipods[nipods++] = fresh[j++];
+                        nchanged++;
+                } else {
+                        struct ipoddisk_failed *prev = NULL;
+
+                        if (rescan_failed != NULL)
+                                prev = g_hash_table_lookup(rescan_failed,
+                                                           added[i]);
+                        g_hash_table_insert(failed, g_strdup(added[i]),
+                                            ipoddisk_failed_new(added[i],
+                                                                prev));
+                }
+        }
+
+        if (rescan_failed != NULL)
+                g_hash_table_destroy(rescan_failed);
+        rescan_failed = failed;
+
+        if (nchanged > 0) {
+                ipoddisk_tree_publish(ipoddisk_tree_new(ipods, nipods));
+
+                /* the tree holds its own references now */
+                for (i = 0; i < nfresh; i++)
+                        ipoddisk_ipod_unref(fresh[i]->nd_data.ipod);
+        }
+
+        ipoddisk_tree_put(tree);
+        for (i = 0; i < nmp; i++)
+                g_free(mps[i]);
+
+        return nchanged;
 }
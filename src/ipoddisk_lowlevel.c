@@ -0,0 +1,711 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Backend on the low-level FUSE API, selected with -o lowlevel. Nodes
+ * are addressed by inode number rather than path, so no path is ever
+ * built or parsed. The inode number of a node is its address: a node
+ * never moves and, as each inode the kernel knows of references the
+ * subtree of its iPod, never goes away while the kernel may ask for it.
+ * A published tree never changes either, so the kernel is told to cache
+ * entries and attributes for good and is told to drop them on reload.
+ * The one exception is the size and mtime of a track, which are the
+ * iTunesDB's until its file is first opened; those are not cached until
+ * then.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ipoddisk.h"
+
+#if FUSE_VERSION >= 28
+/* Cached entries are invalidated on reload, so they can live long */
+#define IPODDISK_LL_TIMEOUT     86400.0
+#endif
+
+/* Inode numbers of the stats directory and file. No node lives at
+ * these addresses, and they are never forgotten. */
+#define IPODDISK_LL_STATS_DIR   2
+#define IPODDISK_LL_STATS_FILE  3
+
+#define IPODDISK_LL_STATS(ino)  ((ino) == IPODDISK_LL_STATS_DIR || \
+                                 (ino) == IPODDISK_LL_STATS_FILE)
+
+/* An inode the kernel knows of */
+struct ipoddisk_inode {
+        struct ipoddisk_node *in_node;
+        struct ipoddisk_ipod *in_ipod;    /* referenced */
+        guint64               in_nlookup; /* lookups not yet forgotten */
+};
+
+/* An open directory; keeps its tree alive between readdir calls */
+struct ipoddisk_ll_dirhandle {
+        struct ipoddisk_tree *dh_tree;
+        struct ipoddisk_node *dh_node;  /* NULL for the stats directory */
+};
+
+static pthread_mutex_t   ll_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable       *ll_inodes;  /* node -> struct ipoddisk_inode */
+static struct fuse_chan *ll_chan;    /* set while mounted */
+
+static double
+ipoddisk_ll_timeout (void)
+{
+#ifdef IPODDISK_LL_TIMEOUT
+        return IPODDISK_LL_TIMEOUT;
+#else
+        /* can't invalidate, so don't let them outlive a reload */
+        return ipoddisk_opts.reload_interval ? ipoddisk_opts.reload_interval
+                                             : 86400.0;
+#endif
+}
+
+/**
+ * How long the kernel may cache the attributes of a node. A track not
+ * opened yet has the size and mtime the iTunesDB gives, which the open
+ * may correct, see ipoddisk_track_check. They are not cached, so that
+ * the kernel asks again after the open, including when a read goes past
+ * the size it has.
+ */
+static double
+ipoddisk_ll_attr_timeout (struct ipoddisk_node *node)
+{
+        if (node->nd_type == IPODDISK_NODE_LEAF &&
+            !ipoddisk_track_checked(node))
+                return 0;
+
+        return ipoddisk_ll_timeout();
+}
+
+static fuse_ino_t
+ipoddisk_ll_ino (struct ipoddisk_tree *tree, struct ipoddisk_node *node)
+{
+        return node == tree->tr_root ? FUSE_ROOT_ID
+                                     : (fuse_ino_t) (uintptr_t) node;
+}
+
+/**
+ * Finds the node of an inode. The root inode is the root of whatever
+ * tree is current, other inodes stay valid until forgotten.
+ */
+static struct ipoddisk_node *
+ipoddisk_ll_node (struct ipoddisk_tree *tree, fuse_ino_t ino)
+{
+        if (ino == FUSE_ROOT_ID)
+                return tree->tr_root;
+
+        return (struct ipoddisk_node *) (uintptr_t) ino;
+}
+
+/**
+ * Counts a lookup of node, referencing its subtree, and holding the
+ * node, when the kernel first learns of it
+ * @param parent Node it was looked up in
+ */
+static void
+ipoddisk_ll_remember (struct ipoddisk_node *parent,
+                      struct ipoddisk_node *node)
+{
+        struct ipoddisk_inode *inode;
+        struct ipoddisk_ipod  *ipod;
+
+        pthread_mutex_lock(&ll_lock);
+
+        inode = g_hash_table_lookup(ll_inodes, node);
+        if (inode != NULL) {
+                inode->in_nlookup++;
+                pthread_mutex_unlock(&ll_lock);
+                return;
+        }
+
+        /* only iPod, search result, track and manifest nodes know their iPod;
+         * directories below an iPod node belong to the same one as
+         * their parent */
+        if (node->nd_type == IPODDISK_NODE_IPOD) {
+                ipod = node->nd_data.ipod;
+        } else if (node->nd_type == IPODDISK_NODE_RESULT) {
+                ipod = node->nd_data.query->q_ipod;
+        } else if (node->nd_type == IPODDISK_NODE_LEAF) {
+                ipod = node->nd_data.track.trk_ipod;
+        } else if (node->nd_type == IPODDISK_NODE_MANIFEST) {
+                ipod = node->nd_data.manifest->mf_ipod;
+        } else if (parent->nd_type == IPODDISK_NODE_IPOD) {
+                ipod = parent->nd_data.ipod;
+        } else {
+                struct ipoddisk_inode *up;
+
+                up = g_hash_table_lookup(ll_inodes, parent);
+                assert (up != NULL);
+                ipod = up->in_ipod;
+        }
+
+        inode = g_slice_new(struct ipoddisk_inode);
+        inode->in_node    = node;
+        inode->in_ipod    = ipod;
+        inode->in_nlookup = 1;
+        ipoddisk_ipod_ref(ipod);
+        ipoddisk_node_hold(node);
+        g_hash_table_insert(ll_inodes, node, inode);
+
+        pthread_mutex_unlock(&ll_lock);
+
+        return;
+}
+
+static void
+ipoddisk_ll_init (void *userdata, struct fuse_conn_info *conn)
+{
+        UNUSED (userdata);
+        UNUSED (conn);
+
+        ipoddisk_start();
+
+        return;
+}
+
+static void
+ipoddisk_ll_destroy (void *userdata)
+{
+        UNUSED (userdata);
+
+        ipoddisk_stop();
+
+        return;
+}
+
+static void
+ipoddisk_ll_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        int                      rc = 0;
+        struct fuse_entry_param  e;
+        struct ipoddisk_tree    *tree;
+        struct ipoddisk_node    *pnode;
+        struct ipoddisk_node    *node = NULL;
+        guint64                  start = ipoddisk_stats_clock();
+        guint64                  walk;
+
+        memset(&e, 0, sizeof(e));
+        e.attr_timeout  = ipoddisk_ll_timeout();
+        e.entry_timeout = ipoddisk_ll_timeout();
+
+        if (parent == FUSE_ROOT_ID && strcmp(name, IPODDISK_STATS_DIR) == 0)
+                e.ino = IPODDISK_LL_STATS_DIR;
+        else if (parent == IPODDISK_LL_STATS_DIR &&
+                 strcmp(name, IPODDISK_STATS_FILE) == 0)
+                e.ino = IPODDISK_LL_STATS_FILE;
+        if (e.ino != 0 || parent == IPODDISK_LL_STATS_DIR) {
+                if (e.ino != 0) {
+                        ipoddisk_stats_stat(e.ino == IPODDISK_LL_STATS_DIR,
+                                            &e.attr);
+                        e.attr.st_ino = e.ino;
+                }
+                fuse_reply_entry(req, &e);
+                return;
+        }
+
+        tree  = ipoddisk_tree_get();
+        pnode = ipoddisk_ll_node(tree, parent);
+        if (!IPODDISK_NODE_IS_FILE(pnode)) {
+                walk = ipoddisk_stats_clock();
+                node = ipoddisk_get_child(pnode, name, strlen(name));
+                ipoddisk_stats_add(IPODDISK_OP_TREE, walk);
+        }
+
+        if (node == NULL) {
+                /* ino 0 lets the kernel cache the miss as well */
+                fuse_reply_entry(req, &e);
+                ipoddisk_tree_put(tree);
+                ipoddisk_stats_add(IPODDISK_OP_LOOKUP, start);
+                return;
+        }
+
+        rc = ipoddisk_node_getattr(node, &e.attr);
+        if (rc == 0) {
+                e.ino          = ipoddisk_ll_ino(tree, node);
+                e.attr.st_ino  = e.ino;
+                e.attr_timeout = ipoddisk_ll_attr_timeout(node);
+                ipoddisk_ll_remember(pnode, node);
+        }
+        ipoddisk_node_release(node);
+        ipoddisk_tree_put(tree);
+
+        if (rc != 0)
+                fuse_reply_err(req, -rc);
+        else
+                fuse_reply_entry(req, &e);
+
+        ipoddisk_stats_add(IPODDISK_OP_LOOKUP, start);
+        return;
+}
+
+static void
+ipoddisk_ll_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+        struct ipoddisk_inode *inode;
+        struct ipoddisk_ipod  *ipod = NULL;
+        struct ipoddisk_node  *node = NULL;
+
+        if (ino != FUSE_ROOT_ID && !IPODDISK_LL_STATS(ino)) {
+                pthread_mutex_lock(&ll_lock);
+                inode = g_hash_table_lookup(ll_inodes,
+                                            (gpointer) (uintptr_t) ino);
+                assert (inode != NULL && inode->in_nlookup >= nlookup);
+
+                inode->in_nlookup -= nlookup;
+                if (inode->in_nlookup == 0) {
+                        g_hash_table_remove(ll_inodes, inode->in_node);
+                        node = inode->in_node;
+                        ipod = inode->in_ipod;
+                        g_slice_free(struct ipoddisk_inode, inode);
+                }
+                pthread_mutex_unlock(&ll_lock);
+        }
+
+        /* may free the subtree, which takes fd_lock */
+        if (ipod != NULL) {
+                ipoddisk_node_release(node);
+                ipoddisk_ipod_unref(ipod);
+        }
+
+        fuse_reply_none(req);
+        return;
+}
+
+static void
+ipoddisk_ll_getattr (fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi)
+{
+        int                   rc = 0;
+        struct stat           st;
+        struct ipoddisk_tree *tree;
+        struct ipoddisk_node *node;
+        double                timeout = ipoddisk_ll_timeout();
+        guint64               start = ipoddisk_stats_clock();
+
+        UNUSED (fi);
+
+        if (IPODDISK_LL_STATS(ino)) {
+                ipoddisk_stats_stat(ino == IPODDISK_LL_STATS_DIR, &st);
+        } else {
+                tree    = ipoddisk_tree_get();
+                node    = ipoddisk_ll_node(tree, ino);
+                rc      = ipoddisk_node_getattr(node, &st);
+                timeout = ipoddisk_ll_attr_timeout(node);
+                ipoddisk_tree_put(tree);
+        }
+
+        st.st_ino = ino;
+        if (rc != 0)
+                fuse_reply_err(req, -rc);
+        else
+                fuse_reply_attr(req, &st, timeout);
+
+        if (!IPODDISK_LL_STATS(ino))
+                ipoddisk_stats_add(IPODDISK_OP_GETATTR, start);
+        return;
+}
+
+static void
+ipoddisk_ll_access (fuse_req_t req, fuse_ino_t ino, int mask)
+{
+        int                   rc = 0;
+        struct ipoddisk_tree *tree;
+        struct ipoddisk_node *node;
+
+        if (mask & W_OK) {        /* everything is read-only */
+                fuse_reply_err(req, EROFS);
+                return;
+        }
+        if (IPODDISK_LL_STATS(ino)) {
+                fuse_reply_err(req, (mask & X_OK) &&
+                                    ino == IPODDISK_LL_STATS_FILE ? EACCES : 0);
+                return;
+        }
+
+        tree = ipoddisk_tree_get();
+        node = ipoddisk_ll_node(tree, ino);
+        if ((mask & X_OK) &&      /* only directories are executable */
+            IPODDISK_NODE_IS_FILE(node))
+                rc = EACCES;
+        ipoddisk_tree_put(tree);
+
+        fuse_reply_err(req, rc);
+        return;
+}
+
+static void
+ipoddisk_ll_statfs (fuse_req_t req, fuse_ino_t ino)
+{
+        int                   rc;
+        struct statvfs        st;
+        struct ipoddisk_tree *tree;
+        guint64               start = ipoddisk_stats_clock();
+
+        UNUSED (ino);
+
+        memset(&st, 0, sizeof(st));
+
+        tree = ipoddisk_tree_get();
+        rc   = ipoddisk_statipods(tree, &st);
+        ipoddisk_tree_put(tree);
+
+        if (rc != 0)
+                fuse_reply_err(req, -rc);
+        else
+                fuse_reply_statfs(req, &st);
+
+        ipoddisk_stats_add(IPODDISK_OP_STATFS, start);
+        return;
+}
+
+static void
+ipoddisk_ll_opendir (fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi)
+{
+        struct ipoddisk_tree         *tree;
+        struct ipoddisk_node         *node;
+        struct ipoddisk_ll_dirhandle *dh;
+
+        if (ino == IPODDISK_LL_STATS_FILE) {
+                fuse_reply_err(req, ENOTDIR);
+                return;
+        }
+
+        tree = ipoddisk_tree_get();
+        node = ino == IPODDISK_LL_STATS_DIR ? NULL : ipoddisk_ll_node(tree, ino);
+        if (node != NULL && IPODDISK_NODE_IS_FILE(node)) {
+                ipoddisk_tree_put(tree);
+                fuse_reply_err(req, ENOTDIR);
+                return;
+        }
+
+        dh = g_slice_new(struct ipoddisk_ll_dirhandle);
+        dh->dh_tree = tree;
+        dh->dh_node = node;
+
+        fi->fh = (uint64_t) (uintptr_t) dh;
+        fuse_reply_open(req, fi);
+        return;
+}
+
+static void
+ipoddisk_ll_releasedir (fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+        struct ipoddisk_ll_dirhandle *dh;
+
+        UNUSED (ino);
+
+        dh = (struct ipoddisk_ll_dirhandle *) (uintptr_t) fi->fh;
+        ipoddisk_tree_put(dh->dh_tree);
+        g_slice_free(struct ipoddisk_ll_dirhandle, dh);
+
+        fuse_reply_err(req, 0);
+        return;
+}
+
+/**
+ * Lists a directory, resuming at offset. Offsets are as in the
+ * high-level backend's ipoddisk_readdir.
+ */
+static void
+ipoddisk_ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t size,
+                     off_t offset, struct fuse_file_info *fi)
+{
+        off_t                         k;
+        char                         *buf;
+        size_t                        used = 0;
+        struct stat                   st;
+        struct ipoddisk_dir          *dir = NULL;
+        struct ipoddisk_ll_dirhandle *dh;
+        off_t                         nents = 1;  /* the stats file */
+        guint64                       start = ipoddisk_stats_clock();
+
+        dh  = (struct ipoddisk_ll_dirhandle *) (uintptr_t) fi->fh;
+        if (dh->dh_node != NULL) {
+                dir   = ipoddisk_node_dir(dh->dh_node);
+                nents = dir->dir_nents;
+        }
+        buf = g_malloc(size);
+
+        memset(&st, 0, sizeof(st));
+        for (k = offset; k < nents + 2; k++) {
+                const char           *name;
+                struct ipoddisk_node *child;
+                size_t                len;
+
+                if (k < 2) {
+                        name      = k == 0 ? "." : "..";
+                        st.st_ino = k == 0 ? ino : 0;
+                        st.st_mode = S_IFDIR;
+                } else if (dir == NULL) {
+                        name       = IPODDISK_STATS_FILE;
+                        st.st_ino  = IPODDISK_LL_STATS_FILE;
+                        st.st_mode = S_IFREG;
+                } else {
+                        name  = dir->dir_ents[k - 2].de_name;
+                        child = dir->dir_ents[k - 2].de_node;
+                        st.st_ino  = ipoddisk_ll_ino(dh->dh_tree, child);
+                        st.st_mode = IPODDISK_NODE_IS_FILE(child) ?
+                                     S_IFREG : S_IFDIR;
+                }
+
+                len = fuse_add_direntry(req, buf + used, size - used, name,
+                                        &st, k + 1);
+                if (len > size - used)
+                        break;  /* buffer full, kernel comes back for more */
+                used += len;
+        }
+
+        fuse_reply_buf(req, buf, used);
+        g_free(buf);
+
+        if (dir != NULL)
+                ipoddisk_stats_add(IPODDISK_OP_READDIR, start);
+        return;
+}
+
+static void
+ipoddisk_ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        int                   rc = 0;
+        struct ipoddisk_file *file;
+        struct ipoddisk_tree *tree;
+        struct ipoddisk_node *node;
+        guint64               start = ipoddisk_stats_clock();
+
+        if (IPODDISK_LL_STATS(ino)) {
+                if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+                        fuse_reply_err(req, EACCES);
+                } else if (ino == IPODDISK_LL_STATS_DIR) {
+                        fuse_reply_err(req, EISDIR);
+                } else {
+                        GString *text = ipoddisk_stats_text();
+
+                        fi->fh        = (uint64_t) (uintptr_t) text;
+                        fi->direct_io = 1;  /* its size is given as 0 */
+                        if (fuse_reply_open(req, fi) == -ENOENT)
+                                g_string_free(text, TRUE);
+                }
+                return;
+        }
+
+        tree = ipoddisk_tree_get();
+        node = ipoddisk_ll_node(tree, ino);
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+                rc = EACCES;
+        else if (!IPODDISK_NODE_IS_FILE(node))
+                rc = EISDIR;
+        else
+                rc = -ipoddisk_file_open(node, &file);
+        ipoddisk_tree_put(tree);
+
+        if (rc != 0) {
+                fuse_reply_err(req, rc);
+                ipoddisk_stats_add(IPODDISK_OP_OPEN, start);
+                return;
+        }
+
+        fi->fh         = (uint64_t) (uintptr_t) file; /* pins the subtree */
+        fi->keep_cache = 1;  /* tracks don't change under a published tree */
+        if (fuse_reply_open(req, fi) == -ENOENT)
+                ipoddisk_file_close(file);  /* interrupted */
+
+        ipoddisk_stats_add(IPODDISK_OP_OPEN, start);
+        return;
+}
+
+static void
+ipoddisk_ll_release (fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi)
+{
+        if (ino == IPODDISK_LL_STATS_FILE)
+                g_string_free((GString *) (uintptr_t) fi->fh, TRUE);
+        else
+                ipoddisk_file_close((struct ipoddisk_file *) (uintptr_t) fi->fh);
+
+        fuse_reply_err(req, 0);
+        return;
+}
+
+static void
+ipoddisk_ll_read (fuse_req_t req, fuse_ino_t ino, size_t size,
+                  off_t offset, struct fuse_file_info *fi)
+{
+        struct ipoddisk_file *file = (struct ipoddisk_file *) (uintptr_t) fi->fh;
+        char                 *buf;
+        ssize_t               rc;
+        guint64               start = ipoddisk_stats_clock();
+
+        buf = g_malloc(size);
+
+        if (ino == IPODDISK_LL_STATS_FILE) {
+                rc = ipoddisk_stats_read((GString *) (uintptr_t) fi->fh,
+                                         buf, size, offset);
+                fuse_reply_buf(req, buf, rc);
+                g_free(buf);
+                return;
+        }
+
+#if FUSE_VERSION >= 29
+        if (!ipoddisk_opts.nosplice) {
+                /* as ipoddisk_read_buf: what isn't in memory is spliced
+                 * from the iPod file */
+                struct {
+                        struct fuse_bufvec bv;
+                        struct fuse_buf    more;
+                } v;
+                size_t done;
+
+                memset(&v, 0, sizeof(v));
+                done = ipoddisk_file_read_cached(file, buf, size, offset);
+                if (done > 0) {
+                        v.bv.buf[v.bv.count].size = done;
+                        v.bv.buf[v.bv.count].mem  = buf;
+                        v.bv.count++;
+                }
+                if (done < size && file->fl_fd != NULL) {
+                        v.bv.buf[v.bv.count].size  = size - done;
+                        v.bv.buf[v.bv.count].flags = FUSE_BUF_IS_FD |
+                                                     FUSE_BUF_FD_SEEK;
+                        v.bv.buf[v.bv.count].fd    = file->fl_fd->fd_fd;
+                        v.bv.buf[v.bv.count].pos   = offset + done;
+                        v.bv.count++;
+                }
+
+                /* timed before libfuse splices the rest */
+                ipoddisk_stats_add(IPODDISK_OP_READ, start);
+                fuse_reply_data(req, &v.bv, FUSE_BUF_SPLICE_MOVE);
+                g_free(buf);
+                return;
+        }
+#endif
+
+        rc = ipoddisk_file_read(file, buf, size, offset);
+        if (rc < 0)
+                fuse_reply_err(req, -rc);
+        else
+                fuse_reply_buf(req, buf, rc);
+
+        g_free(buf);
+        ipoddisk_stats_add(IPODDISK_OP_READ, start);
+        return;
+}
+
+static struct fuse_lowlevel_ops ipoddisk_ll_ops = {
+        .init       = ipoddisk_ll_init,
+        .destroy    = ipoddisk_ll_destroy,
+        .lookup     = ipoddisk_ll_lookup,
+        .forget     = ipoddisk_ll_forget,
+        .getattr    = ipoddisk_ll_getattr,
+        .access     = ipoddisk_ll_access,
+        .statfs     = ipoddisk_ll_statfs,
+        .opendir    = ipoddisk_ll_opendir,
+        .readdir    = ipoddisk_ll_readdir,
+        .releasedir = ipoddisk_ll_releasedir,
+        .open       = ipoddisk_ll_open,
+        .read       = ipoddisk_ll_read,
+        .release    = ipoddisk_ll_release,
+};
+
+#if FUSE_VERSION >= 28
+static void
+ipoddisk_ll_inval_root (struct ipoddisk_tree *tree)
+{
+        struct ipoddisk_dir *dir = ipoddisk_node_dir(tree->tr_root);
+        guint                i;
+
+        for (i = 0; i < dir->dir_nents; i++)
+                fuse_lowlevel_notify_inval_entry(ll_chan, FUSE_ROOT_ID,
+                                                 dir->dir_ents[i].de_name,
+                                                 strlen(dir->dir_ents[i].de_name));
+
+        return;
+}
+#endif
+
+/**
+ * Tells the kernel to forget what it cached of the root directory of
+ * the old tree, so that it looks the new one up. Entries below the root
+ * hang off old inodes, which lose their names with it.
+ */
+static void
+ipoddisk_ll_tree_changed (struct ipoddisk_tree *old,
+                          struct ipoddisk_tree *tree)
+{
+#if FUSE_VERSION >= 28
+        if (ll_chan == NULL)
+                return;
+
+        /* names gone and names that were cached as missing */
+        ipoddisk_ll_inval_root(old);
+        ipoddisk_ll_inval_root(tree);
+        fuse_lowlevel_notify_inval_inode(ll_chan, FUSE_ROOT_ID, 0, 0);
+#else
+        UNUSED (old);
+        UNUSED (tree);
+#endif
+
+        return;
+}
+
+/**
+ * Mounts and serves the filesystem through the low-level API, in place
+ * of fuse_main
+ * @return exit status for main
+ */
+int
+ipoddisk_ll_main (struct fuse_args *args)
+{
+        int                 rc = 1;
+        int                 multithreaded;
+        int                 foreground;
+        char               *mountpoint;
+        struct fuse_chan   *ch;
+        struct fuse_session *se;
+
+        if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                               &foreground) == -1)
+                return 1;
+
+        ll_inodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        ch = fuse_mount(mountpoint, args);
+        if (ch == NULL)
+                goto out;
+
+        se = fuse_lowlevel_new(args, &ipoddisk_ll_ops,
+                               sizeof(ipoddisk_ll_ops), NULL);
+        if (se == NULL)
+                goto out_unmount;
+
+        if (fuse_set_signal_handlers(se) == -1)
+                goto out_destroy;
+
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+
+        ll_chan = ch;
+        ipoddisk_tree_notify(ipoddisk_ll_tree_changed);
+        rc = (multithreaded ? fuse_session_loop_mt(se)
+                            : fuse_session_loop(se)) == -1;
+        ipoddisk_tree_notify(NULL);
+        ll_chan = NULL;
+
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+out_destroy:
+        fuse_session_destroy(se);
+out_unmount:
+        fuse_unmount(mountpoint, ch);
+out:
+        free(mountpoint);
+        fuse_opt_free_args(args);
+
+        return rc;
+}
@@ -0,0 +1,272 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Manifests of directories of tracks: Tracks.m3u8, a playlist players
+ * can open, and Tracks.json, the metadata of the tracks for scripts, so
+ * that neither has to stat every track. Albums list their tracks in
+ * disc and track order, playlists and other directories in their own
+ * order. Paths are relative to the directory, which makes them entry
+ * names; sizes and durations are those iTunesDB gives. A size is the
+ * database's figure even once the track has been opened, when stat and
+ * read go by the file, see ipoddisk_track_check: a manifest can't change
+ * after its size has been reported. Scripts that need the exact size
+ * stat the path.
+ *
+ * getattr needs the size of a manifest before anyone reads it. Rather
+ * than making up the text for that, the writer can run without a buffer
+ * and only count what it would write; the text itself is made up on
+ * first open. Both are kept with the directory: with the subtree, which
+ * is replaced rather than changed when iTunesDB changes, or with the
+ * search result, which goes once nothing holds it.
+ */
+
+#include <stdarg.h>
+
+#include "ipoddisk.h"
+
+/* What a manifest is written to: its text, or nothing if mo_text is
+ * NULL and only its length is wanted */
+struct ipoddisk_manifest_out {
+        GString *mo_text;
+        gsize    mo_len;
+};
+
+static void
+ipoddisk_manifest_put (struct ipoddisk_manifest_out *mo, const gchar *str,
+                       gsize len)
+{
+        if (mo->mo_text != NULL)
+                g_string_append_len(mo->mo_text, str, len);
+        mo->mo_len += len;
+
+        return;
+}
+
+static void
+ipoddisk_manifest_puts (struct ipoddisk_manifest_out *mo, const gchar *str)
+{
+        ipoddisk_manifest_put(mo, str, strlen(str));
+        return;
+}
+
+/* Only for numbers and other short things */
+static void
+ipoddisk_manifest_printf (struct ipoddisk_manifest_out *mo,
+                          const gchar *fmt, ...)
+{
+        char    buf[64];
+        va_list ap;
+        int     n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        assert (n >= 0 && (size_t) n < sizeof(buf));
+
+        ipoddisk_manifest_put(mo, buf, n);
+        return;
+}
+
+/* Writes str as a JSON string, or null */
+static void
+ipoddisk_manifest_json (struct ipoddisk_manifest_out *mo, const gchar *str)
+{
+        const gchar *run;
+
+        if (str == NULL) {
+                ipoddisk_manifest_puts(mo, "null");
+                return;
+        }
+
+        ipoddisk_manifest_put(mo, "\"", 1);
+        for (run = str; *str != '\0'; str++) {
+                guchar c = *str;
+
+                if (c >= 0x20 && c != '"' && c != '\\')
+                        continue;  /* UTF-8 goes as it is */
+
+                ipoddisk_manifest_put(mo, run, str - run);
+                if (c == '"' || c == '\\') {
+                        ipoddisk_manifest_put(mo, "\\", 1);
+                        ipoddisk_manifest_put(mo, str, 1);
+                } else {
+                        ipoddisk_manifest_printf(mo, "\\u%04x", c);
+                }
+                run = str + 1;
+        }
+        ipoddisk_manifest_put(mo, run, str - run);
+        ipoddisk_manifest_put(mo, "\"", 1);
+
+        return;
+}
+
+/* Album order: by disc, then track number, then as listed */
+static gint
+ipoddisk_manifest_cmp (gconstpointer a, gconstpointer b, gpointer tracks)
+{
+        const struct ipoddisk_dirent *ea = *(struct ipoddisk_dirent **) a;
+        const struct ipoddisk_dirent *eb = *(struct ipoddisk_dirent **) b;
+        struct ipoddisk_tracks       *tt = tracks;
+        guint                         i = ea->de_node->nd_data.track.trk_index;
+        guint                         j = eb->de_node->nd_data.track.trk_index;
+
+        if (tt->tt_cd_nr[i] != tt->tt_cd_nr[j])
+                return tt->tt_cd_nr[i] < tt->tt_cd_nr[j] ? -1 : 1;
+        if (tt->tt_track_nr[i] != tt->tt_track_nr[j])
+                return tt->tt_track_nr[i] < tt->tt_track_nr[j] ? -1 : 1;
+
+        return ea < eb ? -1 : ea > eb ? 1 : 0;
+}
+
+/**
+ * Writes a manifest out, called with ipod_view_lock held
+ */
+static void
+ipoddisk_manifest_write (struct ipoddisk_manifest *mf,
+                         struct ipoddisk_manifest_out *mo)
+{
+        struct ipoddisk_dir     *dir = &mf->mf_dir->nd_children;
+        struct ipoddisk_tracks  *tt = &mf->mf_ipod->ipod_tracks;
+        struct ipoddisk_dirent **ents;
+        guint                    n = 0;
+        guint                    j;
+
+        ents = g_new(struct ipoddisk_dirent *, MAX(dir->dir_nents, 1));
+        for (j = 0; j < dir->dir_nents; j++)
+                if (dir->dir_ents[j].de_node->nd_type == IPODDISK_NODE_LEAF)
+                        ents[n++] = &dir->dir_ents[j];
+        if (mf->mf_album)
+                g_qsort_with_data(ents, n, sizeof(*ents),
+                                  ipoddisk_manifest_cmp, tt);
+
+        ipoddisk_manifest_puts(mo, mf->mf_type == IPODDISK_MANIFEST_M3U8 ?
+                                   "#EXTM3U\n" : "[\n");
+
+        for (j = 0; j < n; j++) {
+                guint i = ents[j]->de_node->nd_data.track.trk_index;
+
+                if (mf->mf_type == IPODDISK_MANIFEST_M3U8) {
+                        ipoddisk_manifest_printf(mo, "#EXTINF:%d,",
+                                tt->tt_length[i] ?
+                                (int) ((tt->tt_length[i] + 500) / 1000) : -1);
+                        ipoddisk_manifest_puts(mo, tt->tt_artist[i] ?
+                                tt->tt_artist[i] : "Unknown Artist");
+                        ipoddisk_manifest_puts(mo, " - ");
+                        ipoddisk_manifest_puts(mo, tt->tt_title[i] ?
+                                tt->tt_title[i] : "Unknown Track");
+                        ipoddisk_manifest_puts(mo, "\n");
+                        ipoddisk_manifest_puts(mo, ents[j]->de_name);
+                        ipoddisk_manifest_puts(mo, "\n");
+                        continue;
+                }
+
+                ipoddisk_manifest_puts(mo, "  {\"path\": ");
+                ipoddisk_manifest_json(mo, ents[j]->de_name);
+                ipoddisk_manifest_puts(mo, ", \"title\": ");
+                ipoddisk_manifest_json(mo, tt->tt_title[i]);
+                ipoddisk_manifest_puts(mo, ", \"artist\": ");
+                ipoddisk_manifest_json(mo, tt->tt_artist[i]);
+                ipoddisk_manifest_puts(mo, ", \"album\": ");
+                ipoddisk_manifest_json(mo, tt->tt_album[i]);
+                ipoddisk_manifest_puts(mo, ", \"genre\": ");
+                ipoddisk_manifest_json(mo, tt->tt_genre[i]);
+                ipoddisk_manifest_printf(mo, ", \"track\": %u, \"disc\": %u, "
+                                         "\"year\": %u",
+                                         tt->tt_track_nr[i], tt->tt_cd_nr[i],
+                                         tt->tt_year[i]);
+                ipoddisk_manifest_printf(mo, ", \"duration_ms\": %u, "
+                                         "\"size\": %lld}%s\n",
+                                         tt->tt_length[i],
+                                         (long long) tt->tt_size[i],
+                                         j + 1 < n ? "," : "");
+        }
+
+        if (mf->mf_type == IPODDISK_MANIFEST_JSON)
+                ipoddisk_manifest_puts(mo, "]\n");
+
+        g_free(ents);
+        return;
+}
+
+/**
+ * Returns the size of a manifest, working it out the first time
+ */
+gsize
+ipoddisk_manifest_size (struct ipoddisk_node *node)
+{
+        struct ipoddisk_manifest *mf = node->nd_data.manifest;
+
+        if (g_atomic_int_get(&mf->mf_sized))
+                return mf->mf_size;
+
+        pthread_mutex_lock(&mf->mf_ipod->ipod_view_lock);
+        if (!mf->mf_sized) {
+                struct ipoddisk_manifest_out mo = { NULL, 0 };
+
+                ipoddisk_manifest_write(mf, &mo);
+                mf->mf_size = mo.mo_len;
+                g_atomic_int_set(&mf->mf_sized, 1);
+        }
+        pthread_mutex_unlock(&mf->mf_ipod->ipod_view_lock);
+
+        return mf->mf_size;
+}
+
+/**
+ * Returns the text of a manifest, making it up the first time. It is
+ * ipoddisk_manifest_size bytes long and not NUL-terminated.
+ */
+const gchar *
+ipoddisk_manifest_text (struct ipoddisk_node *node)
+{
+        struct ipoddisk_manifest *mf = node->nd_data.manifest;
+        gchar                    *text;
+
+        text = g_atomic_pointer_get(&mf->mf_text);
+        if (text != NULL)
+                return text;
+
+        pthread_mutex_lock(&mf->mf_ipod->ipod_view_lock);
+        text = mf->mf_text;
+        if (text == NULL) {
+                struct ipoddisk_manifest_out mo;
+
+                mo.mo_text = g_string_sized_new(4096);
+                mo.mo_len  = 0;
+                ipoddisk_manifest_write(mf, &mo);
+
+                text = ipoddisk_arena_alloc(mf->mf_arena, mo.mo_len);
+                memcpy(text, mo.mo_text->str, mo.mo_len);
+                g_string_free(mo.mo_text, TRUE);
+
+                mf->mf_size = mo.mo_len;
+                g_atomic_int_set(&mf->mf_sized, 1);
+                g_atomic_pointer_set(&mf->mf_text, text);
+        }
+        pthread_mutex_unlock(&mf->mf_ipod->ipod_view_lock);
+
+        return text;
+}
+
+/**
+ * Copies what there is of [off, off + size) of a manifest into buf
+ * @return bytes copied
+ */
+size_t
+ipoddisk_manifest_read (struct ipoddisk_node *node, char *buf, size_t size,
+                        off_t off)
+{
+        const gchar *text = ipoddisk_manifest_text(node);
+        gsize        len = node->nd_data.manifest->mf_size;
+        size_t       n;
+
+        if (off < 0 || (gsize) off >= len)
+                return 0;
+
+        n = MIN(size, len - off);
+        memcpy(buf, text + off, n);
+
+        return n;
+}
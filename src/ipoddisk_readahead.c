@@ -0,0 +1,457 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Readahead for tracks being streamed. Each open file watches its own
+ * read offsets; once it is read sequentially it gets a ring of aligned
+ * blocks that worker threads fill ahead of the reader, so a player
+ * rarely waits for a slow, spun-down iPod disk.
+ */
+
+#include <stdlib.h>
+
+#include "ipoddisk.h"
+
+/* Reads in a row at the expected offset before readahead starts */
+#define IPODDISK_RA_TRIGGER     2
+
+enum {
+        IPODDISK_RA_EMPTY,
+        IPODDISK_RA_PENDING,    /* queued or being read by a worker */
+        IPODDISK_RA_READY
+};
+
+struct ipoddisk_ra_block {
+        off_t    rb_off;
+        ssize_t  rb_len;        /* bytes read, or -errno */
+        int      rb_state;
+        char    *rb_data;
+};
+
+struct ipoddisk_ra_job {
+        struct ipoddisk_file     *rj_file;
+        struct ipoddisk_ra_block *rj_block;
+};
+
+struct ipoddisk_ra_stats ipoddisk_ra_stats;
+
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  ra_cond = PTHREAD_COND_INITIALIZER;
+static GQueue         *ra_jobs;       /* struct ipoddisk_ra_job */
+static int             ra_running;    /* there are workers */
+
+/**
+ * Opens a track or manifest for reading
+ * @param filep On success, the new file; close with ipoddisk_file_close
+ * @return 0 on success, -errno otherwise
+ */
+int
+ipoddisk_file_open (struct ipoddisk_node *node, struct ipoddisk_file **filep)
+{
+        int                   rc;
+        struct ipoddisk_fd   *fd;
+        struct ipoddisk_file *file;
+
+        if (node->nd_type == IPODDISK_NODE_MANIFEST) {
+                /* made up now rather than on the first read */
+                ipoddisk_manifest_text(node);
+                ipoddisk_ipod_ref(node->nd_data.manifest->mf_ipod);
+                ipoddisk_node_hold(node);
+                fd = NULL;
+        } else {
+                rc = ipoddisk_fd_get(node, &fd);
+                if (rc != 0)
+                        return rc;
+        }
+
+        file = g_slice_new0(struct ipoddisk_file);
+        file->fl_fd       = fd;
+        file->fl_manifest = fd ? NULL : node;
+        pthread_mutex_init(&file->fl_lock, NULL);
+        pthread_cond_init(&file->fl_cond, NULL);
+
+        *filep = file;
+        return 0;
+}
+
+static void
+ipoddisk_file_free (struct ipoddisk_file *file)
+{
+        guint i;
+
+        for (i = 0; i < file->fl_nblocks; i++)
+                free(file->fl_blocks[i].rb_data);
+        g_free(file->fl_blocks);
+
+        pthread_cond_destroy(&file->fl_cond);
+        pthread_mutex_destroy(&file->fl_lock);
+        if (file->fl_manifest != NULL) {
+                struct ipoddisk_ipod *ipod;
+
+                ipod = file->fl_manifest->nd_data.manifest->mf_ipod;
+                ipoddisk_node_release(file->fl_manifest);
+                ipoddisk_ipod_unref(ipod);
+        } else
+                ipoddisk_fd_put(file->fl_fd);
+        g_slice_free(struct ipoddisk_file, file);
+
+        return;
+}
+
+/**
+ * Closes a file. Blocks still being read ahead are dropped; the last
+ * worker done with them frees the file.
+ */
+void
+ipoddisk_file_close (struct ipoddisk_file *file)
+{
+        int idle;
+
+        pthread_mutex_lock(&file->fl_lock);
+        file->fl_closed = 1;
+        idle = file->fl_jobs == 0;
+        pthread_mutex_unlock(&file->fl_lock);
+
+        if (idle)
+                ipoddisk_file_free(file);
+
+        return;
+}
+
+/**
+ * Sets up the readahead ring of a file, called with fl_lock held
+ * @return FALSE if there's no memory for it
+ */
+static gboolean
+ipoddisk_ra_alloc (struct ipoddisk_file *file)
+{
+        guint n;
+        guint i;
+
+        /* the block being read plus a window's worth ahead of it */
+        n = MAX(ipoddisk_opts.readahead * 1024 / IPODDISK_BLOCK, 1) + 1;
+
+        file->fl_blocks = g_new0(struct ipoddisk_ra_block, n);
+        for (i = 0; i < n; i++) {
+                if (posix_memalign((void **) &file->fl_blocks[i].rb_data,
+                                   4096, IPODDISK_BLOCK) != 0) {
+                        while (i-- > 0)
+                                free(file->fl_blocks[i].rb_data);
+                        g_free(file->fl_blocks);
+                        file->fl_blocks = NULL;
+                        return FALSE;
+                }
+        }
+        file->fl_nblocks = n;
+
+        return TRUE;
+}
+
+/**
+ * Copies what the ring holds of [off, off + size) into buf, waiting for
+ * blocks that are on their way. Called with fl_lock held.
+ * @return number of bytes copied from the start of the range
+ */
+static size_t
+ipoddisk_ra_copy (struct ipoddisk_file *file, char *buf, size_t size,
+                  off_t off, int *waited)
+{
+        size_t done = 0;
+
+        while (done < size) {
+                struct ipoddisk_ra_block *block;
+                off_t                     boff;
+                size_t                    skip;
+                size_t                    n;
+
+                boff  = (off + done) / IPODDISK_BLOCK * IPODDISK_BLOCK;
+                block = &file->fl_blocks[(boff / IPODDISK_BLOCK) %
+                                         file->fl_nblocks];
+
+                while (block->rb_state == IPODDISK_RA_PENDING &&
+                       block->rb_off == boff) {
+                        *waited = 1;
+                        pthread_cond_wait(&file->fl_cond, &file->fl_lock);
+                }
+
+                /* errors are left for the caller's own read to find */
+                if (block->rb_state != IPODDISK_RA_READY ||
+                    block->rb_off != boff || block->rb_len < 0) {
+                        /* not read ahead as another alias had cached it */
+                        n = ipoddisk_bc_read(file->fl_fd->fd_node, buf + done,
+                                             MIN(size - done,
+                                                 boff + IPODDISK_BLOCK -
+                                                 (off + done)),
+                                             off + done);
+                        if (n == 0)
+                                break;
+                        done += n;
+                        continue;
+                }
+
+                skip = off + done - boff;
+                if (skip >= (size_t) block->rb_len)
+                        break;  /* end of file */
+
+                n = MIN(size - done, block->rb_len - skip);
+                memcpy(buf + done, block->rb_data + skip, n);
+                done += n;
+
+                if (block->rb_len < IPODDISK_BLOCK)
+                        break;  /* end of file */
+        }
+
+        return done;
+}
+
+/**
+ * Queues the blocks from the one holding off on, up to the end of the
+ * window or of the track. Called with fl_lock held.
+ */
+static void
+ipoddisk_ra_schedule (struct ipoddisk_file *file, off_t off)
+{
+        off_t  size;
+        time_t mtime;
+        off_t  b;
+        off_t  first = off / IPODDISK_BLOCK;
+        int    queued = 0;
+
+        ipoddisk_track_attr(file->fl_fd->fd_node, &size, &mtime);
+
+        for (b = first; b < first + (off_t) file->fl_nblocks - 1; b++) {
+                struct ipoddisk_ra_block *block;
+                struct ipoddisk_ra_job   *job;
+
+                if (b * IPODDISK_BLOCK >= size)
+                        break;
+
+                block = &file->fl_blocks[b % file->fl_nblocks];
+                if (block->rb_state == IPODDISK_RA_PENDING ||
+                    (block->rb_state == IPODDISK_RA_READY &&
+                     block->rb_off == b * IPODDISK_BLOCK))
+                        continue;
+                if (ipoddisk_bc_contains(file->fl_fd->fd_node,
+                                         b * IPODDISK_BLOCK))
+                        continue;
+
+                block->rb_off   = b * IPODDISK_BLOCK;
+                block->rb_state = IPODDISK_RA_PENDING;
+                file->fl_jobs++;
+
+                job = g_slice_new(struct ipoddisk_ra_job);
+                job->rj_file  = file;
+                job->rj_block = block;
+
+                pthread_mutex_lock(&ra_lock);
+                g_queue_push_tail(ra_jobs, job);
+                pthread_mutex_unlock(&ra_lock);
+                queued++;
+        }
+
+        if (queued > 0)
+                pthread_cond_broadcast(&ra_cond);
+
+        return;
+}
+
+/**
+ * Reads from the iPod what is neither read ahead nor cached. With the
+ * block cache on, whole blocks are read so that they can be cached.
+ * @return bytes read, or -errno
+ */
+static ssize_t
+ipoddisk_file_fill (struct ipoddisk_file *file, char *buf, size_t size,
+                    off_t off)
+{
+        off_t   boff = off / IPODDISK_BLOCK * IPODDISK_BLOCK;
+        size_t  skip = off - boff;
+        char   *data;
+        ssize_t rc;
+        guint64 start;
+
+        if (ipoddisk_opts.cache == 0) {
+                start = ipoddisk_stats_clock();
+                rc = pread(file->fl_fd->fd_fd, buf, size, off);
+                ipoddisk_stats_add(IPODDISK_OP_DEVICE, start);
+                return rc == -1 ? -errno : rc;
+        }
+
+        data  = g_malloc(IPODDISK_BLOCK);
+        start = ipoddisk_stats_clock();
+        rc = pread(file->fl_fd->fd_fd, data, IPODDISK_BLOCK, boff);
+        ipoddisk_stats_add(IPODDISK_OP_DEVICE, start);
+        if (rc == -1) {
+                rc = -errno;
+        } else {
+                ipoddisk_bc_insert(file->fl_fd->fd_node, boff, data, rc);
+                rc = (size_t) rc > skip ? MIN(size, rc - skip) : 0;
+                memcpy(buf, data + skip, rc);
+        }
+        g_free(data);
+
+        return rc;
+}
+
+/**
+ * Reads what is already in memory of [off, off + size) of a file, from
+ * readahead blocks when the file is being read sequentially and from
+ * the block cache otherwise. Keeps readahead going either way.
+ * @return number of bytes read from the start of the range
+ */
+size_t
+ipoddisk_file_read_cached (struct ipoddisk_file *file, char *buf,
+                           size_t size, off_t off)
+{
+        size_t done = 0;
+
+        if (file->fl_manifest != NULL)  /* all in memory */
+                return ipoddisk_manifest_read(file->fl_manifest, buf, size,
+                                              off);
+
+        pthread_mutex_lock(&file->fl_lock);
+
+        file->fl_seq  = off == file->fl_next ? file->fl_seq + 1 : 0;
+        file->fl_next = off + size;
+
+        if (ra_running && file->fl_seq >= IPODDISK_RA_TRIGGER &&
+            (file->fl_blocks != NULL || ipoddisk_ra_alloc(file))) {
+                int waited = 0;
+
+                done = ipoddisk_ra_copy(file, buf, size, off, &waited);
+                ipoddisk_ra_schedule(file, off + size);
+
+                if (done == size) {
+                        ipoddisk_count(&ipoddisk_ra_stats.ra_hits);
+                        if (waited)
+                                ipoddisk_count(&ipoddisk_ra_stats.ra_waits);
+                } else {
+                        ipoddisk_count(&ipoddisk_ra_stats.ra_misses);
+                }
+        }
+
+        pthread_mutex_unlock(&file->fl_lock);
+
+        if (done < size)
+                done += ipoddisk_bc_read(file->fl_fd->fd_node, buf + done,
+                                         size - done, off + done);
+
+        return done;
+}
+
+/**
+ * Reads from a file like pread(2), from memory where it can
+ * @return bytes read, or -errno
+ */
+ssize_t
+ipoddisk_file_read (struct ipoddisk_file *file, char *buf, size_t size,
+                    off_t off)
+{
+        size_t  done;
+        ssize_t rc;
+
+        done = ipoddisk_file_read_cached(file, buf, size, off);
+        if (file->fl_manifest != NULL)
+                return done;
+
+        while (done < size) {
+                rc = ipoddisk_file_fill(file, buf + done, size - done,
+                                        off + done);
+                if (rc < 0)
+                        return done ? (ssize_t) done : rc;
+                if (rc == 0)
+                        break;  /* end of file */
+                done += rc;
+
+                /* the next blocks may have been cached meanwhile */
+                done += ipoddisk_bc_read(file->fl_fd->fd_node, buf + done,
+                                         size - done, off + done);
+        }
+
+        return done;
+}
+
+static void *
+ipoddisk_ra_thread (void *arg)
+{
+        UNUSED (arg);
+
+        for (;;) {
+                struct ipoddisk_ra_job   *job;
+                struct ipoddisk_file     *file;
+                struct ipoddisk_ra_block *block;
+                ssize_t                   rc = -ECANCELED;
+                int                       closed;
+                int                       last;
+
+                pthread_mutex_lock(&ra_lock);
+                while (g_queue_is_empty(ra_jobs))
+                        pthread_cond_wait(&ra_cond, &ra_lock);
+                job = g_queue_pop_head(ra_jobs);
+                pthread_mutex_unlock(&ra_lock);
+
+                file  = job->rj_file;
+                block = job->rj_block;
+                g_slice_free(struct ipoddisk_ra_job, job);
+
+                /* nobody else touches a pending block */
+                pthread_mutex_lock(&file->fl_lock);
+                closed = file->fl_closed;
+                pthread_mutex_unlock(&file->fl_lock);
+
+                if (!closed) {
+                        guint64 start = ipoddisk_stats_clock();
+
+                        rc = pread(file->fl_fd->fd_fd, block->rb_data,
+                                   IPODDISK_BLOCK, block->rb_off);
+                        ipoddisk_stats_add(IPODDISK_OP_DEVICE, start);
+                        if (rc == -1)
+                                rc = -errno;
+                        else
+                                ipoddisk_bc_insert(file->fl_fd->fd_node,
+                                                   block->rb_off,
+                                                   block->rb_data, rc);
+                        ipoddisk_count(&ipoddisk_ra_stats.ra_blocks);
+                }
+
+                pthread_mutex_lock(&file->fl_lock);
+                block->rb_len   = rc;
+                block->rb_state = closed ? IPODDISK_RA_EMPTY : IPODDISK_RA_READY;
+                file->fl_jobs--;
+                last = file->fl_closed && file->fl_jobs == 0;
+                pthread_cond_broadcast(&file->fl_cond);
+                pthread_mutex_unlock(&file->fl_lock);
+
+                if (last)
+                        ipoddisk_file_free(file);
+        }
+
+        return NULL;
+}
+
+/**
+ * Starts the readahead workers; without them files are read directly
+ */
+void
+ipoddisk_ra_start (void)
+{
+        pthread_t      thread;
+        pthread_attr_t attr;
+        unsigned int   i;
+
+        ra_jobs = g_queue_new();
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        for (i = 0; i < MAX(ipoddisk_opts.readahead_threads, 1); i++)
+                if (pthread_create(&thread, &attr, ipoddisk_ra_thread, NULL) == 0)
+                        ra_running = 1;
+        pthread_attr_destroy(&attr);
+
+        if (!ra_running)
+                fprintf(stderr, "failed to start readahead workers, "
+                                "readahead disabled\n");
+
+        return;
+}
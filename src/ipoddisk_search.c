@@ -0,0 +1,267 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Word index over the titles, artists, albums and genres of the tracks
+ * of an iPod, behind its Search directory: looking up Search/<query>
+ * lists the tracks that have, for every word of the query, a word
+ * starting with it. "beat help" finds Help! by the Beatles.
+ *
+ * Words are runs of letters and digits, case-folded and with accents
+ * dropped, so "beyonce" finds Beyoncé. The index is a sorted array of
+ * distinct words, each with the ascending indices of the tracks that
+ * have it; a query word is looked up by binary search, and all index
+ * words it is a prefix of follow it.
+ *
+ * The index is built on the first search, from the track table, so it
+ * costs nothing to mounts nobody searches and works the same for
+ * subtrees loaded from a snapshot. It goes into the arena of the
+ * subtree; callers hold ipod_view_lock.
+ */
+
+#include "ipoddisk.h"
+
+/**
+ * Calls fn on each word of the first len bytes of str, or all of it if
+ * len is -1
+ */
+static void
+ipoddisk_search_words (const gchar *str, gssize len,
+                       void (*fn) (const gchar *word, gpointer arg),
+                       gpointer arg)
+{
+        gchar       *norm;
+        gchar       *fold;
+        const gchar *p;
+        GString     *word;
+
+        /* names are stored decomposed already, but what is typed in
+         * on Linux usually isn't */
+        norm = g_utf8_normalize(str, len, G_NORMALIZE_NFD);
+        if (norm == NULL)
+                return;  /* not UTF-8 */
+        fold = g_utf8_casefold(norm, -1);
+        word = g_string_sized_new(32);
+
+        for (p = fold; ; p = g_utf8_next_char(p)) {
+                gunichar c = g_utf8_get_char(p);
+
+                if (c != 0 && g_unichar_ismark(c))
+                        continue;  /* accent of the letter before */
+                if (c != 0 && g_unichar_isalnum(c)) {
+                        g_string_append_unichar(word, c);
+                        continue;
+                }
+
+                if (word->len > 0) {
+                        fn(word->str, arg);
+                        g_string_truncate(word, 0);
+                }
+                if (c == 0)
+                        break;
+        }
+
+        g_string_free(word, TRUE);
+        g_free(fold);
+        g_free(norm);
+
+        return;
+}
+
+/* Words of the tracks seen so far, while building */
+struct ipoddisk_search_builder {
+        GHashTable *sb_words;   /* word -> GArray of track indices */
+        guint       sb_track;   /* track being added */
+};
+
+static void
+ipoddisk_search_add (const gchar *word, gpointer arg)
+{
+        struct ipoddisk_search_builder *sb = arg;
+        GArray                         *postings;
+
+        postings = g_hash_table_lookup(sb->sb_words, word);
+        if (postings == NULL) {
+                postings = g_array_new(FALSE, FALSE, sizeof(guint));
+                g_hash_table_insert(sb->sb_words, g_strdup(word), postings);
+        }
+
+        /* tracks are added in order, and a word can come up in several
+         * fields of one */
+        if (postings->len == 0 ||
+            g_array_index(postings, guint, postings->len - 1) != sb->sb_track)
+                g_array_append_val(postings, sb->sb_track);
+
+        return;
+}
+
+static void
+ipoddisk_search_collect (gpointer key, gpointer value, gpointer words)
+{
+        UNUSED (value);
+
+        g_ptr_array_add(words, key);
+        return;
+}
+
+static gint
+ipoddisk_search_cmp (gconstpointer a, gconstpointer b)
+{
+        return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+static void
+ipoddisk_search_free_postings (gpointer postings)
+{
+        g_array_free(postings, TRUE);
+        return;
+}
+
+/**
+ * Builds the word index of an iPod, unless it has one already
+ */
+void
+ipoddisk_search_build (struct ipoddisk_ipod *ipod)
+{
+        struct ipoddisk_tracks         *tt = &ipod->ipod_tracks;
+        struct ipoddisk_search_builder  sb;
+        struct ipoddisk_search         *sr;
+        GPtrArray                      *words;
+        guint                           i;
+
+        if (ipod->ipod_search != NULL)
+                return;
+
+        sb.sb_words = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            ipoddisk_search_free_postings);
+
+        for (i = 0; i < tt->tt_count; i++) {
+                const gchar *fields[4];
+                int          f;
+
+                fields[0] = tt->tt_title[i];
+                fields[1] = tt->tt_artist[i];
+                fields[2] = tt->tt_album[i];
+                fields[3] = tt->tt_genre[i];
+
+                sb.sb_track = i;
+                for (f = 0; f < 4; f++)
+                        if (fields[f] != NULL)
+                                ipoddisk_search_words(fields[f], -1,
+                                                      ipoddisk_search_add, &sb);
+        }
+
+        words = g_ptr_array_sized_new(g_hash_table_size(sb.sb_words));
+        g_hash_table_foreach(sb.sb_words, ipoddisk_search_collect, words);
+        g_ptr_array_sort(words, ipoddisk_search_cmp);
+
+        sr = ipoddisk_arena_alloc(ipod->ipod_arena, sizeof(*sr));
+        sr->sr_ntokens   = words->len;
+        sr->sr_tokens    = ipoddisk_arena_alloc(ipod->ipod_arena,
+                                words->len * sizeof(*sr->sr_tokens));
+        sr->sr_npostings = ipoddisk_arena_alloc(ipod->ipod_arena,
+                                words->len * sizeof(*sr->sr_npostings));
+        sr->sr_postings  = ipoddisk_arena_alloc(ipod->ipod_arena,
+                                words->len * sizeof(*sr->sr_postings));
+
+        for (i = 0; i < words->len; i++) {
+                gchar  *word = g_ptr_array_index(words, i);
+                GArray *postings = g_hash_table_lookup(sb.sb_words, word);
+
+                sr->sr_tokens[i]    = ipoddisk_arena_strdup(ipod->ipod_arena,
+                                                            word);
+                sr->sr_npostings[i] = postings->len;
+                sr->sr_postings[i]  = ipoddisk_arena_alloc(ipod->ipod_arena,
+                                        postings->len * sizeof(guint));
+                memcpy(sr->sr_postings[i], postings->data,
+                       postings->len * sizeof(guint));
+        }
+
+        g_ptr_array_free(words, TRUE);
+        g_hash_table_destroy(sb.sb_words);
+
+        ipod->ipod_search = sr;
+        return;
+}
+
+/* A query being run */
+struct ipoddisk_search_query {
+        struct ipoddisk_search *sq_index;
+        guint                  *sq_hits;    /* per track: words matched */
+        guint                   sq_nwords;  /* words of the query so far */
+};
+
+/**
+ * Counts a query word for the tracks that have matched all the words
+ * before it and have a word it is a prefix of
+ */
+static void
+ipoddisk_search_match (const gchar *word, gpointer arg)
+{
+        struct ipoddisk_search_query *sq = arg;
+        struct ipoddisk_search       *sr = sq->sq_index;
+        size_t                        len = strlen(word);
+        guint                         lo = 0;
+        guint                         hi = sr->sr_ntokens;
+        guint                         t;
+
+        while (lo < hi) {
+                guint mid = lo + (hi - lo) / 2;
+
+                if (strcmp(sr->sr_tokens[mid], word) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        for (t = lo; t < sr->sr_ntokens &&
+                     strncmp(sr->sr_tokens[t], word, len) == 0; t++) {
+                guint j;
+
+                for (j = 0; j < sr->sr_npostings[t]; j++) {
+                        guint i = sr->sr_postings[t][j];
+
+                        /* once per query word, however many of the
+                         * track's words it matches */
+                        if (sq->sq_hits[i] == sq->sq_nwords)
+                                sq->sq_hits[i]++;
+                }
+        }
+
+        sq->sq_nwords++;
+        return;
+}
+
+/**
+ * Runs a query against the index of an iPod, see ipoddisk_search_build
+ * @param query Words to look for; need not be NUL-terminated
+ * @return indices of the matching tracks, in track table order; none if
+ *         the query has no words
+ */
+GArray *
+ipoddisk_search_run (struct ipoddisk_ipod *ipod, const char *query,
+                     size_t len)
+{
+        struct ipoddisk_tracks       *tt = &ipod->ipod_tracks;
+        struct ipoddisk_search_query  sq;
+        GArray                       *tracks;
+        guint                         i;
+
+        assert (ipod->ipod_search != NULL);
+
+        sq.sq_index  = ipod->ipod_search;
+        sq.sq_hits   = g_new0(guint, tt->tt_count);
+        sq.sq_nwords = 0;
+
+        ipoddisk_search_words(query, len, ipoddisk_search_match, &sq);
+
+        tracks = g_array_new(FALSE, FALSE, sizeof(guint));
+        if (sq.sq_nwords > 0)
+                for (i = 0; i < tt->tt_count; i++)
+                        if (sq.sq_hits[i] == sq.sq_nwords)
+                                g_array_append_val(tracks, i);
+
+        g_free(sq.sq_hits);
+        return tracks;
+}
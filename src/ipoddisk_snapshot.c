@@ -0,0 +1,621 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Snapshots of built iPod subtrees, so that a mount whose iTunesDB
+ * hasn't changed can skip parsing it and building the tree.
+ *
+ * A snapshot is a header followed by an array of nodes, the track
+ * table, the playlists and their members, an array of directory entries
+ * and a string pool. Views that are built on first use are saved
+ * unbuilt, Search without the queries run so far and manifests without
+ * their text. It is mapped read-only when loaded; names and track paths
+ * point straight into the mapping, and nodes and entries go into the
+ * arena of the subtree.
+ */
+
+#include <sys/mman.h>
+
+#include "ipoddisk.h"
+
+#define IPODDISK_SNAP_MAGIC     "iPodSnap"
+#define IPODDISK_SNAP_VERSION   6
+#define IPODDISK_SNAP_BYTEORDER 0x01020304
+#define IPODDISK_SNAP_NULL      G_MAXUINT32  /* string offset of NULL */
+#define IPODDISK_SNAP_ALBUM     0x100        /* sn_data of album manifests */
+
+struct ipoddisk_snap_header {
+        char    sh_magic[8];
+        guint32 sh_version;
+        guint32 sh_byteorder;   /* snapshots are not portable */
+        guint64 sh_dbsize;      /* iTunesDB the snapshot was built from */
+        gint64  sh_dbmtime;
+        guint64 sh_dbhash;
+        guint32 sh_nnodes;      /* node 0 is the IPOD node */
+        guint32 sh_nents;
+        guint32 sh_ntracks;
+        guint32 sh_nplaylists;
+        guint32 sh_nmembers;
+        guint32 sh_pad;
+        guint64 sh_strsize;
+};
+
+struct ipoddisk_snap_node {
+        guint32 sn_type;
+        guint32 sn_nents;
+        guint32 sn_ents;        /* index of first entry */
+        guint32 sn_data;        /* leaves: index into the track table,
+                                   manifests: type, | IPODDISK_SNAP_ALBUM,
+                                   others: view still to be built */
+};
+
+struct ipoddisk_snap_track {
+        guint64 sk_size;
+        gint64  sk_mtime;
+        gint64  sk_added;
+        gint64  sk_played;
+        guint32 sk_path;        /* offsets into string pool */
+        guint32 sk_title;
+        guint32 sk_album;
+        guint32 sk_artist;
+        guint32 sk_genre;
+        guint32 sk_playcount;
+        guint32 sk_length;
+        guint16 sk_track_nr;
+        guint16 sk_cd_nr;
+        guint16 sk_year;
+        guint8  sk_compilation;
+        guint8  sk_rating;
+        guint8  sk_pad[4];
+};
+
+struct ipoddisk_snap_playlist {
+        guint32 sp_name;
+        guint32 sp_ntracks;
+        guint32 sp_tracks;      /* index of first member */
+};
+
+struct ipoddisk_snap_ent {
+        guint32 se_name;        /* offset into string pool */
+        guint32 se_hash;
+        guint32 se_ndup;
+        guint32 se_node;
+};
+
+#define FNV64_INIT  0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+static guint64
+ipoddisk_fnv64 (guint64 h, const guchar *p, size_t len)
+{
+        while (len--) {
+                h ^= *p++;
+                h *= FNV64_PRIME;
+        }
+        return h;
+}
+
+/**
+ * Hashes the contents of an iTunesDB, as part of the key of its snapshot
+ * @return hash, or 0 if dbfile couldn't be read
+ */
+guint64
+ipoddisk_snapshot_hash (const gchar *dbfile)
+{
+        guchar  buf[65536];
+        guint64 h = FNV64_INIT;
+        ssize_t rc;
+        int     fd;
+
+        fd = open(dbfile, O_RDONLY);
+        if (fd == -1)
+                return 0;
+
+        while ((rc = read(fd, buf, sizeof(buf))) > 0)
+                h = ipoddisk_fnv64(h, buf, rc);
+        close(fd);
+
+        if (rc == -1)
+                return 0;
+
+        return h ? h : 1;
+}
+
+static gchar *
+ipoddisk_snapshot_path (const gchar *mp)
+{
+        gchar   *dir;
+        gchar   *name;
+        gchar   *path;
+        guint64  h;
+
+        if (ipoddisk_opts.snapshot_dir != NULL)
+                dir = g_strdup(ipoddisk_opts.snapshot_dir);
+        else
+                dir = g_build_filename(g_get_user_cache_dir(), "ipoddisk", NULL);
+
+        h    = ipoddisk_fnv64(FNV64_INIT, (const guchar *) mp, strlen(mp));
+        name = g_strdup_printf("%016llx.snap", (unsigned long long) h);
+        path = g_build_filename(dir, name, NULL);
+
+        g_free(dir);
+        g_free(name);
+        return path;
+}
+
+static guint32
+ipoddisk_snapshot_string (GString *pool, GHashTable *offsets, const gchar *str)
+{
+        gpointer off;
+
+        if (str == NULL)
+                return IPODDISK_SNAP_NULL;
+
+        off = g_hash_table_lookup(offsets, str);
+        if (off != NULL)
+                return GPOINTER_TO_UINT(off) - 1;
+
+        off = GUINT_TO_POINTER(pool->len + 1);
+        g_hash_table_insert(offsets, (gpointer) str, off);
+        g_string_append_len(pool, str, strlen(str) + 1);
+
+        return GPOINTER_TO_UINT(off) - 1;
+}
+
+/**
+ * Writes the subtree of an iPod built from its iTunesDB to its snapshot
+ * file. Failures are reported but otherwise harmless.
+ */
+void
+ipoddisk_snapshot_save (struct ipoddisk_node *ipodnode)
+{
+        struct ipoddisk_ipod        *ipod = ipodnode->nd_data.ipod;
+        struct ipoddisk_tracks      *tt = &ipod->ipod_tracks;
+        struct ipoddisk_snap_header  hdr;
+        struct ipoddisk_snap_track  *tracks;
+        GArray                      *playlists;
+        GArray                      *members;
+        GArray                      *nodes;
+        GArray                      *ents;
+        GString                     *pool;
+        GHashTable                  *index;    /* node -> 1 + its number */
+        GHashTable                  *offsets;  /* string -> 1 + its offset */
+        gchar                       *path;
+        gchar                       *tmp;
+        gchar                       *dir;
+        FILE                        *fp;
+        guint                        nnodes;
+        guint                        i;
+        int                          ok;
+
+        if (ipod->ipod_dbhash == 0 || ipod->ipod_nodes == NULL)
+                return;
+
+        nnodes  = ipod->ipod_nodes->len + 1;
+        nodes   = g_array_sized_new(FALSE, TRUE,
+                                    sizeof(struct ipoddisk_snap_node), nnodes);
+        ents    = g_array_new(FALSE, TRUE, sizeof(struct ipoddisk_snap_ent));
+        pool    = g_string_sized_new(65536);
+        index   = g_hash_table_new(g_direct_hash, g_direct_equal);
+        offsets = g_hash_table_new(g_str_hash, g_str_equal);
+
+        tracks  = g_new0(struct ipoddisk_snap_track, MAX(tt->tt_count, 1));
+        for (i = 0; i < tt->tt_count; i++) {
+                tracks[i].sk_size     = tt->tt_size[i];
+                tracks[i].sk_mtime    = tt->tt_mtime[i];
+                tracks[i].sk_added    = tt->tt_added[i];
+                tracks[i].sk_path     = ipoddisk_snapshot_string(pool, offsets,
+                                                                 tt->tt_path[i]);
+                tracks[i].sk_title    = ipoddisk_snapshot_string(pool, offsets,
+                                                                 tt->tt_title[i]);
+                tracks[i].sk_album    = ipoddisk_snapshot_string(pool, offsets,
+                                                                 tt->tt_album[i]);
+                tracks[i].sk_artist   = ipoddisk_snapshot_string(pool, offsets,
+                                                                 tt->tt_artist[i]);
+                tracks[i].sk_genre    = ipoddisk_snapshot_string(pool, offsets,
+                                                                 tt->tt_genre[i]);
+                tracks[i].sk_track_nr = tt->tt_track_nr[i];
+                tracks[i].sk_cd_nr    = tt->tt_cd_nr[i];
+                tracks[i].sk_year     = tt->tt_year[i];
+                tracks[i].sk_compilation = tt->tt_compilation[i];
+                tracks[i].sk_played    = tt->tt_played[i];
+                tracks[i].sk_playcount = tt->tt_playcount[i];
+                tracks[i].sk_rating    = tt->tt_rating[i];
+                tracks[i].sk_length    = tt->tt_length[i];
+        }
+
+        playlists = g_array_new(FALSE, TRUE,
+                                sizeof(struct ipoddisk_snap_playlist));
+        members   = g_array_new(FALSE, TRUE, sizeof(guint32));
+        for (i = 0; i < ipod->ipod_nplaylists; i++) {
+                struct ipoddisk_playlist      *pl = &ipod->ipod_playlists[i];
+                struct ipoddisk_snap_playlist  sp;
+                guint                          j;
+
+                sp.sp_name    = ipoddisk_snapshot_string(pool, offsets,
+                                                         pl->pl_name);
+                sp.sp_ntracks = pl->pl_ntracks;
+                sp.sp_tracks  = members->len;
+                g_array_append_val(playlists, sp);
+
+                for (j = 0; j < pl->pl_ntracks; j++) {
+                        guint32 member = pl->pl_tracks[j];
+
+                        g_array_append_val(members, member);
+                }
+        }
+
+        g_hash_table_insert(index, ipodnode, GUINT_TO_POINTER(1));
+        for (i = 1; i < nnodes; i++)
+                g_hash_table_insert(index,
+                                    g_ptr_array_index(ipod->ipod_nodes, i - 1),
+                                    GUINT_TO_POINTER(i + 1));
+
+        for (i = 0; i < nnodes; i++) {
+                struct ipoddisk_node      *node;
+                struct ipoddisk_snap_node  sn;
+                guint                      j;
+
+                node = i ? g_ptr_array_index(ipod->ipod_nodes, i - 1)
+                         : ipodnode;
+
+                memset(&sn, 0, sizeof(sn));
+                sn.sn_type  = node->nd_type;
+                sn.sn_nents = node->nd_children.dir_nents;
+                sn.sn_ents  = ents->len;
+
+                if (node->nd_type == IPODDISK_NODE_LEAF)
+                        sn.sn_data = node->nd_data.track.trk_index;
+                else if (node->nd_type == IPODDISK_NODE_DEFAULT)
+                        sn.sn_data = node->nd_data.view.vw_pending;
+                else if (node->nd_type == IPODDISK_NODE_MANIFEST)
+                        sn.sn_data = node->nd_data.manifest->mf_type |
+                                (node->nd_data.manifest->mf_album ?
+                                 IPODDISK_SNAP_ALBUM : 0);
+                g_array_append_val(nodes, sn);
+
+                for (j = 0; j < node->nd_children.dir_nents; j++) {
+                        struct ipoddisk_dirent   *de;
+                        struct ipoddisk_snap_ent  se;
+
+                        de = &node->nd_children.dir_ents[j];
+                        se.se_name = ipoddisk_snapshot_string(pool, offsets,
+                                                              de->de_name);
+                        se.se_hash = de->de_hash;
+                        se.se_ndup = de->de_ndup;
+                        se.se_node = GPOINTER_TO_UINT(
+                                g_hash_table_lookup(index, de->de_node)) - 1;
+                        g_array_append_val(ents, se);
+                }
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.sh_magic, IPODDISK_SNAP_MAGIC, sizeof(hdr.sh_magic));
+        hdr.sh_version   = IPODDISK_SNAP_VERSION;
+        hdr.sh_byteorder = IPODDISK_SNAP_BYTEORDER;
+        hdr.sh_dbsize    = ipod->ipod_dbsize;
+        hdr.sh_dbmtime   = ipod->ipod_dbmtime;
+        hdr.sh_dbhash    = ipod->ipod_dbhash;
+        hdr.sh_nnodes    = nodes->len;
+        hdr.sh_nents     = ents->len;
+        hdr.sh_ntracks   = tt->tt_count;
+        hdr.sh_nplaylists = playlists->len;
+        hdr.sh_nmembers  = members->len;
+        hdr.sh_strsize   = pool->len;
+
+        path = ipoddisk_snapshot_path(ipod->ipod_mp);
+        tmp  = g_strdup_printf("%s.%d", path, (int) getpid());
+        dir  = g_path_get_dirname(path);
+        g_mkdir_with_parents(dir, 0700);
+
+        /* write a new file and rename it over the old one, in case
+         * another mount is mapping it right now */
+        fp = fopen(tmp, "wb");
+        ok = fp != NULL &&
+             fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fwrite(nodes->data, sizeof(struct ipoddisk_snap_node),
+                    nodes->len, fp) == nodes->len &&
+             fwrite(tracks, sizeof(struct ipoddisk_snap_track),
+                    tt->tt_count, fp) == tt->tt_count &&
+             fwrite(playlists->data, sizeof(struct ipoddisk_snap_playlist),
+                    playlists->len, fp) == playlists->len &&
+             fwrite(members->data, sizeof(guint32),
+                    members->len, fp) == members->len &&
+             fwrite(ents->data, sizeof(struct ipoddisk_snap_ent),
+                    ents->len, fp) == ents->len &&
+             fwrite(pool->str, 1, pool->len, fp) == pool->len;
+        if (fp != NULL && fclose(fp) != 0)
+                ok = 0;
+        if (!ok || rename(tmp, path) == -1) {
+                fprintf(stderr, "ipoddisk: failed to write snapshot %s: %s\n",
+                        path, strerror(errno));
+                unlink(tmp);
+        }
+
+        g_free(dir);
+        g_free(tmp);
+        g_free(path);
+        g_hash_table_destroy(offsets);
+        g_hash_table_destroy(index);
+        g_string_free(pool, TRUE);
+        g_array_free(ents, TRUE);
+        g_array_free(nodes, TRUE);
+        g_free(tracks);
+        g_array_free(playlists, TRUE);
+        g_array_free(members, TRUE);
+
+        return;
+}
+
+/**
+ * Resolves a string offset written by ipoddisk_snapshot_string
+ * @return FALSE if off is out of range
+ */
+static gboolean
+ipoddisk_snapshot_ptr (const gchar *pool, guint64 strsize, guint32 off,
+                       gchar **strp)
+{
+        if (off == IPODDISK_SNAP_NULL) {
+                *strp = NULL;
+                return TRUE;
+        }
+
+        if (off >= strsize)
+                return FALSE;
+
+        *strp = (gchar *) pool + off;  /* the pool ends with a NUL */
+        return TRUE;
+}
+
+/**
+ * Maps the snapshot of the iPod mounted at mp, if it was built from an
+ * iTunesDB with the given size, mtime and hash
+ * @return IPOD node of the subtree, or NULL if there is no usable snapshot
+ */
+struct ipoddisk_node *
+ipoddisk_snapshot_load (const gchar *mp, off_t dbsize, time_t dbmtime,
+                        guint64 dbhash)
+{
+        const struct ipoddisk_snap_header *hdr;
+        const struct ipoddisk_snap_node   *sn;
+        const struct ipoddisk_snap_track  *stk;
+        const struct ipoddisk_snap_playlist *sp;
+        const guint32                     *members;
+        const struct ipoddisk_snap_ent    *se;
+        const gchar                       *pool;
+        struct ipoddisk_arena             *arena = NULL;
+        struct ipoddisk_ipod              *ipod;
+        struct ipoddisk_tracks            *tt;
+        struct ipoddisk_node              *nodes;
+        struct ipoddisk_dirent            *ents;
+        struct stat                        st;
+        gchar                             *path;
+        void                              *map;
+        guint64                            expect;
+        guint32                            i;
+        int                                fd;
+
+        if (dbhash == 0)
+                return NULL;
+
+        path = ipoddisk_snapshot_path(mp);
+        fd   = open(path, O_RDONLY);
+        g_free(path);
+        if (fd == -1)
+                return NULL;
+
+        if (fstat(fd, &st) == -1 ||
+            st.st_size < (off_t) sizeof(struct ipoddisk_snap_header)) {
+                close(fd);
+                return NULL;
+        }
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+                return NULL;
+
+        hdr = map;
+        if (memcmp(hdr->sh_magic, IPODDISK_SNAP_MAGIC,
+                   sizeof(hdr->sh_magic)) != 0 ||
+            hdr->sh_version   != IPODDISK_SNAP_VERSION ||
+            hdr->sh_byteorder != IPODDISK_SNAP_BYTEORDER ||
+            hdr->sh_dbsize    != (guint64) dbsize ||
+            hdr->sh_dbmtime   != (gint64) dbmtime ||
+            hdr->sh_dbhash    != dbhash ||
+            hdr->sh_nnodes    == 0)
+                goto fail;
+
+        expect = sizeof(*hdr) +
+                 (guint64) hdr->sh_nnodes * sizeof(*sn) +
+                 (guint64) hdr->sh_ntracks * sizeof(*stk) +
+                 (guint64) hdr->sh_nplaylists * sizeof(*sp) +
+                 (guint64) hdr->sh_nmembers * sizeof(*members) +
+                 (guint64) hdr->sh_nents * sizeof(*se) +
+                 hdr->sh_strsize;
+        if (expect != (guint64) st.st_size || hdr->sh_strsize == 0)
+                goto fail;
+
+        sn   = (const struct ipoddisk_snap_node *) (hdr + 1);
+        stk  = (const struct ipoddisk_snap_track *) (sn + hdr->sh_nnodes);
+        sp   = (const struct ipoddisk_snap_playlist *) (stk + hdr->sh_ntracks);
+        members = (const guint32 *) (sp + hdr->sh_nplaylists);
+        se   = (const struct ipoddisk_snap_ent *) (members + hdr->sh_nmembers);
+        pool = (const gchar *) (se + hdr->sh_nents);
+        if (pool[hdr->sh_strsize - 1] != '\0' ||
+            sn[0].sn_type != IPODDISK_NODE_IPOD)
+                goto fail;
+
+        arena = ipoddisk_arena_new();
+        nodes = ipoddisk_arena_alloc(arena, hdr->sh_nnodes * sizeof(*nodes));
+        ents  = ipoddisk_arena_alloc(arena, hdr->sh_nents * sizeof(*ents));
+        ipod  = ipoddisk_arena_alloc(arena, sizeof(*ipod));
+        tt    = &ipod->ipod_tracks;
+        ipoddisk_tracks_alloc(arena, tt, hdr->sh_ntracks);
+
+        for (i = 0; i < hdr->sh_ntracks; i++) {
+                if (!ipoddisk_snapshot_ptr(pool, hdr->sh_strsize,
+                                           stk[i].sk_path, &tt->tt_path[i]) ||
+                    tt->tt_path[i] == NULL || *tt->tt_path[i] != '/' ||
+                    !ipoddisk_snapshot_ptr(pool, hdr->sh_strsize,
+                                           stk[i].sk_title, &tt->tt_title[i]) ||
+                    !ipoddisk_snapshot_ptr(pool, hdr->sh_strsize,
+                                           stk[i].sk_album, &tt->tt_album[i]) ||
+                    !ipoddisk_snapshot_ptr(pool, hdr->sh_strsize,
+                                           stk[i].sk_artist, &tt->tt_artist[i]) ||
+                    !ipoddisk_snapshot_ptr(pool, hdr->sh_strsize,
+                                           stk[i].sk_genre, &tt->tt_genre[i]))
+                        goto fail;
+
+                tt->tt_compilation[i] = stk[i].sk_compilation;
+                tt->tt_size[i]     = stk[i].sk_size;
+                tt->tt_mtime[i]    = stk[i].sk_mtime;
+                tt->tt_added[i]    = stk[i].sk_added;
+                tt->tt_track_nr[i] = stk[i].sk_track_nr;
+                tt->tt_cd_nr[i]    = stk[i].sk_cd_nr;
+                tt->tt_year[i]     = stk[i].sk_year;
+                tt->tt_played[i]   = stk[i].sk_played;
+                tt->tt_playcount[i] = stk[i].sk_playcount;
+                tt->tt_rating[i]   = stk[i].sk_rating;
+                tt->tt_length[i]   = stk[i].sk_length;
+        }
+        tt->tt_count = hdr->sh_ntracks;
+
+        ipod->ipod_playlists = ipoddisk_arena_alloc(arena,
+                                  hdr->sh_nplaylists * sizeof(*ipod->ipod_playlists));
+        for (i = 0; i < hdr->sh_nplaylists; i++) {
+                struct ipoddisk_playlist *pl = &ipod->ipod_playlists[i];
+                guint32                   j;
+
+                if (!ipoddisk_snapshot_ptr(pool, hdr->sh_strsize,
+                                           sp[i].sp_name, &pl->pl_name) ||
+                    (guint64) sp[i].sp_tracks + sp[i].sp_ntracks >
+                    hdr->sh_nmembers)
+                        goto fail;
+
+                for (j = 0; j < sp[i].sp_ntracks; j++)
+                        if (members[sp[i].sp_tracks + j] >= hdr->sh_ntracks)
+                                goto fail;
+
+                /* guint and guint32 are the same on everything we run on */
+                pl->pl_tracks  = (guint *) members + sp[i].sp_tracks;
+                pl->pl_ntracks = sp[i].sp_ntracks;
+        }
+        ipod->ipod_nplaylists = hdr->sh_nplaylists;
+
+        for (i = 0; i < hdr->sh_nents; i++) {
+                if (se[i].se_name >= hdr->sh_strsize ||
+                    se[i].se_node == 0 || se[i].se_node >= hdr->sh_nnodes)
+                        goto fail;
+
+                ents[i].de_name = (gchar *) pool + se[i].se_name;
+                ents[i].de_hash = se[i].se_hash;
+                ents[i].de_ndup = se[i].se_ndup;
+                ents[i].de_node = &nodes[se[i].se_node];
+        }
+
+        for (i = 0; i < hdr->sh_nnodes; i++) {
+                struct ipoddisk_node *node = &nodes[i];
+
+                if (sn[i].sn_type > IPODDISK_NODE_MANIFEST ||
+                    (guint64) sn[i].sn_ents + sn[i].sn_nents > hdr->sh_nents)
+                        goto fail;
+
+                node->nd_type = sn[i].sn_type;
+
+                if (node->nd_type == IPODDISK_NODE_LEAF) {
+                        if (sn[i].sn_nents != 0 ||
+                            sn[i].sn_data >= hdr->sh_ntracks)
+                                goto fail;
+
+                        node->nd_data.track.trk_ipod  = ipod;
+                        node->nd_data.track.trk_index = sn[i].sn_data;
+                        tt->tt_leaf[sn[i].sn_data]    = node;
+                } else if (node->nd_type == IPODDISK_NODE_MANIFEST) {
+                        struct ipoddisk_manifest *mf;
+                        guint32                   type;
+
+                        type = sn[i].sn_data & ~IPODDISK_SNAP_ALBUM;
+                        if (sn[i].sn_nents != 0 ||
+                            type > IPODDISK_MANIFEST_JSON)
+                                goto fail;
+
+                        /* mf_dir is set from the entries below */
+                        mf = ipoddisk_arena_alloc(arena, sizeof(*mf));
+                        mf->mf_ipod  = ipod;
+                        mf->mf_arena = arena;
+                        mf->mf_type  = type;
+                        mf->mf_album = (sn[i].sn_data &
+                                        IPODDISK_SNAP_ALBUM) != 0;
+                        node->nd_data.manifest = mf;
+                } else {
+                        if (node->nd_type == IPODDISK_NODE_SEARCH) {
+                                if (sn[i].sn_nents != 0)
+                                        goto fail;
+                                node->nd_data.ipod = ipod;
+                        } else if (node->nd_type == IPODDISK_NODE_DEFAULT &&
+                                   sn[i].sn_data != IPODDISK_VIEW_NONE) {
+                                if (sn[i].sn_data > IPODDISK_VIEW_TOP_RATED)
+                                        goto fail;
+                                node->nd_data.view.vw_ipod    = ipod;
+                                node->nd_data.view.vw_pending = sn[i].sn_data;
+                        }
+
+                        node->nd_children.dir_ents  = ents + sn[i].sn_ents;
+                        node->nd_children.dir_nents =
+                        node->nd_children.dir_size  = sn[i].sn_nents;
+                        ipoddisk_dir_index(arena, &node->nd_children);
+                }
+        }
+
+        for (i = 0; i < hdr->sh_ntracks; i++)
+                if (tt->tt_leaf[i] == NULL)
+                        goto fail;
+
+        /* manifests have one parent, the directory they list */
+        for (i = 0; i < hdr->sh_nnodes; i++) {
+                struct ipoddisk_dir *dir = &nodes[i].nd_children;
+                guint                j;
+
+                for (j = 0; j < dir->dir_nents; j++) {
+                        struct ipoddisk_node *child = dir->dir_ents[j].de_node;
+
+                        if (child->nd_type != IPODDISK_NODE_MANIFEST)
+                                continue;
+                        if (child->nd_data.manifest->mf_dir != NULL)
+                                goto fail;
+                        child->nd_data.manifest->mf_dir = &nodes[i];
+                }
+        }
+        for (i = 0; i < hdr->sh_nnodes; i++)
+                if (nodes[i].nd_type == IPODDISK_NODE_MANIFEST &&
+                    nodes[i].nd_data.manifest->mf_dir == NULL)
+                        goto fail;
+
+        nodes[0].nd_data.ipod = ipod;
+        ipod->ipod_arena      = arena;
+        ipod->ipod_snap       = map;
+        ipod->ipod_snapsize   = st.st_size;
+
+        return &nodes[0];
+
+fail:
+        if (arena != NULL)
+                ipoddisk_arena_free(arena);
+        munmap(map, st.st_size);
+        return NULL;
+}
+
+/**
+ * Unmaps the snapshot a subtree was loaded from; the rest of the subtree
+ * goes with its arena
+ */
+void
+ipoddisk_snapshot_free (struct ipoddisk_ipod *ipod)
+{
+        munmap(ipod->ipod_snap, ipod->ipod_snapsize);
+        ipod->ipod_snap = NULL;
+
+        return;
+}
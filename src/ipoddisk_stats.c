@@ -0,0 +1,316 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+/*
+ * Operation counters and latency histograms. Timing an operation costs
+ * two clock reads and a few atomic increments, so they are kept all the
+ * time and from every thread without taking a lock. They are read as
+ * /.ipoddisk/stats within the mount, and dumped to stderr on SIGUSR1.
+ *
+ * Counters are 64 bits wide, as a mount that stays up for long serves
+ * more reads than 32 bits hold. Where the CPU can't update 64 bits
+ * atomically, as on 32-bit PowerPC, a counter is two 32-bit words: the
+ * low one is added to and carries into the high one every 2^31 counts.
+ * Bit 31 of the low word flips with every carry, so a reader that finds
+ * it out of step with the high word knows a carry is on its way.
+ *
+ * Histogram buckets are powers of two of microseconds: bucket 0 counts
+ * operations that took less than 1us, bucket b those that took at least
+ * 2^(b-1)us and less than 2^b us, and the last one anything longer.
+ */
+
+#include <signal.h>
+#include <time.h>
+
+#include "ipoddisk.h"
+
+#define IPODDISK_STATS_BUCKETS  24      /* the last from 2^22us, ~4s */
+
+struct ipoddisk_op_stats {
+        volatile gint    os_max;        /* in us */
+        ipoddisk_counter os_buckets[IPODDISK_STATS_BUCKETS];
+};
+
+static struct ipoddisk_op_stats op_stats[IPODDISK_OP_MAX];
+
+static const char *op_names[IPODDISK_OP_MAX] = {
+        [IPODDISK_OP_GETATTR] = "getattr",
+        [IPODDISK_OP_LOOKUP]  = "lookup",
+        [IPODDISK_OP_READDIR] = "readdir",
+        [IPODDISK_OP_OPEN]    = "open",
+        [IPODDISK_OP_READ]    = "read",
+        [IPODDISK_OP_STATFS]  = "statfs",
+        [IPODDISK_OP_TREE]    = "tree",
+        [IPODDISK_OP_DEVICE]  = "device",
+};
+
+#define IPODDISK_COUNT_LOW       0x7fffffff
+
+/**
+ * Adds one to a counter
+ */
+void
+ipoddisk_count (ipoddisk_counter *counter)
+{
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+        __sync_fetch_and_add(counter, 1);
+#else
+        gint low;
+
+        low = g_atomic_int_add(&counter->c_low, 1);
+        if ((low & IPODDISK_COUNT_LOW) == IPODDISK_COUNT_LOW)
+                g_atomic_int_inc(&counter->c_high);
+#endif
+        return;
+}
+
+/**
+ * Reads a counter other threads may be adding to
+ */
+guint64
+ipoddisk_count_get (ipoddisk_counter *counter)
+{
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_8
+        return __sync_fetch_and_add(counter, 0);
+#else
+        guint high;
+        guint low;
+
+        do {
+                high = g_atomic_int_get(&counter->c_high);
+                low  = g_atomic_int_get(&counter->c_low);
+        } while (high != (guint) g_atomic_int_get(&counter->c_high));
+
+        /* carried out of low, but not yet into high */
+        if ((high & 1) != low >> 31)
+                high++;
+
+        return (guint64) high << 31 | (low & IPODDISK_COUNT_LOW);
+#endif
+}
+
+/**
+ * Reads the clock operations are timed with
+ * @return microseconds since some fixed point
+ */
+guint64
+ipoddisk_stats_clock (void)
+{
+#ifdef CLOCK_MONOTONIC
+        struct timespec ts;
+
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+                return (guint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+        {
+                struct timeval tv;
+
+                gettimeofday(&tv, NULL);
+                return (guint64) tv.tv_sec * 1000000 + tv.tv_usec;
+        }
+}
+
+/**
+ * Counts an operation of the given type that began at start, as read
+ * from ipoddisk_stats_clock
+ */
+void
+ipoddisk_stats_add (ipoddisk_op_type op, guint64 start)
+{
+        struct ipoddisk_op_stats *os = &op_stats[op];
+        guint64                   us;
+        gint                      max;
+        int                       b = 0;
+
+        us = ipoddisk_stats_clock() - start;
+        if ((gint64) us < 0)
+                us = 0;  /* gettimeofday went back */
+        if (us > G_MAXINT)
+                us = G_MAXINT;
+
+        while (b < IPODDISK_STATS_BUCKETS - 1 && (us >> b) != 0)
+                b++;
+
+        ipoddisk_count(&os->os_buckets[b]);
+
+        do {
+                max = g_atomic_int_get(&os->os_max);
+        } while ((gint) us > max &&
+                 !g_atomic_int_compare_and_exchange(&os->os_max, max,
+                                                    (gint) us));
+
+        return;
+}
+
+/**
+ * Estimates a percentile from a histogram
+ * @return upper bound in us of the bucket holding it, or the longest
+ *         time seen if less; 0 if empty
+ */
+static guint
+ipoddisk_stats_percentile (const guint64 *buckets, guint64 count, gint max,
+                           int pct)
+{
+        guint64 want = count / 100 * pct + (count % 100 * pct + 99) / 100;
+        guint64 seen = 0;
+        int     b;
+
+        for (b = 0; b < IPODDISK_STATS_BUCKETS; b++) {
+                seen += buckets[b];
+                if (seen >= want && seen > 0)
+                        return MIN(1U << b, (guint) max);
+        }
+
+        return 0;
+}
+
+/**
+ * Writes out all counters, as the stats file shows them. Counters keep
+ * moving while they are read, so the figures of an operation may be off
+ * by the operations that finished meanwhile.
+ * @return the text, to be freed with g_string_free
+ */
+GString *
+ipoddisk_stats_text (void)
+{
+        GString *text = g_string_new(NULL);
+        int      op;
+        int      b;
+
+        g_string_append(text, "# op        count   p50_us   p90_us   "
+                              "p99_us   max_us\n");
+        for (op = 0; op < IPODDISK_OP_MAX; op++) {
+                struct ipoddisk_op_stats *os = &op_stats[op];
+                guint64                   buckets[IPODDISK_STATS_BUCKETS];
+                guint64                   count = 0;
+                gint                      max;
+
+                for (b = 0; b < IPODDISK_STATS_BUCKETS; b++) {
+                        buckets[b] = ipoddisk_count_get(&os->os_buckets[b]);
+                        count += buckets[b];
+                }
+                max = g_atomic_int_get(&os->os_max);
+
+                g_string_append_printf(text, "%-8s %8" G_GUINT64_FORMAT
+                                             " %8u %8u %8u %8d\n",
+                        op_names[op], count,
+                        ipoddisk_stats_percentile(buckets, count, max, 50),
+                        ipoddisk_stats_percentile(buckets, count, max, 90),
+                        ipoddisk_stats_percentile(buckets, count, max, 99),
+                        max);
+        }
+
+        g_string_append_printf(text, "\n# op      operations taking < 1us, "
+                                     "< 2us, < 4us, ... and >= %uus\n",
+                               1U << (IPODDISK_STATS_BUCKETS - 2));
+        for (op = 0; op < IPODDISK_OP_MAX; op++) {
+                g_string_append_printf(text, "%-8s", op_names[op]);
+                for (b = 0; b < IPODDISK_STATS_BUCKETS; b++)
+                        g_string_append_printf(text, " %" G_GUINT64_FORMAT,
+                                ipoddisk_count_get(&op_stats[op].os_buckets[b]));
+                g_string_append_c(text, '\n');
+        }
+
+        g_string_append_printf(text, "\nreadahead hits %" G_GUINT64_FORMAT
+                                     " waits %" G_GUINT64_FORMAT
+                                     " misses %" G_GUINT64_FORMAT
+                                     " blocks %" G_GUINT64_FORMAT "\n",
+                               ipoddisk_count_get(&ipoddisk_ra_stats.ra_hits),
+                               ipoddisk_count_get(&ipoddisk_ra_stats.ra_waits),
+                               ipoddisk_count_get(&ipoddisk_ra_stats.ra_misses),
+                               ipoddisk_count_get(&ipoddisk_ra_stats.ra_blocks));
+        g_string_append_printf(text, "cache hits %" G_GUINT64_FORMAT
+                                     " misses %" G_GUINT64_FORMAT
+                                     " evictions %" G_GUINT64_FORMAT "\n",
+                               ipoddisk_count_get(&ipoddisk_bc_stats.bc_hits),
+                               ipoddisk_count_get(&ipoddisk_bc_stats.bc_misses),
+                               ipoddisk_count_get(&ipoddisk_bc_stats.bc_evictions));
+        g_string_append_printf(text, "paths hits %" G_GUINT64_FORMAT
+                                     " misses %" G_GUINT64_FORMAT
+                                     " walks %" G_GUINT64_FORMAT "\n",
+                               ipoddisk_count_get(&ipoddisk_path_stats.ps_hits),
+                               ipoddisk_count_get(&ipoddisk_path_stats.ps_misses),
+                               ipoddisk_count_get(&ipoddisk_path_stats.ps_walks));
+
+        return text;
+}
+
+/**
+ * Copies what there is of [off, off + size) of a stats text into buf
+ * @return bytes copied
+ */
+size_t
+ipoddisk_stats_read (GString *text, char *buf, size_t size, off_t off)
+{
+        size_t n;
+
+        if (off < 0 || (size_t) off >= text->len)
+                return 0;
+
+        n = MIN(size, text->len - off);
+        memcpy(buf, text->str + off, n);
+
+        return n;
+}
+
+/**
+ * Blocks SIGUSR1, to be called before any thread is created so that
+ * every thread inherits it and only the stats thread takes the signal
+ */
+void
+ipoddisk_stats_init (void)
+{
+        sigset_t set;
+
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        return;
+}
+
+static void *
+ipoddisk_stats_thread (void *arg)
+{
+        sigset_t set;
+        int      sig;
+
+        UNUSED (arg);
+
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+
+        for (;;) {
+                GString *text;
+
+                if (sigwait(&set, &sig) != 0)
+                        continue;
+
+                text = ipoddisk_stats_text();
+                fputs(text->str, stderr);
+                fflush(stderr);
+                g_string_free(text, TRUE);
+        }
+
+        return NULL;
+}
+
+/**
+ * Starts the thread dumping the stats on SIGUSR1
+ */
+void
+ipoddisk_stats_start (void)
+{
+        pthread_t      thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, ipoddisk_stats_thread, NULL) != 0)
+                fprintf(stderr, "failed to start stats thread, "
+                                "SIGUSR1 ignored\n");
+        pthread_attr_destroy(&attr);
+
+        return;
+}
@@ -0,0 +1,123 @@
+/*
+ * vim:expandtab:shiftwidth=8:tabstop=8:
+ */
+
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "ipoddisk.h"
+
+/* How soon to look again at an iTunesDB that is still being written */
+#define IPODDISK_SETTLE_MS      1000
+
+#ifdef __linux__
+static void
+ipoddisk_watch_add (const gchar *dbpath, gpointer arg)
+{
+        int    ifd = GPOINTER_TO_INT(arg);
+        gchar *dir;
+
+        /* watch the directory: iTunesDB may be replaced by a rename */
+        dir = g_path_get_dirname(dbpath);
+        inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                                    IN_CREATE | IN_DELETE);
+        g_free(dir);
+        return;
+}
+#endif
+
+/**
+ * Waits for iTunesDB changes and rebuilds the affected iPods, and for
+ * iPods to be mounted and unmounted. Changes are picked up from inotify
+ * and the mount table where available, and by checking every
+ * reload_interval seconds otherwise.
+ */
+static void *
+ipoddisk_watch_thread (void *arg)
+{
+        int ifd = -1;
+        int mfd = -1;
+        int unsettled = 0;
+
+        UNUSED (arg);
+
+#ifdef __linux__
+        ifd = inotify_init();
+        if (ifd != -1)
+                fcntl(ifd, F_SETFL, O_NONBLOCK);
+
+        /* polls with POLLPRI whenever something is mounted or unmounted
+         * since the last poll */
+        mfd = open(IPODDISK_MOUNTINFO, O_RDONLY);
+#endif
+
+        for (;;) {
+                int timeout = unsettled ? IPODDISK_SETTLE_MS
+                                        : ipoddisk_opts.reload_interval * 1000;
+
+#ifdef __linux__
+                if (ifd != -1 || mfd != -1) {
+                        struct pollfd pfd[2];
+                        int           changed = 0;
+
+                        /* iPods come and go with reloads, re-adding an
+                         * existing watch is harmless */
+                        if (ifd != -1)
+                                ipoddisk_foreach_dbpath(ipoddisk_watch_add,
+                                                        GINT_TO_POINTER(ifd));
+
+                        pfd[0].fd      = ifd;
+                        pfd[0].events  = POLLIN;
+                        pfd[0].revents = 0;
+                        pfd[1].fd      = mfd;
+                        pfd[1].events  = POLLPRI;
+                        pfd[1].revents = 0;
+                        if (poll(pfd, 2, timeout) > 0) {
+                                if (pfd[1].revents & (POLLPRI | POLLERR)) {
+                                        ipoddisk_rescan_ipods();
+                                        changed = 1;
+                                }
+                                if (pfd[0].revents & POLLIN) {
+                                        char buf[4096];
+
+                                        while (read(ifd, buf, sizeof(buf)) > 0)
+                                                ;
+                                        /* let the writer finish before
+                                         * looking */
+                                        unsettled = 1;
+                                        changed = 1;
+                                }
+                        }
+                        if (changed)
+                                continue;
+                } else
+#endif
+                poll(NULL, 0, timeout);
+
+                /* the mount table says nothing of iPods that failed to
+                 * attach becoming readable */
+                if (mfd == -1 || ipoddisk_rescan_pending())
+                        ipoddisk_rescan_ipods();
+                unsettled = ipoddisk_reload_ipods();
+        }
+
+        return NULL;
+}
+
+void
+ipoddisk_watch_start (void)
+{
+        pthread_t      thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, ipoddisk_watch_thread, NULL) != 0)
+                fprintf(stderr, "failed to start iTunesDB watcher, "
+                                "reload and hotplug disabled\n");
+        pthread_attr_destroy(&attr);
+
+        return;
+}